@@ -0,0 +1,120 @@
+/*
+ * Fuzz target: request head and body parsing.
+ *
+ * The input's first byte picks a read size and the rest is the request
+ * stream. The head is parsed in one call with the portable scanner, in
+ * one call with the fastest scanner the CPU has, and again as it would
+ * arrive in reads of that size; all three must agree field for field.
+ * A complete head's body is then parsed, checking every payload span
+ * lies inside the input.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http_core.h"
+
+/* Parse buf[0..len) as a head, feeding it piece bytes at a time (0: all at once) */
+static int parse_head(http_parser_t *p, const char *buf, size_t len, size_t piece) {
+    int r = HTTP_PARSE_AGAIN;
+    http_parser_init(p);
+    if (piece == 0) {
+        return http_parse_head(p, buf, len);
+    }
+    for (size_t have = piece; r == HTTP_PARSE_AGAIN; have += piece) {
+        r = http_parse_head(p, buf, have < len ? have : len);
+        if (have >= len) {
+            break;
+        }
+    }
+    return r;
+}
+
+/* Everything a caller reads from a finished head must match */
+static void same_head(const http_parser_t *a, const http_parser_t *b, int r) {
+    if (r != HTTP_PARSE_DONE) {
+        return;
+    }
+    if (a->pos != b->pos || a->method_off != b->method_off || a->method_len != b->method_len ||
+        a->target_off != b->target_off || a->target_len != b->target_len ||
+        a->version_minor != b->version_minor || a->num_headers != b->num_headers ||
+        a->keep_alive != b->keep_alive || a->chunked != b->chunked ||
+        a->expect_continue != b->expect_continue || a->content_length != b->content_length ||
+        a->state != b->state ||
+        memcmp(a->headers, b->headers, a->num_headers * sizeof(a->headers[0])) != 0) {
+        abort();
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static int initialized = 0;
+    static http_scanner_t best;
+    if (!initialized) {
+        http_scanner_init();
+        best = http_scanner;
+        initialized = 1;
+    }
+    if (size < 1) {
+        return 0;
+    }
+
+    size_t piece = data[0] % 64;
+    const char *buf = (const char *)data + 1;
+    size_t len = size - 1;
+    http_parser_t scalar;
+    http_parser_t fast;
+    http_parser_t split;
+
+    http_scanner = http_scanner_scalar;
+    int r = parse_head(&scalar, buf, len, 0);
+    http_scanner = best;
+    if (parse_head(&fast, buf, len, 0) != r || parse_head(&split, buf, len, piece) != r) {
+        abort();
+    }
+    same_head(&scalar, &fast, r);
+    same_head(&scalar, &split, r);
+    if (r != HTTP_PARSE_DONE) {
+        return 0;
+    }
+
+    /* Parsed fields stay inside the head */
+    if (scalar.pos > len || scalar.method_off + scalar.method_len > scalar.pos ||
+        scalar.target_off + scalar.target_len > scalar.pos) {
+        abort();
+    }
+    for (size_t i = 0; i < scalar.num_headers; i++) {
+        const http_header_t *h = &scalar.headers[i];
+        if (h->name_off + h->name_len > scalar.pos || h->value_off + h->value_len > scalar.pos) {
+            abort();
+        }
+        header_has_token(buf + h->value_off, h->value_len, "close");
+    }
+
+    /* The body, in reads of the same size */
+    size_t off = scalar.pos;
+    size_t step = piece ? piece : len;
+    size_t payload = 0;
+    while (scalar.state != PS_DONE && off < len) {
+        size_t avail = len - off < step ? len - off : step;
+        size_t consumed;
+        size_t data_off = 0;
+        size_t data_len;
+        int b = http_parse_body(&scalar, buf + off, avail, &consumed, &data_off, &data_len);
+        if (b == HTTP_PARSE_ERROR) {
+            break;
+        }
+        if (consumed > avail || (data_len && data_off + data_len > consumed)) {
+            abort();
+        }
+        payload += data_len;
+        if (consumed == 0 && b != HTTP_PARSE_DONE) {
+            abort();
+        }
+        off += consumed;
+    }
+    if (!scalar.chunked && payload > scalar.content_length) {
+        abort();
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Fuzz target: request path checks.
+ *
+ * The input is a request path. Whatever is_safe_path() accepts must be
+ * absolute and must never climb above the document root when its
+ * segments are resolved, before or after percent-decoding.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http_core.h"
+
+/* Resolve "." and ".." segments; 0 if the path climbs above the root */
+static int stays_under_root(const char *path) {
+    long depth = 0;
+    while (*path) {
+        while (*path == '/') {
+            path++;
+        }
+        size_t len = strcspn(path, "/");
+        if (len == 2 && path[0] == '.' && path[1] == '.') {
+            if (--depth < 0) {
+                return 0;
+            }
+        } else if (len > 0 && !(len == 1 && path[0] == '.')) {
+            depth++;
+        }
+        path += len;
+    }
+    return 1;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    char *path = malloc(size + 1);
+    char *decoded = malloc(size + 1);
+    if (!path || !decoded) {
+        abort();
+    }
+    memcpy(path, data, size);
+    path[size] = '\0';
+
+    if (is_safe_path(path) && (path[0] != '/' || !stays_under_root(path))) {
+        abort();
+    }
+    url_decode(decoded, size + 1, path, strlen(path));
+    if (is_safe_path(decoded) && (decoded[0] != '/' || !stays_under_root(decoded))) {
+        abort();
+    }
+
+    free(path);
+    free(decoded);
+    return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Fuzz target: query strings and percent-decoding.
+ *
+ * The input is a query string. Every parameter must be a slice of it, each
+ * key must find a value through query_get(), and url_decode() must stay
+ * within and terminate destinations of every small size.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http_core.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    const char *q = (const char *)data;
+    query_params_t params;
+    arena_t arena = {NULL, NULL, NULL, NULL};
+
+    parse_query_string(q, size, &params, &arena);
+    if (params.count > MAX_QUERY_PARAMS) {
+        abort();
+    }
+    for (size_t i = 0; i < params.count; i++) {
+        const query_param_t *param = &params.params[i];
+        if (param->key < q || param->key + param->key_len > q + size ||
+            param->value < q || param->value + param->value_len > q + size) {
+            abort();
+        }
+
+        /* Keys that decode to a C string are found again */
+        char key[256];
+        if (param->key_len >= sizeof(key)) {
+            continue;
+        }
+        size_t key_len = url_decode(key, sizeof(key), param->key, param->key_len);
+        if (key_len > param->key_len || key[key_len] != '\0') {
+            abort();
+        }
+        if (strlen(key) == key_len) {
+            const char *value = query_get(&params, key);
+            if (!value || strlen(value) > size) {
+                abort();
+            }
+        }
+    }
+
+    /* Truncating decodes */
+    for (size_t dst_size = 1; dst_size <= 16; dst_size++) {
+        char dst[16];
+        size_t n = url_decode(dst, dst_size, q, size);
+        if (n >= dst_size || dst[n] != '\0') {
+            abort();
+        }
+    }
+    arena_reset(&arena);
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Fuzz target: response building and the scatter/gather view of it.
+ *
+ * The input is a program of response operations: appends, formatted
+ * appends, borrowed and owned segments and file ranges. A flat copy of
+ * the expected bytes is kept alongside. The response is then walked the
+ * way the server sends it, in short writes of varying size, and the
+ * iovecs must reproduce the copy exactly, with file ranges in place.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http_core.h"
+
+#define FILE_BYTE '#'   /* stands in for file data in the expected copy */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    response_t res;
+    arena_t arena = {NULL, NULL, NULL, NULL};
+    size_t expected_len = 0;
+    char *expected = NULL;
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+
+    if (response_init(&res, 64) < 0) {
+        return 0;
+    }
+    res.arena = &arena;
+    expected = malloc(size / 2 * 255 + size + 1);  /* each op adds at most 255 bytes */
+    if (!expected) {
+        abort();
+    }
+
+    while (end - p >= 2) {
+        int op = p[0] % 6;
+        size_t n = p[1];
+        p += 2;
+        if (n > (size_t)(end - p)) {
+            n = (size_t)(end - p);
+        }
+        const char *bytes = (const char *)p;
+        int added = 0;
+        switch (op) {
+            case 0:
+                added = response_append(&res, bytes, n) == 0;
+                break;
+            case 1:
+                /* %.*s stops at a NUL */
+                n = strnlen(bytes, n);
+                added = response_printf(&res, "%.*s", (int)n, bytes) == 0;
+                break;
+            case 2:
+                added = response_add_ref(&res, bytes, n) == 0;
+                break;
+            case 3: {
+                char *owned = malloc(n ? n : 1);
+                if (!owned) {
+                    abort();
+                }
+                memcpy(owned, bytes, n);
+                added = response_add_owned(&res, owned, n, free) == 0;
+                break;
+            }
+            case 4: {
+                char *copy = response_alloc(&res, n);
+                if (copy) {
+                    memcpy(copy, bytes, n);
+                    added = response_add_ref(&res, copy, n) == 0;
+                }
+                break;
+            }
+            case 5:
+                /* A file range consumes no input; n only sets its length */
+                if (response_add_file_range(&res, (off_t)n * 4096, n) == 0) {
+                    memset(expected + expected_len, FILE_BYTE, n);
+                    expected_len += n;
+                }
+                continue;
+        }
+        if (added) {
+            memcpy(expected + expected_len, bytes, n);
+            expected_len += n;
+        }
+        p += n;
+    }
+
+    size_t total = res.size + res.seg_bytes;
+    if (total != expected_len) {
+        abort();
+    }
+
+    /* Send it in writes of 1 to 64 bytes, taking the sizes from the input */
+    size_t off = 0;
+    size_t turn = 0;
+    while (off < total) {
+        size_t write_max = size ? (size_t)data[turn++ % size] % 64 + 1 : 1;
+        off_t file_off;
+        size_t file_len;
+        if (response_file_at(&res, off, &file_off, &file_len)) {
+            if (file_len == 0 || off + file_len > total) {
+                abort();
+            }
+            for (size_t i = 0; i < file_len; i++) {
+                if (expected[off + i] != FILE_BYTE) {
+                    abort();
+                }
+            }
+            off += file_len < write_max ? file_len : write_max;
+            continue;
+        }
+
+        struct iovec iov[2 * RESPONSE_MAX_SEGMENTS + 1];
+        int more;
+        int niov = response_iov(&res, off, iov, 2 * RESPONSE_MAX_SEGMENTS + 1, &more);
+        size_t written = 0;
+        for (int i = 0; i < niov && written < write_max; i++) {
+            size_t len = iov[i].iov_len;
+            if (len == 0 || off + written + len > total) {
+                abort();
+            }
+            if (len > write_max - written) {
+                len = write_max - written;
+            }
+            if (memcmp(iov[i].iov_base, expected + off + written, len) != 0) {
+                abort();
+            }
+            written += len;
+        }
+        if (written == 0) {
+            abort();
+        }
+        off += written;
+    }
+
+    response_free(&res);
+    arena_reset(&arena);
+    free(expected);
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * Replays inputs through a fuzz target without libFuzzer, for compilers
+ * that lack -fsanitize=fuzzer and for checking a crash once it is fixed:
+ *   ./fuzz/fuzz_parser-replay crash-1234 more-inputs...
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) {
+            perror(argv[i]);
+            return 1;
+        }
+        size_t cap = 4096;
+        size_t len = 0;
+        uint8_t *data = malloc(cap);
+        size_t n;
+        while (data && (n = fread(data + len, 1, cap - len, f)) > 0) {
+            len += n;
+            if (len == cap) {
+                uint8_t *grown = realloc(data, cap * 2);
+                if (!grown) {
+                    free(data);
+                }
+                data = grown;
+                cap *= 2;
+            }
+        }
+        fclose(f);
+        if (!data) {
+            fprintf(stderr, "%s: out of memory\n", argv[i]);
+            return 1;
+        }
+
+        /* An exact-size copy, so a read past the end trips the sanitizer */
+        uint8_t *input = malloc(len ? len : 1);
+        if (!input) {
+            return 1;
+        }
+        memcpy(input, data, len);
+        LLVMFuzzerTestOneInput(input, len);
+        free(input);
+        free(data);
+    }
+    printf("%d input%s ok\n", argc - 1, argc == 2 ? "" : "s");
+    return 0;
+}
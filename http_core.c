@@ -0,0 +1,1022 @@
+/*
+ * HTTP core: the parsing and response-building code the server is built
+ * on, kept free of I/O and server state so it can be linked into
+ * benchmarks and fuzzers on its own. See http_core.h.
+ */
+
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#include "http_core.h"
+
+/* Bump-allocate size bytes, taking a pooled block when the current one is full */
+void *arena_alloc(arena_t *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (!a->ptr || (size_t)(a->end - a->ptr) < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        arena_block_t *b;
+        if (block_size == ARENA_BLOCK_SIZE && a->pool && a->pool->free_blocks) {
+            b = a->pool->free_blocks;
+            a->pool->free_blocks = b->next;
+            a->pool->num_free_blocks--;
+        } else {
+            b = malloc(sizeof(arena_block_t) + block_size);
+            if (!b) {
+                return NULL;
+            }
+            b->size = block_size;
+        }
+        b->next = a->blocks;
+        a->blocks = b;
+        a->ptr = (char *)(b + 1);
+        a->end = a->ptr + block_size;
+    }
+
+    void *p = a->ptr;
+    a->ptr += size;
+    return p;
+}
+
+/* Free everything allocated since the last reset, recycling blocks */
+void arena_reset(arena_t *a) {
+    while (a->blocks) {
+        arena_block_t *b = a->blocks;
+        a->blocks = b->next;
+        if (b->size == ARENA_BLOCK_SIZE && a->pool && a->pool->num_free_blocks < ARENA_POOL_MAX) {
+            b->next = a->pool->free_blocks;
+            a->pool->free_blocks = b;
+            a->pool->num_free_blocks++;
+        } else {
+            free(b);
+        }
+    }
+    a->ptr = NULL;
+    a->end = NULL;
+}
+
+/* Reset everything but the slab allocation */
+void response_clear(response_t *res) {
+    res->size = 0;
+    res->keep_alive = 0;
+    res->nsegs = 0;
+    res->seg_bytes = 0;
+    res->file_fd = -1;
+    res->file_borrowed = 0;
+    res->file_off = 0;
+    res->file_len = 0;
+    res->release = NULL;
+    res->release_arg = NULL;
+    res->arena = NULL;
+    res->status = 0;
+    res->route_kind = ROUTE_KIND_OTHER;
+    res->on_body = NULL;
+    res->on_body_end = NULL;
+    res->body_ctx = NULL;
+    res->produce = NULL;
+    res->produce_ctx = NULL;
+    res->allow_chunked = 0;
+    res->stream_chunked = 0;
+    res->head_only = 0;
+    res->user_copy = 0;
+}
+
+/* Initialize response buffer */
+int response_init(response_t *res, size_t initial_capacity) {
+    res->data = malloc(initial_capacity);
+    if (!res->data) {
+        return -1;
+    }
+    response_clear(res);
+    res->capacity = initial_capacity;
+    res->data[0] = '\0';
+    return 0;
+}
+
+/* Append data to response buffer */
+int response_append(response_t *res, const char *data, size_t len) {
+    if (res->size + len + 1 > res->capacity) {
+        size_t new_capacity = res->capacity * 2;
+        while (new_capacity < res->size + len + 1) {
+            new_capacity *= 2;
+        }
+        char *new_data = realloc(res->data, new_capacity);
+        if (!new_data) {
+            return -1;
+        }
+        res->data = new_data;
+        res->capacity = new_capacity;
+    }
+    memcpy(res->data + res->size, data, len);
+    res->size += len;
+    res->data[res->size] = '\0';
+    return 0;
+}
+
+/* Append formatted string to response */
+int response_printf(response_t *res, const char *format, ...) {
+    char buffer[RESPONSE_PRINTF_MAX];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    if (len < 0 || (size_t)len >= sizeof(buffer)) {
+        return -1;
+    }
+    return response_append(res, buffer, len);
+}
+
+/*
+ * Attach a segment after everything appended so far. An owned buffer
+ * (free_fn set) is freed after it is sent, or right away on failure.
+ */
+int response_add_segment(response_t *res, const char *data, size_t len,
+                         void (*free_fn)(void *)) {
+    if (res->nsegs == RESPONSE_MAX_SEGMENTS) {
+        if (free_fn) {
+            free_fn((void *)data);
+        }
+        return -1;
+    }
+    response_segment_t *seg = &res->segs[res->nsegs++];
+    seg->slab_pos = res->size;
+    seg->base = data;
+    seg->len = len;
+    seg->file_off = 0;
+    seg->free_fn = free_fn;
+    res->seg_bytes += len;
+    return 0;
+}
+
+/*
+ * Allocate memory that lives until the response has been sent, e.g. for a
+ * handler-built body attached with response_add_ref().
+ */
+void *response_alloc(response_t *res, size_t size) {
+    return res->arena ? arena_alloc(res->arena, size) : NULL;
+}
+
+/* Attach bytes that outlive the response without copying them */
+int response_add_ref(response_t *res, const char *data, size_t len) {
+    return response_add_segment(res, data, len, NULL);
+}
+
+/* Attach a handler-allocated buffer; the response takes ownership */
+int response_add_owned(response_t *res, char *data, size_t len,
+                       void (*free_fn)(void *)) {
+    return response_add_segment(res, data, len, free_fn);
+}
+
+/* Attach len bytes of file_fd starting at off, between slab runs */
+int response_add_file_range(response_t *res, off_t off, size_t len) {
+    if (response_add_segment(res, NULL, len, NULL) < 0) {
+        return -1;
+    }
+    res->segs[res->nsegs - 1].file_off = off;
+    return 0;
+}
+
+/*
+ * Describe the unsent part of the in-memory response (slab runs interleaved
+ * with segments) as at most max iovecs, skipping the first skip bytes.
+ * Stops before a file segment; *more is set if file data follows.
+ */
+int response_iov(const response_t *res, size_t skip, struct iovec *iov, int max,
+                 int *more) {
+    int n = 0;
+    size_t slab_pos = 0;
+
+    *more = res->file_len > 0;
+    for (size_t i = 0; i <= res->nsegs && n < max; i++) {
+        size_t slab_end = i < res->nsegs ? res->segs[i].slab_pos : res->size;
+        const char *parts[2] = {res->data + slab_pos, i < res->nsegs ? res->segs[i].base : NULL};
+        size_t lens[2] = {slab_end - slab_pos, i < res->nsegs ? res->segs[i].len : 0};
+
+        for (int k = 0; k < 2 && n < max; k++) {
+            if (skip >= lens[k]) {
+                skip -= lens[k];
+                continue;
+            }
+            if (k == 1 && !parts[k]) {
+                *more = 1;
+                return n;
+            }
+            iov[n].iov_base = (char *)parts[k] + skip;
+            iov[n].iov_len = lens[k] - skip;
+            skip = 0;
+            n++;
+        }
+        slab_pos = slab_end;
+    }
+    return n;
+}
+
+/* If offset off of the response falls in a file segment, locate the rest of it */
+int response_file_at(const response_t *res, size_t off, off_t *file_off, size_t *len) {
+    size_t pos = 0;
+    size_t slab_pos = 0;
+
+    for (size_t i = 0; i < res->nsegs; i++) {
+        const response_segment_t *seg = &res->segs[i];
+        pos += seg->slab_pos - slab_pos;
+        slab_pos = seg->slab_pos;
+        if (off < pos) {
+            return 0;
+        }
+        if (!seg->base && off < pos + seg->len) {
+            *file_off = seg->file_off + (off_t)(off - pos);
+            *len = seg->len - (off - pos);
+            return 1;
+        }
+        pos += seg->len;
+    }
+    return 0;
+}
+
+/* Drop the attached segments, freeing the owned ones */
+void response_release_segments(response_t *res) {
+    for (size_t i = 0; i < res->nsegs; i++) {
+        if (res->segs[i].free_fn) {
+            res->segs[i].free_fn((void *)res->segs[i].base);
+        }
+    }
+    res->nsegs = 0;
+    res->seg_bytes = 0;
+}
+
+/* Drop the segments and file body, if any */
+void response_release_body(response_t *res) {
+    if (res->file_fd >= 0 && !res->file_borrowed) {
+        close(res->file_fd);
+    }
+    res->file_fd = -1;
+    res->file_borrowed = 0;
+    res->file_off = 0;
+    res->file_len = 0;
+    response_release_segments(res);
+    if (res->release) {
+        res->release(res->release_arg);
+        res->release = NULL;
+        res->release_arg = NULL;
+    }
+}
+
+/*
+ * Cut the response after its header block, as the answer to HEAD. The
+ * headers come first, in the slab or in a borrowed prebuilt segment;
+ * everything past the blank line is dropped, owned segments freed and any
+ * file body or stream left unsent.
+ */
+void response_drop_body(response_t *res) {
+    static const char end[] = "\r\n\r\n";
+    size_t matched = 0;
+    size_t slab_pos = 0;
+    size_t keep = res->nsegs;
+    int found = 0;
+
+    for (size_t i = 0; i <= res->nsegs && !found; i++) {
+        size_t slab_end = i < res->nsegs ? res->segs[i].slab_pos : res->size;
+        for (size_t j = slab_pos; j < slab_end && !found; j++) {
+            char ch = res->data[j];
+            matched = ch == end[matched] ? matched + 1 : ch == '\r';
+            if (matched == 4) {
+                res->size = j + 1;
+                keep = i;
+                found = 1;
+            }
+        }
+        if (found || i == res->nsegs || !res->segs[i].base) {
+            break;
+        }
+        response_segment_t *seg = &res->segs[i];
+        for (size_t j = 0; j < seg->len && !found; j++) {
+            char ch = seg->base[j];
+            matched = ch == end[matched] ? matched + 1 : ch == '\r';
+            if (matched == 4) {
+                res->seg_bytes -= seg->len - (j + 1);
+                seg->len = j + 1;
+                res->size = slab_end;
+                keep = i + 1;
+                found = 1;
+            }
+        }
+        slab_pos = slab_end;
+    }
+    res->data[res->size] = '\0';
+
+    for (size_t i = keep; i < res->nsegs; i++) {
+        if (res->segs[i].free_fn) {
+            res->segs[i].free_fn((void *)res->segs[i].base);
+        }
+        res->seg_bytes -= res->segs[i].len;
+    }
+    res->nsegs = keep;
+    res->file_len = 0;
+    res->produce = NULL;
+    res->stream_chunked = 0;
+}
+
+/* Free response buffer */
+void response_free(response_t *res) {
+    response_release_body(res);
+    free(res->data);
+    res->data = NULL;
+    res->size = 0;
+    res->capacity = 0;
+}
+
+/* Value of a hex digit, or -1 */
+static int hex_value(unsigned char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    ch = (unsigned char)tolower(ch);
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    return -1;
+}
+
+/* Percent-decode src[0..len) into dst, NUL-terminated and truncated to fit */
+size_t url_decode(char *dst, size_t dst_size, const char *src, size_t len) {
+    size_t i = 0;
+    size_t j = 0;
+    while (j < len && i < dst_size - 1) {
+        if (src[j] == '%' && j + 2 < len && hex_value(src[j + 1]) >= 0 &&
+            hex_value(src[j + 2]) >= 0) {
+            dst[i++] = (char)(hex_value(src[j + 1]) << 4 | hex_value(src[j + 2]));
+            j += 3;
+        } else if (src[j] == '+') {
+            dst[i++] = ' ';
+            j++;
+        } else {
+            dst[i++] = src[j++];
+        }
+    }
+    dst[i] = '\0';
+    return i;
+}
+
+/* Compare percent-encoded src[0..len) with a plain string without decoding it out */
+static int url_decoded_equals(const char *src, size_t len, const char *str) {
+    size_t j = 0;
+    while (j < len) {
+        char ch;
+        if (src[j] == '%' && j + 2 < len && hex_value(src[j + 1]) >= 0 &&
+            hex_value(src[j + 2]) >= 0) {
+            ch = (char)(hex_value(src[j + 1]) << 4 | hex_value(src[j + 2]));
+            j += 3;
+        } else {
+            ch = src[j] == '+' ? ' ' : src[j];
+            j++;
+        }
+        if (*str++ != ch) {
+            return 0;
+        }
+    }
+    return *str == '\0';
+}
+
+/* Split a query string into key/value slices without copying it */
+void parse_query_string(const char *query, size_t len, query_params_t *params,
+                        struct arena *arena) {
+    const char *end = query + len;
+
+    params->count = 0;
+    params->arena = arena;
+
+    while (query < end && params->count < MAX_QUERY_PARAMS) {
+        const char *amp = memchr(query, '&', end - query);
+        const char *pair_end = amp ? amp : end;
+        const char *equals = memchr(query, '=', pair_end - query);
+        if (equals) {
+            query_param_t *param = &params->params[params->count++];
+            param->key = query;
+            param->key_len = equals - query;
+            param->value = equals + 1;
+            param->value_len = pair_end - equals - 1;
+        }
+        query = pair_end + 1;
+    }
+}
+
+/* Find a query parameter by decoded key, returning its still-encoded value */
+const char *query_get_raw(const query_params_t *params, const char *key, size_t *len) {
+    for (size_t i = 0; i < params->count; i++) {
+        const query_param_t *param = &params->params[i];
+        if (url_decoded_equals(param->key, param->key_len, key)) {
+            *len = param->value_len;
+            return param->value;
+        }
+    }
+    return NULL;
+}
+
+/* Get a query parameter by key, decoding its value into the request arena */
+const char *query_get(const query_params_t *params, const char *key) {
+    size_t len;
+    const char *raw = query_get_raw(params, key, &len);
+    if (!raw || !params->arena) {
+        return NULL;
+    }
+    char *value = arena_alloc(params->arena, len + 1);
+    if (!value) {
+        return NULL;
+    }
+    url_decode(value, len + 1, raw, len);
+    return value;
+}
+
+/* Check whether a comma-separated header value contains a token */
+int header_has_token(const char *value, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && value[i] != ',') {
+            i++;
+        }
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) {
+            end--;
+        }
+        if (end - start == token_len && strncasecmp(value + start, token, token_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Reset parser for the next request */
+void http_parser_init(http_parser_t *p) {
+    p->state = PS_METHOD;
+    p->pos = 0;
+    p->mark = 0;
+    p->method_off = 0;
+    p->method_len = 0;
+    p->target_off = 0;
+    p->target_len = 0;
+    p->version_minor = 0;
+    p->num_headers = 0;
+    p->keep_alive = 0;
+    p->chunked = 0;
+    p->expect_continue = 0;
+    p->content_length = 0;
+    p->remaining = 0;
+    p->saw_digit = 0;
+}
+
+/* RFC 9110 token characters: alphanumerics and !#$%&'*+-.^_`|~ */
+static const unsigned char tchar_map[128] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0
+};
+
+/* RFC 9110 token character */
+static int is_tchar(unsigned char ch) {
+    return ch < 128 && tchar_map[ch];
+}
+
+/* Scalar: stop at a space, control character or DEL */
+static size_t scan_target_scalar(const char *buf, size_t i, size_t len) {
+    while (i < len && (unsigned char)buf[i] > 0x20 && buf[i] != 0x7f) {
+        i++;
+    }
+    return i;
+}
+
+/* Scalar: stop at any non-token byte */
+static size_t scan_header_name_scalar(const char *buf, size_t i, size_t len) {
+    while (i < len && is_tchar((unsigned char)buf[i])) {
+        i++;
+    }
+    return i;
+}
+
+/* Scalar: stop at a control character other than tab, or DEL */
+static size_t scan_header_value_scalar(const char *buf, size_t i, size_t len) {
+    for (; i < len; i++) {
+        unsigned char ch = (unsigned char)buf[i];
+        if ((ch < 0x20 && ch != '\t') || ch == 0x7f) {
+            break;
+        }
+    }
+    return i;
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * SSE4.2: PCMPESTRI finds the first byte inside a set of ranges, 16 bytes
+ * per instruction, as in picohttpparser.
+ */
+__attribute__((target("sse4.2")))
+static size_t scan_ranges_sse42(const char *buf, size_t i, size_t len, const char *ranges,
+                                int ranges_len) {
+    __m128i r = _mm_loadu_si128((const __m128i *)ranges);
+    while (len - i >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        int idx = _mm_cmpestri(r, ranges_len, v, 16,
+                               _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16) {
+            return i + idx;
+        }
+        i += 16;
+    }
+    return i;
+}
+
+__attribute__((target("sse4.2")))
+static size_t scan_target_sse42(const char *buf, size_t i, size_t len) {
+    static const char ranges[16] = "\x00\x20\x7f\x7f";
+    i = scan_ranges_sse42(buf, i, len, ranges, 4);
+    return scan_target_scalar(buf, i, len);
+}
+
+/* Non-token bytes, widened to eight ranges ('|' and '~' stop the scan too) */
+__attribute__((target("sse4.2")))
+static size_t scan_header_name_sse42(const char *buf, size_t i, size_t len) {
+    static const char ranges[16] = "\x00\x20\"\"()" ",,//:@[]{\xff";
+    i = scan_ranges_sse42(buf, i, len, ranges, 16);
+    return scan_header_name_scalar(buf, i, len);
+}
+
+__attribute__((target("sse4.2")))
+static size_t scan_header_value_sse42(const char *buf, size_t i, size_t len) {
+    static const char ranges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+    i = scan_ranges_sse42(buf, i, len, ranges, 6);
+    return scan_header_value_scalar(buf, i, len);
+}
+
+/* AVX2: 32 bytes at a time; x <= c is tested as min(x, c) == x */
+__attribute__((target("avx2")))
+static size_t scan_target_avx2(const char *buf, size_t i, size_t len) {
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    while (len - i >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, space), v),
+                                       _mm256_cmpeq_epi8(v, del));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(stop);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+    return scan_target_scalar(buf, i, len);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_header_value_avx2(const char *buf, size_t i, size_t len) {
+    const __m256i ctl = _mm256_set1_epi8(0x1f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    while (len - i >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i is_ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v);
+        __m256i stop = _mm256_or_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), is_ctl),
+                                       _mm256_cmpeq_epi8(v, del));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(stop);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+    return scan_header_value_scalar(buf, i, len);
+}
+#endif
+
+#ifdef HAVE_NEON
+/* Index of the first set byte of a NEON comparison mask, or 16 */
+static size_t neon_first(uint8x16_t mask) {
+    uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(mask), 4)), 0);
+    return bits ? (size_t)__builtin_ctzll(bits) >> 2 : 16;
+}
+
+static size_t scan_target_neon(const char *buf, size_t i, size_t len) {
+    while (len - i >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)buf + i);
+        uint8x16_t stop = vorrq_u8(vcleq_u8(v, vdupq_n_u8(0x20)), vceqq_u8(v, vdupq_n_u8(0x7f)));
+        size_t idx = neon_first(stop);
+        if (idx != 16) {
+            return i + idx;
+        }
+        i += 16;
+    }
+    return scan_target_scalar(buf, i, len);
+}
+
+static size_t scan_header_value_neon(const char *buf, size_t i, size_t len) {
+    while (len - i >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)buf + i);
+        uint8x16_t ctl = vbicq_u8(vcltq_u8(v, vdupq_n_u8(0x20)), vceqq_u8(v, vdupq_n_u8('\t')));
+        uint8x16_t stop = vorrq_u8(ctl, vceqq_u8(v, vdupq_n_u8(0x7f)));
+        size_t idx = neon_first(stop);
+        if (idx != 16) {
+            return i + idx;
+        }
+        i += 16;
+    }
+    return scan_header_value_scalar(buf, i, len);
+}
+#endif
+
+/* The portable scanners, kept for checking the SIMD ones against */
+const http_scanner_t http_scanner_scalar = {
+    "scalar", scan_target_scalar, scan_header_name_scalar, scan_header_value_scalar
+};
+
+/* Scanner in use; http_scanner_init() upgrades it to the best the CPU has */
+http_scanner_t http_scanner = {
+    "scalar", scan_target_scalar, scan_header_name_scalar, scan_header_value_scalar
+};
+
+/* Pick the widest scanner the running CPU supports */
+void http_scanner_init(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        http_scanner.name = "sse4.2";
+        http_scanner.target = scan_target_sse42;
+        http_scanner.header_name = scan_header_name_sse42;
+        http_scanner.header_value = scan_header_value_sse42;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        /* Header names are short; PCMPESTRI's ranges suit them better */
+        http_scanner.name = "avx2";
+        http_scanner.target = scan_target_avx2;
+        http_scanner.header_value = scan_header_value_avx2;
+    }
+#elif defined(HAVE_NEON)
+    http_scanner.name = "neon";
+    http_scanner.target = scan_target_neon;
+    http_scanner.header_value = scan_header_value_neon;
+#endif
+}
+
+/* Compare a parsed header name, case-insensitively */
+int header_name_is(const char *buf, const http_header_t *h, const char *name) {
+    return h->name_len == strlen(name) && strncasecmp(buf + h->name_off, name, h->name_len) == 0;
+}
+
+/* Derive connection and body framing from the parsed headers */
+static int http_parser_finish_head(http_parser_t *p, const char *buf) {
+    int have_length = 0;
+    int have_te = 0;
+
+    p->keep_alive = p->version_minor >= 1;
+
+    for (size_t i = 0; i < p->num_headers; i++) {
+        const http_header_t *h = &p->headers[i];
+        const char *value = buf + h->value_off;
+
+        if (header_name_is(buf, h, "Content-Length")) {
+            size_t length = 0;
+            if (h->value_len == 0) {
+                return HTTP_PARSE_ERROR;
+            }
+            for (size_t j = 0; j < h->value_len; j++) {
+                if (!isdigit((unsigned char)value[j]) || length > ((size_t)-1 - 9) / 10) {
+                    return HTTP_PARSE_ERROR;
+                }
+                length = length * 10 + (value[j] - '0');
+            }
+            if (have_length && length != p->content_length) {
+                return HTTP_PARSE_ERROR;
+            }
+            p->content_length = length;
+            have_length = 1;
+        } else if (header_name_is(buf, h, "Transfer-Encoding")) {
+            /* Only a final "chunked" coding can be framed */
+            size_t end = h->value_len;
+            while (end > 0 && (value[end - 1] == ' ' || value[end - 1] == '\t')) {
+                end--;
+            }
+            if (end < 7 || strncasecmp(value + end - 7, "chunked", 7) != 0 ||
+                (end > 7 && value[end - 8] != ' ' && value[end - 8] != ',')) {
+                return HTTP_PARSE_ERROR;
+            }
+            have_te = 1;
+        } else if (header_name_is(buf, h, "Expect")) {
+            p->expect_continue = header_has_token(value, h->value_len, "100-continue");
+        } else if (header_name_is(buf, h, "Connection")) {
+            if (header_has_token(value, h->value_len, "close")) {
+                p->keep_alive = 0;
+            } else if (header_has_token(value, h->value_len, "keep-alive")) {
+                p->keep_alive = 1;
+            }
+        }
+    }
+
+    /* Conflicting framing is a request smuggling vector */
+    if (have_te && have_length) {
+        return HTTP_PARSE_ERROR;
+    }
+
+    if (have_te) {
+        p->chunked = 1;
+        p->state = PS_CHUNK_SIZE;
+    } else if (p->content_length > 0) {
+        p->remaining = p->content_length;
+        p->state = PS_BODY_IDENTITY;
+    } else {
+        p->state = PS_DONE;
+    }
+    return HTTP_PARSE_DONE;
+}
+
+/*
+ * Parse the request line and headers from buf[p->pos..len), where buf is
+ * the start of the request. Returns HTTP_PARSE_DONE with p->pos set to the
+ * head length, HTTP_PARSE_AGAIN once all bytes are consumed, or
+ * HTTP_PARSE_ERROR. Bare LF line endings are accepted.
+ */
+int http_parse_head(http_parser_t *p, const char *buf, size_t len) {
+    size_t i;
+
+    for (i = p->pos; i < len; i++) {
+        unsigned char ch = (unsigned char)buf[i];
+
+        switch (p->state) {
+            case PS_METHOD:
+                if (ch == ' ') {
+                    if (i == p->mark) {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    p->method_off = p->mark;
+                    p->method_len = i - p->mark;
+                    p->mark = i + 1;
+                    p->state = PS_TARGET;
+                } else if (!is_tchar(ch)) {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case PS_TARGET:
+                i = http_scanner.target(buf, i, len);
+                if (i == len) {
+                    p->pos = i;
+                    return HTTP_PARSE_AGAIN;
+                }
+                ch = (unsigned char)buf[i];
+                if (ch == ' ') {
+                    if (i == p->mark) {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    p->target_off = p->mark;
+                    p->target_len = i - p->mark;
+                    p->mark = i + 1;
+                    p->state = PS_VERSION;
+                } else if (ch < 0x21 || ch == 0x7f) {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case PS_VERSION:
+                if (ch == '\r' || ch == '\n') {
+                    const char *v = buf + p->mark;
+                    if (i - p->mark != 8 || strncmp(v, "HTTP/1.", 7) != 0 ||
+                        !isdigit((unsigned char)v[7])) {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    p->version_minor = v[7] - '0';
+                    p->state = ch == '\r' ? PS_REQUEST_LINE_LF : PS_HEADER_START;
+                } else if (i - p->mark >= 8) {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case PS_REQUEST_LINE_LF:
+            case PS_HEADER_LF:
+                if (ch != '\n') {
+                    return HTTP_PARSE_ERROR;
+                }
+                p->state = PS_HEADER_START;
+                break;
+
+            case PS_HEADER_START:
+                if (ch == '\r') {
+                    p->state = PS_HEAD_END_LF;
+                } else if (ch == '\n') {
+                    p->pos = i + 1;
+                    return http_parser_finish_head(p, buf);
+                } else if (is_tchar(ch) && p->num_headers < MAX_HEADERS) {
+                    p->mark = i;
+                    p->state = PS_HEADER_NAME;
+                } else {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case PS_HEADER_NAME:
+                i = http_scanner.header_name(buf, i, len);
+                if (i == len) {
+                    p->pos = i;
+                    return HTTP_PARSE_AGAIN;
+                }
+                ch = (unsigned char)buf[i];
+                if (ch == ':') {
+                    p->headers[p->num_headers].name_off = p->mark;
+                    p->headers[p->num_headers].name_len = i - p->mark;
+                    p->state = PS_HEADER_VALUE_START;
+                } else if (!is_tchar(ch)) {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case PS_HEADER_VALUE_START:
+                if (ch == ' ' || ch == '\t') {
+                    break;
+                }
+                p->mark = i;
+                p->state = PS_HEADER_VALUE;
+                /* fall through */
+
+            case PS_HEADER_VALUE:
+                i = http_scanner.header_value(buf, i, len);
+                if (i == len) {
+                    p->pos = i;
+                    return HTTP_PARSE_AGAIN;
+                }
+                ch = (unsigned char)buf[i];
+                if (ch == '\r' || ch == '\n') {
+                    http_header_t *h = &p->headers[p->num_headers++];
+                    size_t end = i;
+                    while (end > p->mark && (buf[end - 1] == ' ' || buf[end - 1] == '\t')) {
+                        end--;
+                    }
+                    h->value_off = p->mark;
+                    h->value_len = end - p->mark;
+                    p->state = ch == '\r' ? PS_HEADER_LF : PS_HEADER_START;
+                } else if ((ch < 0x20 && ch != '\t') || ch == 0x7f) {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case PS_HEAD_END_LF:
+                if (ch != '\n') {
+                    return HTTP_PARSE_ERROR;
+                }
+                p->pos = i + 1;
+                return http_parser_finish_head(p, buf);
+
+            default:
+                return HTTP_PARSE_ERROR;
+        }
+    }
+
+    p->pos = i;
+    return HTTP_PARSE_AGAIN;
+}
+
+/*
+ * Consume body bytes from buf[0..len) after a completed head. Returns
+ * HTTP_PARSE_DATA with a span of payload (excluding chunk framing) in
+ * buf[*data_off..*data_off + *data_len), HTTP_PARSE_AGAIN when more input
+ * is needed, HTTP_PARSE_DONE once the body has ended, or HTTP_PARSE_ERROR.
+ * *consumed is always set to the number of bytes used from buf.
+ */
+int http_parse_body(http_parser_t *p, const char *buf, size_t len, size_t *consumed,
+                    size_t *data_off, size_t *data_len) {
+    size_t i = 0;
+
+    *consumed = 0;
+    *data_len = 0;
+    while (p->state != PS_DONE && i < len) {
+        unsigned char ch = (unsigned char)buf[i];
+
+        switch (p->state) {
+            case PS_BODY_IDENTITY:
+            case PS_CHUNK_DATA: {
+                size_t n = len - i < p->remaining ? len - i : p->remaining;
+                *data_off = i;
+                *data_len = n;
+                p->remaining -= n;
+                if (p->remaining == 0) {
+                    p->state = p->state == PS_CHUNK_DATA ? PS_CHUNK_DATA_CR : PS_DONE;
+                }
+                *consumed = i + n;
+                return HTTP_PARSE_DATA;
+            }
+
+            case PS_CHUNK_SIZE: {
+                int digit = hex_value(ch);
+                if (digit >= 0) {
+                    if (p->remaining > ((size_t)-1 >> 4)) {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    p->remaining = (p->remaining << 4) | (size_t)digit;
+                    p->saw_digit = 1;
+                } else if (!p->saw_digit) {
+                    return HTTP_PARSE_ERROR;
+                } else if (ch == ';' || ch == ' ' || ch == '\t') {
+                    p->state = PS_CHUNK_EXT;
+                } else if (ch == '\r') {
+                    p->state = PS_CHUNK_SIZE_LF;
+                } else if (ch == '\n') {
+                    p->state = p->remaining ? PS_CHUNK_DATA : PS_TRAILER_START;
+                } else {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+            }
+
+            case PS_CHUNK_EXT:
+                if (ch == '\r') {
+                    p->state = PS_CHUNK_SIZE_LF;
+                } else if (ch == '\n') {
+                    p->state = p->remaining ? PS_CHUNK_DATA : PS_TRAILER_START;
+                }
+                break;
+
+            case PS_CHUNK_SIZE_LF:
+                if (ch != '\n') {
+                    return HTTP_PARSE_ERROR;
+                }
+                p->state = p->remaining ? PS_CHUNK_DATA : PS_TRAILER_START;
+                break;
+
+            case PS_CHUNK_DATA_CR:
+                if (ch == '\r') {
+                    p->state = PS_CHUNK_DATA_LF;
+                    break;
+                }
+                /* fall through */
+
+            case PS_CHUNK_DATA_LF:
+                if (ch != '\n') {
+                    return HTTP_PARSE_ERROR;
+                }
+                p->remaining = 0;
+                p->saw_digit = 0;
+                p->state = PS_CHUNK_SIZE;
+                break;
+
+            case PS_TRAILER_START:
+                if (ch == '\r') {
+                    p->state = PS_TRAILER_END_LF;
+                } else if (ch == '\n') {
+                    p->state = PS_DONE;
+                } else {
+                    p->state = PS_TRAILER_LINE;
+                }
+                break;
+
+            case PS_TRAILER_LINE:
+                if (ch == '\n') {
+                    p->state = PS_TRAILER_START;
+                }
+                break;
+
+            case PS_TRAILER_END_LF:
+                if (ch != '\n') {
+                    return HTTP_PARSE_ERROR;
+                }
+                p->state = PS_DONE;
+                break;
+
+            default:
+                return HTTP_PARSE_ERROR;
+        }
+        i++;
+    }
+
+    *consumed = i;
+    return p->state == PS_DONE ? HTTP_PARSE_DONE : HTTP_PARSE_AGAIN;
+}
+
+/* Normalize path and check for directory traversal */
+int is_safe_path(const char *path) {
+    if (strstr(path, "..")) {
+        return 0;
+    }
+    if (path[0] != '/') {
+        return 0;
+    }
+    return 1;
+}
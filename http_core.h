@@ -0,0 +1,249 @@
+/*
+ * HTTP core: request parsing, query strings, path checks and response
+ * buffers, shared by the server, the micro-benchmarks and the fuzz targets.
+ * Nothing here touches sockets, settings or global server state; the only
+ * process-wide state is the header scanner picked by http_scanner_init().
+ */
+
+#ifndef HTTP_CORE_H
+#define HTTP_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define MAX_QUERY_PARAMS 32
+#define MAX_HEADERS 64
+#define RESPONSE_MAX_SEGMENTS 16
+#define ARENA_BLOCK_SIZE (32 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_POOL_MAX 64
+#define RESPONSE_PRINTF_MAX 8192   /* longest single response_printf() expansion */
+
+/* Query parameter located in the request target, still percent-encoded */
+typedef struct {
+    const char *key;
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+} query_param_t;
+
+/*
+ * Query parameters as slices of the request target. Nothing is copied or
+ * decoded until a handler asks for a value; decoded values are allocated
+ * from the request arena.
+ */
+typedef struct {
+    query_param_t params[MAX_QUERY_PARAMS];
+    size_t count;
+    struct arena *arena;
+} query_params_t;
+
+/* Header located in the connection buffer by offset and length */
+typedef struct {
+    size_t name_off;
+    size_t name_len;
+    size_t value_off;
+    size_t value_len;
+} http_header_t;
+
+/*
+ * Incremental HTTP/1.x request parser. All offsets are relative to the
+ * start of the request in the caller's buffer, so parsing can resume after
+ * more bytes arrive without copying anything out of it. The scalar state
+ * comes first, ahead of the header table, so stepping the parser touches
+ * the same few cache lines however many headers a request carries.
+ */
+typedef struct {
+    int state;
+    size_t pos;
+    size_t mark;
+    size_t method_off;
+    size_t method_len;
+    size_t target_off;
+    size_t target_len;
+    int version_minor;
+    int keep_alive;
+    int chunked;
+    int expect_continue;
+    int saw_digit;
+    size_t num_headers;
+    size_t content_length;
+    size_t remaining;
+    http_header_t headers[MAX_HEADERS];
+} http_parser_t;
+
+/* Parser results */
+enum {
+    HTTP_PARSE_ERROR = -1,
+    HTTP_PARSE_AGAIN = 0,
+    HTTP_PARSE_DONE = 1,
+    HTTP_PARSE_DATA = 2
+};
+
+/* Parser states */
+enum {
+    PS_METHOD,
+    PS_TARGET,
+    PS_VERSION,
+    PS_REQUEST_LINE_LF,
+    PS_HEADER_START,
+    PS_HEADER_NAME,
+    PS_HEADER_VALUE_START,
+    PS_HEADER_VALUE,
+    PS_HEADER_LF,
+    PS_HEAD_END_LF,
+    PS_BODY_IDENTITY,
+    PS_CHUNK_SIZE,
+    PS_CHUNK_EXT,
+    PS_CHUNK_SIZE_LF,
+    PS_CHUNK_DATA,
+    PS_CHUNK_DATA_CR,
+    PS_CHUNK_DATA_LF,
+    PS_TRAILER_START,
+    PS_TRAILER_LINE,
+    PS_TRAILER_END_LF,
+    PS_DONE
+};
+
+/*
+ * Byte scanners for the parser states that cover most of a request head:
+ * the request target, header names and header values. Each returns the
+ * index of the first byte in buf[i..len) that might end the field or be
+ * invalid in it, or len if there is none. They may stop early on a byte
+ * that turns out to be fine; the parser checks every byte they stop at.
+ */
+typedef struct {
+    const char *name;
+    size_t (*target)(const char *buf, size_t i, size_t len);
+    size_t (*header_name)(const char *buf, size_t i, size_t len);
+    size_t (*header_value)(const char *buf, size_t i, size_t len);
+} http_scanner_t;
+
+/* Arena block header; the usable bytes follow it */
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+} arena_block_t;
+
+/* Per-thread free lists recycling connection objects and arena blocks */
+typedef struct {
+    struct conn *free_conns;
+    size_t num_free_conns;
+    arena_block_t *free_blocks;
+    size_t num_free_blocks;
+} mem_pool_t;
+
+/* Bump allocator for request-lifetime memory, emptied after each response */
+typedef struct arena {
+    arena_block_t *blocks;
+    char *ptr;
+    char *end;
+    mem_pool_t *pool;
+} arena_t;
+
+/* How a request was answered, for the latency histograms */
+enum {
+    ROUTE_KIND_DYNAMIC,
+    ROUTE_KIND_STATIC,
+    ROUTE_KIND_OTHER,
+    ROUTE_KINDS
+};
+
+/*
+ * Out-of-line response bytes spliced in after slab offset slab_pos. A
+ * segment with no base is a slice of the response's file_fd starting at
+ * file_off, sent with sendfile().
+ */
+typedef struct {
+    size_t slab_pos;
+    const char *base;
+    size_t len;
+    off_t file_off;
+    void (*free_fn)(void *); /* frees base once sent; NULL if borrowed */
+} response_segment_t;
+
+/*
+ * Response under construction. Bytes appended are formatted into the slab
+ * (data); larger or shared bodies are attached as segments and sent in place
+ * with scatter/gather I/O, followed by an optional file body streamed from
+ * file_fd. Borrowed segments and shared descriptors stay valid until
+ * release(release_arg) runs once the response is sent. A handler that
+ * streams the request body leaves the response empty and sets on_body,
+ * which sees each piece of payload, and on_body_end, which builds the
+ * response once the body is complete. A streamed response body comes from
+ * produce, called for each piece once the previous one has been sent.
+ */
+typedef struct response {
+    char *data;
+    size_t size;
+    size_t capacity;
+    int keep_alive;
+    response_segment_t segs[RESPONSE_MAX_SEGMENTS];
+    size_t nsegs;
+    size_t seg_bytes;
+    int file_fd;
+    int file_borrowed;
+    off_t file_off;
+    size_t file_len;
+    void (*release)(void *arg);
+    void *release_arg;
+    arena_t *arena;
+    int status;
+    int route_kind;
+    int (*on_body)(void *ctx, const char *data, size_t len);
+    void (*on_body_end)(void *ctx, struct response *res);
+    void *body_ctx;
+    int (*produce)(void *ctx, struct response *res);
+    void *produce_ctx;
+    int allow_chunked;   /* the client speaks HTTP/1.1 */
+    int stream_chunked;  /* produce's pieces are framed as chunks */
+    int head_only;       /* HEAD: send the header block alone */
+    int user_copy;       /* body bytes pass through user space (TLS) */
+} response_t;
+
+/* Scanner the parser uses, and the portable one it starts as */
+extern http_scanner_t http_scanner;
+extern const http_scanner_t http_scanner_scalar;
+
+/* Request arena */
+void *arena_alloc(arena_t *a, size_t size);
+void arena_reset(arena_t *a);
+
+/* Response construction and the scatter/gather view used to send it */
+void response_clear(response_t *res);
+int response_init(response_t *res, size_t initial_capacity);
+int response_append(response_t *res, const char *data, size_t len);
+int response_printf(response_t *res, const char *format, ...);
+int response_add_segment(response_t *res, const char *data, size_t len, void (*free_fn)(void *));
+void *response_alloc(response_t *res, size_t size);
+int response_add_ref(response_t *res, const char *data, size_t len);
+int response_add_owned(response_t *res, char *data, size_t len, void (*free_fn)(void *));
+int response_add_file_range(response_t *res, off_t off, size_t len);
+int response_iov(const response_t *res, size_t skip, struct iovec *iov, int max, int *more);
+int response_file_at(const response_t *res, size_t off, off_t *file_off, size_t *len);
+void response_release_segments(response_t *res);
+void response_release_body(response_t *res);
+void response_drop_body(response_t *res);
+void response_free(response_t *res);
+
+/* Percent-decoding and query strings */
+size_t url_decode(char *dst, size_t dst_size, const char *src, size_t len);
+void parse_query_string(const char *query, size_t len, query_params_t *params, struct arena *arena);
+const char *query_get_raw(const query_params_t *params, const char *key, size_t *len);
+const char *query_get(const query_params_t *params, const char *key);
+
+/* Request head and body parsing */
+void http_scanner_init(void);
+void http_parser_init(http_parser_t *p);
+int http_parse_head(http_parser_t *p, const char *buf, size_t len);
+int http_parse_body(http_parser_t *p, const char *buf, size_t len, size_t *consumed,
+                    size_t *data_off, size_t *data_len);
+int header_name_is(const char *buf, const http_header_t *h, const char *name);
+int header_has_token(const char *value, size_t len, const char *token);
+
+/* Request paths */
+int is_safe_path(const char *path);
+
+#endif
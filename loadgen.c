@@ -0,0 +1,709 @@
+/*
+ * HTTP Load Generator and Latency Benchmark
+ * Author: HueCodes
+ *
+ * Drives a server with a fixed number of concurrent connections and reports
+ * throughput and latency percentiles:
+ * - Keep-alive or connection-per-request mode
+ * - Configurable pipelining depth
+ * - Weighted mix of request paths
+ * - Log-linear (HDR-style) latency histograms, merged across threads
+ */
+
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* Configuration constants */
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 8080
+#define MAX_THREADS 64
+#define MAX_CONNS 65536
+#define MAX_DEPTH 64
+#define MAX_PATHS 32
+#define MAX_PATH_SIZE 512
+#define MAX_HEADER_SIZE 256
+#define HEAD_BUFFER_SIZE 8192
+#define READ_BUFFER_SIZE 65536
+#define MAX_EVENTS 256
+#define RECONNECT_BACKOFF_MS 10
+
+/*
+ * Histogram layout: values below 2^HIST_SUB_BITS are exact, above that each
+ * power of two is split into 2^(HIST_SUB_BITS - 1) linear buckets, so every
+ * recorded value is within ~1.6% of its bucket. Values are nanoseconds.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_MAX_SHIFT 40
+#define HIST_BUCKETS ((HIST_MAX_SHIFT + 2) * HIST_HALF)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} histogram_t;
+
+/* Weighted request path */
+typedef struct {
+    char path[MAX_PATH_SIZE];
+    unsigned weight;
+} path_t;
+
+/* Benchmark settings */
+typedef struct {
+    struct sockaddr_in addr;
+    int connections;
+    int threads;
+    int duration;
+    int depth;
+    int keep_alive;
+    char header[MAX_HEADER_SIZE]; /* extra request header line, CRLF included */
+    path_t paths[MAX_PATHS];
+    size_t num_paths;
+    unsigned total_weight;
+} config_t;
+
+/* Response parser states */
+enum {
+    RESP_HEAD,
+    RESP_BODY
+};
+
+/* One client connection */
+typedef struct {
+    int fd;
+    int connecting;
+    int state;
+    char head[HEAD_BUFFER_SIZE];
+    size_t head_len;
+    size_t body_left;
+    int status;
+    int server_close;
+    uint64_t sent_at[MAX_DEPTH];
+    int inflight;
+    int queue_head;
+    char out[MAX_DEPTH * (MAX_PATH_SIZE + MAX_HEADER_SIZE + 64)];
+    size_t out_len;
+    size_t out_off;
+    uint64_t retry_at;  /* when a failed connect may be retried; 0 if not waiting */
+} bconn_t;
+
+/* Per-thread state and results */
+typedef struct {
+    const config_t *cfg;
+    int id;
+    int num_conns;
+    int epoll_fd;
+    bconn_t *conns;
+    uint64_t rng;
+    uint64_t deadline;
+    uint64_t requests;
+    uint64_t non_2xx;
+    uint64_t errors;
+    uint64_t bytes;
+    int backing_off;  /* connections waiting out RECONNECT_BACKOFF_MS */
+    histogram_t hist;
+    pthread_t thread;
+} bench_thread_t;
+
+/* Set by the first connection to succeed, and by a connect failing before that */
+static int connected_ever;
+static int connect_error;
+
+/* Nanoseconds from a monotonic clock */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64* step */
+static uint64_t rng_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+/* Bucket index for a value */
+static size_t hist_index(uint64_t v) {
+    if (v < (1ULL << HIST_SUB_BITS)) {
+        return (size_t)v;
+    }
+    int log2 = 63 - __builtin_clzll(v);
+    int shift = log2 - (HIST_SUB_BITS - 1);
+    if (shift > HIST_MAX_SHIFT) {
+        return HIST_BUCKETS - 1;
+    }
+    return (size_t)shift * HIST_HALF + (size_t)(v >> shift);
+}
+
+/* Highest value that maps to a bucket */
+static uint64_t hist_value(size_t index) {
+    if (index < (1U << HIST_SUB_BITS)) {
+        return index;
+    }
+    size_t shift = (index - HIST_HALF) / HIST_HALF;
+    uint64_t sub = index - shift * HIST_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(histogram_t *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+static void hist_merge(histogram_t *dst, const histogram_t *src) {
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+/* Value at a percentile in [0, 100] */
+static uint64_t hist_percentile(const histogram_t *h, double pct) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)h->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Pick a path according to the configured weights */
+static const char *pick_path(bench_thread_t *t) {
+    const config_t *cfg = t->cfg;
+    if (cfg->num_paths == 1) {
+        return cfg->paths[0].path;
+    }
+    unsigned r = (unsigned)(rng_next(&t->rng) % cfg->total_weight);
+    for (size_t i = 0; i < cfg->num_paths; i++) {
+        if (r < cfg->paths[i].weight) {
+            return cfg->paths[i].path;
+        }
+        r -= cfg->paths[i].weight;
+    }
+    return cfg->paths[0].path;
+}
+
+/* Queue one request on a connection and stamp its send time */
+static void queue_request(bench_thread_t *t, bconn_t *c) {
+    const char *path = pick_path(t);
+    int n = snprintf(c->out + c->out_len, sizeof(c->out) - c->out_len,
+                     "GET %s HTTP/1.1\r\nHost: bench\r\n%s%s\r\n", path, t->cfg->header,
+                     t->cfg->keep_alive ? "" : "Connection: close\r\n");
+    if (n < 0 || (size_t)n >= sizeof(c->out) - c->out_len) {
+        return;
+    }
+    c->out_len += n;
+    c->sent_at[(c->queue_head + c->inflight) % MAX_DEPTH] = now_ns();
+    c->inflight++;
+}
+
+/* Register interest in a connection's next readiness event */
+static void watch(bench_thread_t *t, bconn_t *c, int op) {
+    struct epoll_event ev = {
+        .events = EPOLLIN | (c->connecting || c->out_off < c->out_len ? EPOLLOUT : 0),
+        .data.ptr = c
+    };
+    epoll_ctl(t->epoll_fd, op, c->fd, &ev);
+}
+
+/* Open a new non-blocking connection and fill its pipeline */
+static int conn_open(bench_thread_t *t, bconn_t *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->connecting = 1;
+    c->state = RESP_HEAD;
+    c->head_len = 0;
+    c->body_left = 0;
+    c->server_close = 0;
+    c->inflight = 0;
+    c->queue_head = 0;
+    c->out_len = 0;
+    c->out_off = 0;
+
+    int depth = t->cfg->keep_alive ? t->cfg->depth : 1;
+    for (int i = 0; i < depth; i++) {
+        queue_request(t, c);
+    }
+
+    if (connect(c->fd, (const struct sockaddr *)&t->cfg->addr, sizeof(t->cfg->addr)) < 0 &&
+        errno != EINPROGRESS) {
+        int err = errno;
+        close(c->fd);
+        c->fd = -1;
+        errno = err;
+        return -1;
+    }
+    watch(t, c, EPOLL_CTL_ADD);
+    return 0;
+}
+
+/*
+ * A connection could not be opened (err). Before any connection has gone
+ * through this means nothing is listening, so the run is stopped with
+ * the error; later failures wait RECONNECT_BACKOFF_MS before retrying
+ * instead of spinning on refusals.
+ */
+static void conn_failed(bench_thread_t *t, bconn_t *c, int err) {
+    t->errors++;
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    if (!__atomic_load_n(&connected_ever, __ATOMIC_ACQUIRE)) {
+        int none = 0;
+        __atomic_compare_exchange_n(&connect_error, &none, err, 0, __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED);
+        return;
+    }
+    c->retry_at = now_ns() + RECONNECT_BACKOFF_MS * 1000000ULL;
+    t->backing_off++;
+}
+
+/* Drop a connection and start over with a fresh one */
+static void conn_reopen(bench_thread_t *t, bconn_t *c, int failed) {
+    if (failed) {
+        t->errors++;
+    }
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    if (now_ns() < t->deadline && conn_open(t, c) < 0) {
+        conn_failed(t, c, errno);
+    }
+}
+
+/* Retry the connections whose backoff has run out */
+static void conn_retry_due(bench_thread_t *t) {
+    uint64_t now = now_ns();
+    for (int i = 0; i < t->num_conns && t->backing_off > 0; i++) {
+        bconn_t *c = &t->conns[i];
+        if (c->retry_at == 0 || c->retry_at > now) {
+            continue;
+        }
+        c->retry_at = 0;
+        t->backing_off--;
+        if (conn_open(t, c) < 0) {
+            conn_failed(t, c, errno);
+        }
+    }
+}
+
+/* Parse the status line and framing headers of a complete response head */
+static int parse_head(bconn_t *c) {
+    c->head[c->head_len] = '\0';
+    if (strncmp(c->head, "HTTP/1.", 7) != 0 || c->head_len < 12) {
+        return -1;
+    }
+    c->status = atoi(c->head + 9);
+    c->body_left = 0;
+
+    for (char *line = strstr(c->head, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            c->body_left = strtoull(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char *v = line + 11;
+            while (*v == ' ') {
+                v++;
+            }
+            if (strncasecmp(v, "close", 5) == 0) {
+                c->server_close = 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Account for one finished response; returns 1 if the connection must be replaced */
+static int complete_response(bench_thread_t *t, bconn_t *c) {
+    uint64_t now = now_ns();
+    hist_record(&t->hist, now - c->sent_at[c->queue_head]);
+    c->queue_head = (c->queue_head + 1) % MAX_DEPTH;
+    c->inflight--;
+    t->requests++;
+    if (c->status < 200 || c->status > 299) {
+        t->non_2xx++;
+    }
+
+    c->state = RESP_HEAD;
+    c->head_len = 0;
+
+    if (!t->cfg->keep_alive || c->server_close) {
+        return 1;
+    }
+    if (now < t->deadline) {
+        if (c->out_off == c->out_len) {
+            c->out_len = 0;
+            c->out_off = 0;
+        }
+        queue_request(t, c);
+    }
+    return 0;
+}
+
+/*
+ * Consume response bytes. Returns 0 to keep going, 1 once the server has
+ * closed the connection as announced, or -1 on a protocol error.
+ */
+static int handle_input(bench_thread_t *t, bconn_t *c, const char *buf, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        if (c->state == RESP_HEAD) {
+            if (c->head_len == sizeof(c->head) - 1) {
+                return -1;
+            }
+            c->head[c->head_len++] = buf[i++];
+            if (c->head_len >= 4 && memcmp(c->head + c->head_len - 4, "\r\n\r\n", 4) == 0) {
+                if (parse_head(c) < 0) {
+                    return -1;
+                }
+                c->state = RESP_BODY;
+            }
+        } else {
+            size_t n = len - i < c->body_left ? len - i : c->body_left;
+            c->body_left -= n;
+            i += n;
+        }
+
+        if (c->state == RESP_BODY && c->body_left == 0) {
+            if (c->inflight == 0) {
+                return -1;
+            }
+            if (complete_response(t, c) > 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* React to readiness on one connection */
+static void conn_event(bench_thread_t *t, bconn_t *c, uint32_t events) {
+    if (c->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            err = errno;
+        }
+        if (err != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+            conn_failed(t, c, err ? err : ECONNREFUSED);
+            return;
+        }
+        c->connecting = 0;
+        __atomic_store_n(&connected_ever, 1, __ATOMIC_RELEASE);
+    }
+
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            conn_reopen(t, c, 1);
+            return;
+        }
+        c->out_off += n;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        char buf[READ_BUFFER_SIZE];
+        for (;;) {
+            ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                t->bytes += n;
+                int r = handle_input(t, c, buf, n);
+                if (r != 0) {
+                    conn_reopen(t, c, r < 0);
+                    return;
+                }
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            /* EOF between responses is a server-side close (e.g. request cap) */
+            conn_reopen(t, c, n < 0 || c->state != RESP_HEAD || c->head_len > 0);
+            return;
+        }
+    }
+
+    watch(t, c, EPOLL_CTL_MOD);
+}
+
+/* Benchmark loop for one thread's share of the connections */
+static void *bench_thread(void *arg) {
+    bench_thread_t *t = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (int i = 0; i < t->num_conns; i++) {
+        t->conns[i].fd = -1;
+        t->conns[i].retry_at = 0;
+        if (conn_open(t, &t->conns[i]) < 0) {
+            conn_failed(t, &t->conns[i], errno);
+        }
+    }
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= t->deadline || __atomic_load_n(&connect_error, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        int timeout_ms = (int)((t->deadline - now) / 1000000) + 1;
+        if (t->backing_off > 0 && timeout_ms > RECONNECT_BACKOFF_MS) {
+            timeout_ms = RECONNECT_BACKOFF_MS;
+        }
+        int n = epoll_wait(t->epoll_fd, events, MAX_EVENTS, timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            conn_event(t, events[i].data.ptr, events[i].events);
+        }
+        if (t->backing_off > 0) {
+            conn_retry_due(t);
+        }
+    }
+
+    for (int i = 0; i < t->num_conns; i++) {
+        if (t->conns[i].fd >= 0) {
+            close(t->conns[i].fd);
+        }
+    }
+    return NULL;
+}
+
+/* Add "path" or "path=weight" to the mix */
+static int add_path(config_t *cfg, const char *spec) {
+    if (cfg->num_paths == MAX_PATHS) {
+        fprintf(stderr, "Too many paths (max %d)\n", MAX_PATHS);
+        return -1;
+    }
+    path_t *p = &cfg->paths[cfg->num_paths];
+    const char *eq = strrchr(spec, '=');
+    size_t len = eq ? (size_t)(eq - spec) : strlen(spec);
+    if (len == 0 || len >= sizeof(p->path) || spec[0] != '/') {
+        fprintf(stderr, "Invalid path: %s\n", spec);
+        return -1;
+    }
+    memcpy(p->path, spec, len);
+    p->path[len] = '\0';
+    p->weight = eq ? (unsigned)atoi(eq + 1) : 1;
+    if (p->weight == 0) {
+        fprintf(stderr, "Invalid weight: %s\n", spec);
+        return -1;
+    }
+    cfg->total_weight += p->weight;
+    cfg->num_paths++;
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c conns] [-t threads] [-d seconds] [-p depth] [-C] "
+            "[-H header] [-u path[=weight]]... [host] [port]\n", prog);
+    fprintf(stderr, "  -c N     concurrent connections (default: 64)\n");
+    fprintf(stderr, "  -t N     client threads (default: 1)\n");
+    fprintf(stderr, "  -d N     duration in seconds (default: 10)\n");
+    fprintf(stderr, "  -p N     pipelined requests per connection (default: 1)\n");
+    fprintf(stderr, "  -C       close the connection after every request\n");
+    fprintf(stderr, "  -H LINE  extra request header, e.g. \"Accept-Encoding: gzip\"\n");
+    fprintf(stderr, "  -u PATH  request path, optionally weighted, repeatable "
+            "(default: /health)\n");
+}
+
+int main(int argc, char *argv[]) {
+    static config_t cfg;
+    const char *host = DEFAULT_HOST;
+    int port = DEFAULT_PORT;
+    int opt;
+
+    cfg.connections = 64;
+    cfg.threads = 1;
+    cfg.duration = 10;
+    cfg.depth = 1;
+    cfg.keep_alive = 1;
+
+    while ((opt = getopt(argc, argv, "c:t:d:p:CH:u:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cfg.connections = atoi(optarg);
+                break;
+            case 't':
+                cfg.threads = atoi(optarg);
+                break;
+            case 'd':
+                cfg.duration = atoi(optarg);
+                break;
+            case 'p':
+                cfg.depth = atoi(optarg);
+                break;
+            case 'C':
+                cfg.keep_alive = 0;
+                break;
+            case 'H':
+                if (strlen(optarg) + 3 > sizeof(cfg.header)) {
+                    fprintf(stderr, "Header too long: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                snprintf(cfg.header, sizeof(cfg.header), "%s\r\n", optarg);
+                break;
+            case 'u':
+                if (add_path(&cfg, optarg) < 0) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (cfg.connections <= 0 || cfg.connections > MAX_CONNS ||
+        cfg.threads <= 0 || cfg.threads > MAX_THREADS ||
+        cfg.duration <= 0 || cfg.depth <= 0 || cfg.depth > MAX_DEPTH) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (cfg.threads > cfg.connections) {
+        cfg.threads = cfg.connections;
+    }
+    if (cfg.num_paths == 0) {
+        add_path(&cfg, "/health");
+    }
+
+    if (optind < argc) {
+        host = argv[optind++];
+    }
+    if (optind < argc) {
+        port = atoi(argv[optind]);
+    }
+    cfg.addr.sin_family = AF_INET;
+    cfg.addr.sin_port = htons(port);
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, host, &cfg.addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address: %s:%d\n", host, port);
+        return EXIT_FAILURE;
+    }
+
+    bench_thread_t *threads = calloc(cfg.threads, sizeof(bench_thread_t));
+    bconn_t *conns = calloc(cfg.connections, sizeof(bconn_t));
+    if (!threads || !conns) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("Benchmarking %s:%d for %ds: %d connections, %d thread%s, %s",
+           host, port, cfg.duration, cfg.connections, cfg.threads,
+           cfg.threads == 1 ? "" : "s", cfg.keep_alive ? "keep-alive" : "close");
+    if (cfg.keep_alive && cfg.depth > 1) {
+        printf(", pipeline depth %d", cfg.depth);
+    }
+    printf("\nPaths:");
+    for (size_t i = 0; i < cfg.num_paths; i++) {
+        printf(" %s", cfg.paths[i].path);
+        if (cfg.num_paths > 1) {
+            printf("=%u", cfg.paths[i].weight);
+        }
+    }
+    printf("\n");
+
+    uint64_t start = now_ns();
+    uint64_t deadline = start + (uint64_t)cfg.duration * 1000000000ULL;
+    int assigned = 0;
+
+    for (int i = 0; i < cfg.threads; i++) {
+        bench_thread_t *t = &threads[i];
+        t->cfg = &cfg;
+        t->id = i;
+        t->num_conns = cfg.connections / cfg.threads + (i < cfg.connections % cfg.threads);
+        t->conns = conns + assigned;
+        assigned += t->num_conns;
+        t->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        t->deadline = deadline;
+        t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (t->epoll_fd < 0 || pthread_create(&t->thread, NULL, bench_thread, t) != 0) {
+            perror("thread setup");
+            return EXIT_FAILURE;
+        }
+    }
+
+    static histogram_t hist;
+    uint64_t requests = 0, non_2xx = 0, errors = 0, bytes = 0;
+    for (int i = 0; i < cfg.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        close(threads[i].epoll_fd);
+        hist_merge(&hist, &threads[i].hist);
+        requests += threads[i].requests;
+        non_2xx += threads[i].non_2xx;
+        errors += threads[i].errors;
+        bytes += threads[i].bytes;
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+
+    int err = __atomic_load_n(&connect_error, __ATOMIC_ACQUIRE);
+    if (err) {
+        fflush(stdout);
+        fprintf(stderr, "Cannot connect to %s:%d: %s\n", host, port, strerror(err));
+        free(threads);
+        free(conns);
+        return EXIT_FAILURE;
+    }
+
+    printf("Requests:    %llu (%llu non-2xx, %llu errors)\n", (unsigned long long)requests,
+           (unsigned long long)non_2xx, (unsigned long long)errors);
+    printf("Throughput:  %.1f req/s, %.2f MB/s\n", requests / elapsed,
+           bytes / elapsed / (1024.0 * 1024.0));
+    printf("Latency us:  p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           hist_percentile(&hist, 50.0) / 1e3, hist_percentile(&hist, 90.0) / 1e3,
+           hist_percentile(&hist, 99.0) / 1e3, hist_percentile(&hist, 99.9) / 1e3,
+           hist.max / 1e3);
+
+    free(threads);
+    free(conns);
+    return errors > 0 && requests == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -7,13 +7,16 @@
  * - Dynamic route handlers
  * - Query string parsing
  * - MIME type detection
- * - Graceful shutdown
+ * - Graceful shutdown and zero-downtime upgrades
  */
 
+#define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <string.h>
 #include <stdarg.h>
 #include <strings.h>
@@ -27,578 +30,6640 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#define HAVE_EPOLL 1
+#define HAVE_SENDFILE 1
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "http_core.h"
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+/* A numeric macro's value as a string literal */
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
 
 /* Configuration constants */
 #define DEFAULT_PORT 8080
 #define BUFFER_SIZE 8192
 #define MAX_PATH_SIZE 512
 #define MAX_METHOD_SIZE 16
-#define MAX_QUERY_PARAMS 32
+#define MAX_ROUTE_PARAMS 8
+#define MAX_RANGES 16
+#define RESPONSE_SLAB_KEEP (64 * 1024)
+#define STREAM_CHUNK_SIZE (16 * 1024)
+#define CONN_POOL_MAX 256
 #define MAX_PARAM_SIZE 256
 #define LISTEN_BACKLOG 128
+#define MAX_CONNECTIONS 10000
+#define REQUEST_TIMEOUT 10
+#define LINGER_TIMEOUT 2
+#define DRAIN_TIMEOUT 30
+#define LISTEN_FDS_START 3
+#define RETRY_AFTER_SECS 1
 #define DOCUMENT_ROOT "./public"
 #define DEFAULT_INDEX "index.html"
+#define MAX_WORKERS 256
+#define OFFLOAD_THREADS 4
+#define MAX_OFFLOAD_THREADS 64
+#define OFFLOAD_QUEUE_DEPTH 256
+#define MAX_EVENTS 256
+#define EVENT_LOOP_TICK_MS 1000
+#define KEEPALIVE_TIMEOUT 5
+#define KEEPALIVE_MAX_REQUESTS 100
+#define FILE_CACHE_SIZE_MB 64
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_BUCKETS 256
+#define FILE_CACHE_MAX_ENTRIES 4096
+#define FILE_CACHE_INLINE_MAX (256 * 1024)
+#define FILE_CACHE_CHECK_SECS 1
+#define FILE_CACHE_MMAP_MIN 4096
+#define FILE_ETAG_SIZE 64
+#define MIME_BUCKET_SIZE 4
+#define MIME_DISPLACE_TRIES 4096
+#define HTTP_DATE_SIZE 32
+#define DATE_HEADER_LEN 37      /* "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n" */
+#define LOG_RING_SIZE (128 * 1024)
+#define LOG_LINE_MAX 512
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_FLUSH_MS 50
+#define FILE_COPY_CHUNK (16 * 1024)  /* one full TLS record */
+#define TLS_SESSION_CACHE_SIZE 20480
+#define COMPRESS_MIN_SIZE 256
+#define COMPRESS_GZIP_LEVEL 9
+#define COMPRESS_BROTLI_QUALITY 9
+#define URING_ENTRIES 4096
+#define URING_BUF_COUNT 256
+#define CACHE_LINE_SIZE 64
+#define STATS_STATUS_MIN 100
+#define STATS_STATUS_MAX 599
+#define STATS_LATENCY_BUCKETS 22
 
 /* HTTP status codes */
 #define HTTP_OK 200
+#define HTTP_PARTIAL_CONTENT 206
+#define HTTP_NOT_MODIFIED 304
 #define HTTP_BAD_REQUEST 400
 #define HTTP_NOT_FOUND 404
 #define HTTP_METHOD_NOT_ALLOWED 405
+#define HTTP_REQUEST_TIMEOUT 408
+#define HTTP_PAYLOAD_TOO_LARGE 413
+#define HTTP_RANGE_NOT_SATISFIABLE 416
 #define HTTP_INTERNAL_ERROR 500
+#define HTTP_SERVICE_UNAVAILABLE 503
 
-/* Global state */
+/*
+ * Global state. Settings a reload may change are stored with relaxed
+ * atomics by the reloading thread and read without locks, so a request
+ * sees either the old or the new value. Strings and tables are swapped by
+ * pointer and the old ones are never freed, since readers hold no lock.
+ */
 static volatile sig_atomic_t keep_running = 1;
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+static volatile sig_atomic_t draining = 0;
 static int server_fd = -1;
+static const char *document_root = DOCUMENT_ROOT;
+static size_t read_buffer_size = BUFFER_SIZE;
+static int keepalive_timeout = KEEPALIVE_TIMEOUT;
+static int keepalive_max_requests = KEEPALIVE_MAX_REQUESTS;
+static int max_connections = MAX_CONNECTIONS;
+static int request_timeout = REQUEST_TIMEOUT;
+static int drain_timeout = DRAIN_TIMEOUT;
+static int listen_backlog = LISTEN_BACKLOG;
+static int conns_active = 0;  /* open connections across all threads */
+static int reuseport_listeners = 0;
+static int pin_workers = 0;
+static int use_io_uring = 0;
+static int compress_static = 0;
+static int mmap_static = 0;
+static int offload_threads = OFFLOAD_THREADS;
+static size_t file_cache_size = (size_t)FILE_CACHE_SIZE_MB * 1024 * 1024;
+
+/*
+ * Access log: one request in access_log_every is recorded, 0 while the
+ * log is off. The log thread reopens access_log_path when log_reopen is
+ * set, so a reload also picks up a rotated file.
+ */
+static const char *access_log_path = "";
+static int access_log_every = 0;
+static int log_reopen = 0;
+static int log_stop = 0;
+static int log_thread_running = 0;
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+
+#ifdef HAVE_OPENSSL
+/* Context new TLS connections are made from; NULL serves plain HTTP */
+static SSL_CTX *tls_ctx = NULL;
+#endif
+
+/*
+ * Listening sockets in worker order, as handed to an upgraded process,
+ * and how many of them this process inherited itself.
+ */
+static int listen_fds[MAX_WORKERS];
+static int num_listen_fds = 0;
+static int inherited_listeners = 0;
+static pid_t upgrade_parent = 0;   /* server to drain once we are up */
+static const char *upgrade_exe = NULL;
+static int upgrade_forking = 0;    /* a forked child may still hold our sockets */
+static int closes_active = 0;      /* epoll workers inside a connection close */
 
-/* Query parameter structure */
+/* Where the config file was given, and the command line to reapply on reload */
+static const char *config_path = NULL;
+static int config_argc = 0;
+static char **config_argv = NULL;
+
+/* Values captured by ":name" segments of the matched route */
 typedef struct {
-    char key[MAX_PARAM_SIZE];
+    const char *name;
     char value[MAX_PARAM_SIZE];
-} query_param_t;
+} route_param_t;
 
 typedef struct {
-    query_param_t params[MAX_QUERY_PARAMS];
+    route_param_t params[MAX_ROUTE_PARAMS];
     size_t count;
-} query_params_t;
+} route_params_t;
 
-/* Request context passed to handlers */
+/*
+ * Request context passed to handlers. Header names and values point into
+ * the connection's buffer and are not NUL-terminated; like the other
+ * fields they are only valid while the handler runs.
+ */
 typedef struct {
     const char *method;
     const char *path;
     const query_params_t *query;
+    const route_params_t *params;
+    const char *head;
+    const http_header_t *headers;
+    size_t num_headers;
+    int chunked;
+    size_t content_length;  /* declared length unless chunked */
 } request_t;
 
-/* Response buffer */
-typedef struct {
-    char *data;
-    size_t size;
-    size_t capacity;
-} response_t;
+/* Methods routes can be registered for */
+enum {
+    METHOD_GET,
+    METHOD_HEAD,
+    METHOD_POST,
+    METHOD_PUT,
+    METHOD_DELETE,
+    METHOD_PATCH,
+    METHOD_OPTIONS,
+    NUM_METHODS
+};
 
 /* Route handler function pointer */
 typedef void (*route_handler_t)(const request_t *req, response_t *res);
 
-/* Route definition */
+/*
+ * Route definition. Path segments written ":name" capture whatever the
+ * request has in that position. Routes without a handler answer with a
+ * constant body whose full response is serialized once at startup. A
+ * blocking handler may sleep or wait on disk, so the event loop hands it
+ * to the offload pool instead of running it on the I/O worker.
+ */
 typedef struct {
+    const char *method;
     const char *path;
     route_handler_t handler;
+    const char *content_type;
+    const char *body;
+    int blocking;
 } route_t;
 
-/* Thread argument structure */
+/*
+ * A blocking handler call in flight. It lives in the connection's arena;
+ * the request strings are copied there too since the head parser's locals
+ * are gone by the time a pool thread runs it.
+ */
+typedef struct offload_job {
+    struct offload_job *next;
+    struct conn *conn;
+    struct offload_queue *done;
+    int route;
+    request_t req;
+} offload_job_t;
+
+/*
+ * Completed jobs on their way back to the I/O worker that owns the
+ * connection. Pool threads push onto a lock-free stack; the worker takes
+ * the whole stack at once. Only a push onto an empty stack writes wake_fd,
+ * so a burst of completions costs the worker a single wakeup.
+ */
+typedef struct offload_queue {
+    offload_job_t *head;
+    int wake_fd;
+    int outstanding;  /* submitted and not yet taken back; owner only */
+} offload_queue_t;
+
+/*
+ * Router trie node, one per path segment. Literal children are sorted so
+ * they can be binary searched; a capture child matches any non-empty
+ * segment and is only tried when no literal child leads to a route.
+ */
+typedef struct route_node {
+    const char *segment;          /* literal text, or capture name */
+    size_t segment_len;
+    struct route_node **children;
+    size_t num_children;
+    struct route_node *capture;
+    int routes[NUM_METHODS];      /* index into routes[], -1 if none */
+    int has_routes;
+} route_node_t;
+
+/*
+ * Startup-built response for a constant route, per connection disposition.
+ * The Date line goes in after the first status_len bytes when it is sent.
+ */
+typedef struct {
+    size_t status_len;
+    char *keep_alive;
+    size_t keep_alive_len;
+    char *close;
+    size_t close_len;
+} prebuilt_response_t;
+
+#ifdef HAVE_IO_URING
+/*
+ * An io_uring instance driven through raw syscalls: the mapped submission
+ * and completion rings plus a ring of provided receive buffers the kernel
+ * picks from as data arrives.
+ */
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    char *bufs;
+    unsigned short buf_tail;
+} uring_t;
+
+/* Per-connection io_uring state; ops in flight keep the connection alive */
+typedef struct {
+    uring_t *ring;
+    int inflight;
+    int recv_armed;
+    int send_armed;
+    int poll_armed;
+    int readable;   /* ran out of provided buffers; read() directly */
+    int eof;
+    int closing;
+    const char *pending;     /* received bytes not yet copied into rbuf */
+    size_t pending_len;
+    int pending_bid;
+    struct msghdr msg;
+    struct iovec iov[2 * RESPONSE_MAX_SEGMENTS + 1];
+} conn_uring_t;
+#endif
+
+/* Connection phases: parsing a head, draining its body, writing the response */
+enum {
+    CONN_PHASE_HANDSHAKE,  /* TLS handshake before the first request */
+    CONN_PHASE_HEAD,
+    CONN_PHASE_CONTINUE,   /* sending 100 Continue before reading the body */
+    CONN_PHASE_BODY,
+    CONN_PHASE_WRITE,
+    CONN_PHASE_OFFLOAD,
+    CONN_PHASE_LINGER   /* response sent and write side shut; discarding input */
+};
+
+/*
+ * Per-connection state, shared by the threaded and event-loop servers.
+ * Everything a readiness event touches comes first: the first cache line
+ * holds the socket, phase, read window, write offset and the parser's
+ * state and position, with the rest of the parser's scalars right behind.
+ * Bookkeeping used once per request or connection follows the response.
+ */
+typedef struct conn {
+    int fd;
+    int phase;
+    int events;
+    int keep_alive;
+    char *rbuf;            /* read_buffer_size bytes, allocated with the connection */
+    size_t rstart;
+    size_t rlen;
+    size_t res_off;
+    http_parser_t parser;
+    response_t res;
+    arena_t arena;
+    mem_pool_t *pool;
+    struct sockaddr_in addr;
+    int requests;
+    time_t last_active;
+    time_t deadline;       /* monotonic second the current request must progress by; 0 if none */
+    uint64_t started_ns;
+    uint64_t sent;             /* bytes of the current response written so far */
+    int log_sampled;           /* the current request goes to the access log */
+    const char *log_line;      /* its request line, copied into the arena */
+    size_t log_line_len;
+    offload_queue_t *offload;  /* NULL runs blocking handlers inline */
+    int offloaded;             /* a pool thread owns res and arena */
+    size_t continue_off;       /* bytes of a 100 Continue sent so far */
+#ifdef HAVE_OPENSSL
+    SSL *tls;                  /* NULL for plain HTTP */
+    int ktls_send;             /* the kernel encrypts sends; write to the socket directly */
+#endif
+    struct conn *prev;
+    struct conn *next;
+#ifdef HAVE_IO_URING
+    conn_uring_t u;
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE))) conn_t;
+
+/*
+ * Access log records from one thread, waiting for the log thread. The
+ * owner only advances head and the log thread only advances tail, each on
+ * its own cache line, so appending takes no lock. Positions count bytes
+ * ever written and are reduced modulo LOG_RING_SIZE on access.
+ */
+typedef struct log_ring {
+    uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    char buf[LOG_RING_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+} log_ring_t;
+
+/*
+ * One access log record as queued, followed by line_len bytes of request
+ * line. Formatting into text is left to the log thread.
+ */
+typedef struct {
+    uint32_t len;          /* header and request line, rounded up to 8 */
+    uint16_t status;
+    uint16_t line_len;
+    struct in_addr addr;
+    uint32_t latency_us;
+    uint64_t bytes;
+    int64_t when;          /* wall-clock second the response finished */
+} log_record_t;
+
+/*
+ * Counters owned by one thread. Only the owner writes them and a scrape
+ * sums every slot, so recording never touches a cache line another thread
+ * writes. Latency bucket i counts requests taking under 2^i microseconds;
+ * the last bucket is unbounded.
+ */
+typedef struct stats {
+    uint64_t responses[STATS_STATUS_MAX - STATS_STATUS_MIN + 1];
+    uint64_t bytes_sent;
+    uint64_t conns_opened;
+    uint64_t conns_closed;
+    uint64_t accepted;
+    uint64_t shed;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t latency[ROUTE_KINDS][STATS_LATENCY_BUCKETS];
+    uint64_t latency_sum_ns[ROUTE_KINDS];
+    uint64_t log_dropped;
+    uint64_t tls_handshakes;
+    uint64_t tls_resumed;
+    uint64_t tls_ktls;
+    log_ring_t *log;     /* allocated on the first sampled request; goes with the slot */
+    int in_use;          /* guarded by stats_lock */
+    struct stats *next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) stats_t;
+
+#ifdef HAVE_EPOLL
+/* Event-loop worker owning an epoll set and its connections */
 typedef struct {
-    int client_fd;
-    struct sockaddr_in client_addr;
-} client_info_t;
+    int id;
+    int epoll_fd;
+    int listen_fd;
+    int cpu;
+    int node;            /* NUMA node of cpu, -1 if unpinned or unknown */
+    pthread_t thread;
+    conn_t *conns;       /* most recently active first */
+    conn_t *conns_tail;  /* least recently active, swept for idle timeouts */
+    time_t now;
+    mem_pool_t pool;
+    offload_queue_t done;
+    int draining;        /* stopped accepting; exits once its connections are done */
+    time_t drain_started;
+#ifdef HAVE_IO_URING
+    uring_t *ring;
+    int accept_armed;
+    conn_t *zombies;     /* closed, waiting for their ring ops to complete */
+    struct __kernel_timespec tick;
+#endif
+} worker_t;
+#endif
 
-/* MIME type mapping */
+/*
+ * MIME type mapping. Compressible types get encoded variants; a non-NULL
+ * cache_control is sent as the Cache-Control policy for the extension.
+ */
 typedef struct {
     const char *extension;
     const char *mime_type;
+    int compressible;
+    const char *cache_control;
 } mime_type_t;
 
+#define CACHE_REVALIDATE "no-cache"
+#define CACHE_DAY "public, max-age=86400"
+#define CACHE_WEEK "public, max-age=604800"
+
 static const mime_type_t mime_types[] = {
-    {".html", "text/html"},
-    {".htm", "text/html"},
-    {".css", "text/css"},
-    {".js", "application/javascript"},
-    {".json", "application/json"},
-    {".xml", "application/xml"},
-    {".png", "image/png"},
-    {".jpg", "image/jpeg"},
-    {".jpeg", "image/jpeg"},
-    {".gif", "image/gif"},
-    {".svg", "image/svg+xml"},
-    {".ico", "image/x-icon"},
-    {".txt", "text/plain"},
-    {".pdf", "application/pdf"},
-    {NULL, NULL}
+    {".html", "text/html", 1, CACHE_REVALIDATE},
+    {".htm", "text/html", 1, CACHE_REVALIDATE},
+    {".css", "text/css", 1, CACHE_DAY},
+    {".js", "application/javascript", 1, CACHE_DAY},
+    {".json", "application/json", 1, CACHE_REVALIDATE},
+    {".xml", "application/xml", 1, CACHE_REVALIDATE},
+    {".png", "image/png", 0, CACHE_WEEK},
+    {".jpg", "image/jpeg", 0, CACHE_WEEK},
+    {".jpeg", "image/jpeg", 0, CACHE_WEEK},
+    {".gif", "image/gif", 0, CACHE_WEEK},
+    {".svg", "image/svg+xml", 1, CACHE_WEEK},
+    {".ico", "image/x-icon", 1, CACHE_WEEK},
+    {".txt", "text/plain", 1, CACHE_REVALIDATE},
+    {".pdf", "application/pdf", 0, CACHE_DAY},
+    {NULL, NULL, 0, NULL}
+};
+
+static const mime_type_t default_mime_type = {NULL, "application/octet-stream", 0, NULL};
+
+/*
+ * Extension lookup: a perfect hash over case-folded extensions, built by
+ * hash-and-displace whenever the types change. The high half of an
+ * extension's hash picks its bucket; the displacement stored for that
+ * bucket, chosen so no two extensions share a slot, turns the low half
+ * into its slot. A lookup is one hash and one comparison however many
+ * types are loaded. Config-file types go in first and shadow built-ins.
+ */
+typedef struct {
+    uint32_t num_buckets;
+    uint32_t mask;            /* slot count - 1, a power of two */
+    uint32_t *displace;       /* per bucket */
+    const mime_type_t **slots;
+} mime_index_t;
+
+/* Swapped whole by settings_apply(); old indexes are never freed */
+static const mime_index_t *mime_index = NULL;
+
+/* Content codings for static files, in order of preference */
+typedef struct {
+    const char *name;
+    const char *suffix;
+} content_coding_t;
+
+enum { CODING_BR, CODING_GZIP, NUM_CODINGS, CODING_IDENTITY = -1 };
+
+static const content_coding_t content_codings[NUM_CODINGS] = {
+    {"br", ".br"},
+    {"gzip", ".gz"}
 };
 
-/* Forward declarations */
-static void handle_home(const request_t *req, response_t *res);
-static void handle_about(const request_t *req, response_t *res);
-static void handle_health(const request_t *req, response_t *res);
+static void handle_metrics(const request_t *req, response_t *res);
+static void handle_user(const request_t *req, response_t *res);
+static void handle_upload(const request_t *req, response_t *res);
+static void handle_stream(const request_t *req, response_t *res);
+static void handle_slow(const request_t *req, response_t *res);
 
 /* Route table */
 static const route_t routes[] = {
-    {"/", handle_home},
-    {"/about", handle_about},
-    {"/health", handle_health},
-    {NULL, NULL}
+    {"GET", "/", NULL, "text/html", "<h1>Welcome!</h1><p>Simple C HTTP Server</p>", 0},
+    {"GET", "/about", NULL, "text/html", "<h1>About</h1><p>Multithreaded C Server with Static Files</p>", 0},
+    {"GET", "/health", NULL, "application/json", "{\"status\":\"healthy\",\"threads\":\"enabled\"}", 0},
+    {"GET", "/metrics", handle_metrics, NULL, NULL, 0},
+    {"GET", "/users/:id", handle_user, NULL, NULL, 0},
+    {"POST", "/upload", handle_upload, NULL, NULL, 0},
+    {"PUT", "/upload", handle_upload, NULL, NULL, 0},
+    {"GET", "/stream", handle_stream, NULL, NULL, 0},
+    {"GET", "/slow", handle_slow, NULL, NULL, 1},
+    {NULL, NULL, NULL, NULL, NULL, 0}
 };
 
-/* Signal handler for graceful shutdown */
-static void signal_handler(int signum) {
-    (void)signum;
-    keep_running = 0;
-    if (server_fd != -1) {
-        close(server_fd);
-    }
+#define NUM_ROUTES (sizeof(routes) / sizeof(routes[0]) - 1)
+
+static prebuilt_response_t prebuilt_responses[NUM_ROUTES];
+
+static const char *const method_names[NUM_METHODS] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS"
+};
+
+/* Root of the router, compiled from routes[] at startup */
+static route_node_t *route_root = NULL;
+
+/* Registry of per-thread stats slots; slots are reused, never freed */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_t *stats_slots = NULL;
+static __thread stats_t *thread_stats = NULL;
+static __thread unsigned int log_countdown = 0;
+
+static const char *const route_kind_names[ROUTE_KINDS] = {"dynamic", "static", "other"};
+
+/* Seconds from a monotonic clock, for timeouts and revalidation */
+static time_t monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
 }
 
-/* Initialize response buffer */
-static int response_init(response_t *res, size_t initial_capacity) {
-    res->data = malloc(initial_capacity);
-    if (!res->data) {
-        return -1;
-    }
-    res->size = 0;
-    res->capacity = initial_capacity;
-    res->data[0] = '\0';
-    return 0;
+/* Nanoseconds from a monotonic clock, for request latency */
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
 }
 
-/* Append data to response buffer */
-static int response_append(response_t *res, const char *data, size_t len) {
-    if (res->size + len + 1 > res->capacity) {
-        size_t new_capacity = res->capacity * 2;
-        while (new_capacity < res->size + len + 1) {
-            new_capacity *= 2;
-        }
-        char *new_data = realloc(res->data, new_capacity);
-        if (!new_data) {
-            return -1;
-        }
-        res->data = new_data;
-        res->capacity = new_capacity;
+/* Seconds from the wall clock; the coarse clock is enough and costs no syscall */
+static time_t wall_seconds(void) {
+    struct timespec ts;
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+    return ts.tv_sec;
+}
+
+/* Date header lines shared by every thread, and the second they were made for */
+static char date_lines[2][DATE_HEADER_LEN + 1];
+static int date_current = 0;
+static time_t date_second = 0;
+
+/*
+ * The current Date header line, DATE_HEADER_LEN bytes, formatted at most
+ * once a second. The first thread to see a new second claims it and fills
+ * the slot readers are not using before publishing it, so a reader
+ * copying the other slot is never torn.
+ */
+static const char *date_header(void) {
+    time_t now = wall_seconds();
+    time_t seen = __atomic_load_n(&date_second, __ATOMIC_ACQUIRE);
+
+    if (now != seen && __atomic_compare_exchange_n(&date_second, &seen, now, 0,
+                                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        int next = !__atomic_load_n(&date_current, __ATOMIC_RELAXED);
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(date_lines[next], sizeof(date_lines[next]), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n",
+                 &tm);
+        __atomic_store_n(&date_current, next, __ATOMIC_RELEASE);
     }
-    memcpy(res->data + res->size, data, len);
-    res->size += len;
-    res->data[res->size] = '\0';
-    return 0;
+    return date_lines[__atomic_load_n(&date_current, __ATOMIC_ACQUIRE)];
 }
 
-/* Append formatted string to response */
-static int response_printf(response_t *res, const char *format, ...) {
-    char buffer[BUFFER_SIZE];
-    va_list args;
-    va_start(args, format);
-    int len = vsnprintf(buffer, sizeof(buffer), format, args);
-    va_end(args);
+/*
+ * Add to a counter in the calling thread's stats slot. The owner is the only
+ * writer, so a relaxed store of the incremented value is enough and avoids
+ * a locked read-modify-write.
+ */
+#define STAT_ADD(field, n) do { \
+        stats_t *stats_ = thread_stats; \
+        if (stats_) { \
+            __atomic_store_n(&stats_->field, stats_->field + (n), __ATOMIC_RELAXED); \
+        } \
+    } while (0)
 
-    if (len < 0 || (size_t)len >= sizeof(buffer)) {
-        return -1;
+/* Give the calling thread a stats slot of its own, reusing a released one */
+static void stats_attach(void) {
+    stats_t *s;
+
+    pthread_mutex_lock(&stats_lock);
+    for (s = stats_slots; s && s->in_use; s = s->next) {
     }
-    return response_append(res, buffer, len);
+    if (!s) {
+        void *mem;
+        if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(stats_t)) == 0) {
+            s = mem;
+            memset(s, 0, sizeof(*s));
+            s->next = stats_slots;
+            stats_slots = s;
+        }
+    }
+    if (s) {
+        s->in_use = 1;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    thread_stats = s;
 }
 
-/* Free response buffer */
-static void response_free(response_t *res) {
-    free(res->data);
-    res->data = NULL;
-    res->size = 0;
-    res->capacity = 0;
+/* Hand the calling thread's slot back; its counts stay in the totals */
+static void stats_detach(void) {
+    if (!thread_stats) {
+        return;
+    }
+    pthread_mutex_lock(&stats_lock);
+    thread_stats->in_use = 0;
+    pthread_mutex_unlock(&stats_lock);
+    thread_stats = NULL;
 }
 
-/* Send HTTP response with status */
-static void send_http_response(response_t *res, int status, const char *content_type,
-                               const char *body, size_t body_len) {
-    const char *status_text;
-    switch (status) {
-        case HTTP_OK: status_text = "OK"; break;
-        case HTTP_BAD_REQUEST: status_text = "Bad Request"; break;
-        case HTTP_NOT_FOUND: status_text = "Not Found"; break;
-        case HTTP_METHOD_NOT_ALLOWED: status_text = "Method Not Allowed"; break;
-        case HTTP_INTERNAL_ERROR: status_text = "Internal Server Error"; break;
-        default: status_text = "Unknown"; break;
+/* Record a fully sent response and how long it took */
+static void stats_record_response(const response_t *res, uint64_t elapsed_ns) {
+    if (!thread_stats) {
+        return;
     }
 
-    response_printf(res, "HTTP/1.1 %d %s\r\n", status, status_text);
-    response_printf(res, "Content-Type: %s\r\n", content_type);
-    response_printf(res, "Content-Length: %zu\r\n", body_len);
-    response_printf(res, "Connection: close\r\n");
-    response_printf(res, "\r\n");
+    int status = res->status;
+    if (status < STATS_STATUS_MIN || status > STATS_STATUS_MAX) {
+        status = HTTP_INTERNAL_ERROR;
+    }
+    STAT_ADD(responses[status - STATS_STATUS_MIN], 1);
 
-    if (body && body_len > 0) {
-        response_append(res, body, body_len);
+    uint64_t us = elapsed_ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= STATS_LATENCY_BUCKETS) {
+        bucket = STATS_LATENCY_BUCKETS - 1;
     }
+    STAT_ADD(latency[res->route_kind][bucket], 1);
+    STAT_ADD(latency_sum_ns[res->route_kind], elapsed_ns);
 }
 
-/* URL decode a string in-place */
-static void url_decode(char *dst, const char *src, size_t dst_size) {
-    size_t i = 0;
-    while (*src && i < dst_size - 1) {
-        if (*src == '%' && src[1] && src[2]) {
-            char hex[3] = {src[1], src[2], '\0'};
-            char *end;
-            long val = strtol(hex, &end, 16);
-            if (end == hex + 2) {
-                dst[i++] = (char)val;
-                src += 3;
-                continue;
+/* Sum every thread's slot into total */
+static void stats_collect(stats_t *total) {
+    memset(total, 0, sizeof(*total));
+
+    pthread_mutex_lock(&stats_lock);
+    for (const stats_t *s = stats_slots; s; s = s->next) {
+        for (int i = 0; i <= STATS_STATUS_MAX - STATS_STATUS_MIN; i++) {
+            total->responses[i] += __atomic_load_n(&s->responses[i], __ATOMIC_RELAXED);
+        }
+        total->bytes_sent += __atomic_load_n(&s->bytes_sent, __ATOMIC_RELAXED);
+        total->conns_opened += __atomic_load_n(&s->conns_opened, __ATOMIC_RELAXED);
+        total->conns_closed += __atomic_load_n(&s->conns_closed, __ATOMIC_RELAXED);
+        total->accepted += __atomic_load_n(&s->accepted, __ATOMIC_RELAXED);
+        total->shed += __atomic_load_n(&s->shed, __ATOMIC_RELAXED);
+        total->cache_hits += __atomic_load_n(&s->cache_hits, __ATOMIC_RELAXED);
+        total->cache_misses += __atomic_load_n(&s->cache_misses, __ATOMIC_RELAXED);
+        total->log_dropped += __atomic_load_n(&s->log_dropped, __ATOMIC_RELAXED);
+        total->tls_handshakes += __atomic_load_n(&s->tls_handshakes, __ATOMIC_RELAXED);
+        total->tls_resumed += __atomic_load_n(&s->tls_resumed, __ATOMIC_RELAXED);
+        total->tls_ktls += __atomic_load_n(&s->tls_ktls, __ATOMIC_RELAXED);
+        for (int k = 0; k < ROUTE_KINDS; k++) {
+            for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+                total->latency[k][i] += __atomic_load_n(&s->latency[k][i], __ATOMIC_RELAXED);
             }
-        } else if (*src == '+') {
-            dst[i++] = ' ';
-            src++;
-            continue;
+            total->latency_sum_ns[k] += __atomic_load_n(&s->latency_sum_ns[k],
+                                                        __ATOMIC_RELAXED);
         }
-        dst[i++] = *src++;
     }
-    dst[i] = '\0';
+    pthread_mutex_unlock(&stats_lock);
 }
 
-/* Parse query string into parameters */
-static void parse_query_string(const char *query, query_params_t *params) {
-    params->count = 0;
-    if (!query || !*query) {
-        return;
+/* Whether the request being answered is one of the sampled ones */
+static int access_log_sampled(void) {
+    unsigned int every = (unsigned int)__atomic_load_n(&access_log_every, __ATOMIC_RELAXED);
+    if (every == 0 || ++log_countdown < every) {
+        return 0;
     }
+    log_countdown = 0;
+    return 1;
+}
 
-    char buffer[BUFFER_SIZE];
-    strncpy(buffer, query, sizeof(buffer) - 1);
-    buffer[sizeof(buffer) - 1] = '\0';
+/* Copy len bytes into the ring at position pos, wrapping at the end */
+static void log_ring_put(log_ring_t *r, uint64_t pos, const void *data, size_t len) {
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+    memcpy(r->buf + off, data, first);
+    memcpy(r->buf, (const char *)data + first, len - first);
+}
 
-    char *saveptr;
-    char *pair = strtok_r(buffer, "&", &saveptr);
+/* Copy len bytes out of the ring from position pos */
+static void log_ring_get(const log_ring_t *r, uint64_t pos, void *data, size_t len) {
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+    memcpy(data, r->buf + off, first);
+    memcpy((char *)data + first, r->buf, len - first);
+}
 
-    while (pair && params->count < MAX_QUERY_PARAMS) {
-        char *equals = strchr(pair, '=');
-        if (equals) {
-            *equals = '\0';
-            url_decode(params->params[params->count].key, pair, MAX_PARAM_SIZE);
-            url_decode(params->params[params->count].value, equals + 1, MAX_PARAM_SIZE);
-            params->count++;
+/*
+ * Queue an access log record for a sampled request in the calling
+ * thread's ring. Nothing is formatted or written here; the log thread is
+ * woken early once the ring is half full, and a full ring drops the record.
+ */
+static void access_log_record(const struct sockaddr_in *addr, int status, const char *line,
+                              size_t line_len, uint64_t bytes, uint64_t elapsed_ns) {
+    stats_t *stats = thread_stats;
+    if (!stats) {
+        return;
+    }
+    log_ring_t *r = stats->log;
+    if (!r) {
+        void *mem;
+        if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(log_ring_t)) != 0) {
+            return;
         }
-        pair = strtok_r(NULL, "&", &saveptr);
+        r = mem;
+        r->head = 0;
+        r->tail = 0;
+        __atomic_store_n(&stats->log, r, __ATOMIC_RELEASE);
+    }
+
+    log_record_t rec;
+    uint64_t us = elapsed_ns / 1000;
+    rec.len = (uint32_t)((sizeof(rec) + line_len + 7) & ~(size_t)7);
+    rec.status = (uint16_t)status;
+    rec.line_len = (uint16_t)line_len;
+    rec.addr = addr->sin_addr;
+    rec.latency_us = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    rec.bytes = bytes;
+    rec.when = wall_seconds();
+
+    uint64_t head = r->head;
+    uint64_t used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (used + rec.len > LOG_RING_SIZE) {
+        STAT_ADD(log_dropped, 1);
+        return;
+    }
+    log_ring_put(r, head, &rec, sizeof(rec));
+    log_ring_put(r, head + sizeof(rec), line, line_len);
+    __atomic_store_n(&r->head, head + rec.len, __ATOMIC_RELEASE);
+    if (used < LOG_RING_SIZE / 2 && used + rec.len >= LOG_RING_SIZE / 2) {
+        pthread_cond_signal(&log_wake);
     }
 }
 
-/* Get query parameter value by key */
-static const char *query_get(const query_params_t *params, const char *key) {
-    for (size_t i = 0; i < params->count; i++) {
-        if (strcmp(params->params[i].key, key) == 0) {
-            return params->params[i].value;
+/* The log thread's output file and the batch of lines headed for it */
+typedef struct {
+    int fd;
+    size_t used;
+    time_t stamp_second;
+    char stamp[32];
+    char batch[LOG_BATCH_SIZE];
+} log_writer_t;
+
+/* Write out the batch; a failed write loses it rather than stall the log */
+static void log_writer_flush(log_writer_t *lw) {
+    const char *p = lw->batch;
+    size_t len = lw->used;
+
+    while (len > 0 && lw->fd >= 0) {
+        ssize_t n = write(lw->fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
         }
+        p += n;
+        len -= n;
     }
-    return NULL;
+    lw->used = 0;
 }
 
-/* Parse HTTP request line */
-static int parse_request_line(const char *request, char *method, char *path,
-                              char *query_string) {
-    const char *space1 = strchr(request, ' ');
-    if (!space1) {
-        return -1;
+/* Open the configured log file in place of the current one; "-" is stdout */
+static void log_writer_open(log_writer_t *lw) {
+    const char *path = __atomic_load_n(&access_log_path, __ATOMIC_ACQUIRE);
+    int fd = -1;
+
+    if (strcmp(path, "-") == 0) {
+        fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    } else if (path[0]) {
+        fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    }
+    if (path[0] && fd < 0) {
+        perror(path);
     }
 
-    size_t method_len = space1 - request;
-    if (method_len >= MAX_METHOD_SIZE) {
-        return -1;
+    log_writer_flush(lw);
+    if (lw->fd >= 0) {
+        close(lw->fd);
     }
+    lw->fd = fd;
+}
 
-    strncpy(method, request, method_len);
-    method[method_len] = '\0';
+/*
+ * Format one record in Common Log Format with the response time in
+ * microseconds appended. The request line is escaped so that it cannot
+ * break out of its quotes or the line.
+ */
+static void log_writer_format(log_writer_t *lw, const log_record_t *rec, const char *line) {
+    static const char hex[] = "0123456789abcdef";
+    char addr[INET_ADDRSTRLEN];
 
-    const char *space2 = strchr(space1 + 1, ' ');
-    if (!space2) {
-        return -1;
+    if (lw->used + 4 * LOG_LINE_MAX + 128 > sizeof(lw->batch)) {
+        log_writer_flush(lw);
+    }
+    if (rec->when != lw->stamp_second) {
+        time_t when = (time_t)rec->when;
+        struct tm tm;
+        gmtime_r(&when, &tm);
+        strftime(lw->stamp, sizeof(lw->stamp), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        lw->stamp_second = when;
+    }
+    if (!rec->addr.s_addr || !inet_ntop(AF_INET, &rec->addr, addr, sizeof(addr))) {
+        strcpy(addr, "-");
     }
 
-    const char *uri_start = space1 + 1;
-    size_t uri_len = space2 - uri_start;
-
-    if (uri_len >= MAX_PATH_SIZE) {
-        return -1;
+    char *out = lw->batch + lw->used;
+    out += sprintf(out, "%s - - [%s] \"", addr, lw->stamp);
+    if (rec->line_len == 0) {
+        *out++ = '-';
+    }
+    for (size_t i = 0; i < rec->line_len; i++) {
+        unsigned char ch = (unsigned char)line[i];
+        if (ch == '"' || ch == '\\' || ch < 0x20 || ch >= 0x7f) {
+            *out++ = '\\';
+            *out++ = 'x';
+            *out++ = hex[ch >> 4];
+            *out++ = hex[ch & 15];
+        } else {
+            *out++ = (char)ch;
+        }
     }
+    out += sprintf(out, "\" %u %llu %u\n", rec->status, (unsigned long long)rec->bytes,
+                   rec->latency_us);
+    lw->used = out - lw->batch;
+}
 
-    char uri[MAX_PATH_SIZE];
-    strncpy(uri, uri_start, uri_len);
-    uri[uri_len] = '\0';
+/* Format and consume everything queued in one ring */
+static void log_writer_drain(log_writer_t *lw, log_ring_t *r) {
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->tail;
+    char line[LOG_LINE_MAX];
 
-    char *question = strchr(uri, '?');
-    if (question) {
-        *question = '\0';
-        strncpy(query_string, question + 1, MAX_PATH_SIZE - 1);
-        query_string[MAX_PATH_SIZE - 1] = '\0';
-    } else {
-        query_string[0] = '\0';
+    while (tail < head) {
+        log_record_t rec;
+        log_ring_get(r, tail, &rec, sizeof(rec));
+        log_ring_get(r, tail + sizeof(rec), line, rec.line_len);
+        if (lw->fd >= 0) {
+            log_writer_format(lw, &rec, line);
+        }
+        tail += rec.len;
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
     }
+}
 
-    strncpy(path, uri, MAX_PATH_SIZE - 1);
-    path[MAX_PATH_SIZE - 1] = '\0';
+/*
+ * Log thread: every LOG_FLUSH_MS, or sooner when a ring fills up, drain
+ * every thread's ring into batched writes. Rings are reached through the
+ * stats slots, which are never unlinked, so the list is walked unlocked.
+ */
+static void *access_log_main(void *arg) {
+    log_writer_t *lw = arg;
 
-    return 0;
-}
+    for (;;) {
+        int stop = __atomic_load_n(&log_stop, __ATOMIC_ACQUIRE);
+        if (__atomic_exchange_n(&log_reopen, 0, __ATOMIC_ACQ_REL)) {
+            log_writer_open(lw);
+        }
 
-/* Get MIME type from file extension */
-static const char *get_mime_type(const char *path) {
-    const char *dot = strrchr(path, '.');
-    if (!dot) {
-        return "application/octet-stream";
-    }
+        pthread_mutex_lock(&stats_lock);
+        stats_t *slots = stats_slots;
+        pthread_mutex_unlock(&stats_lock);
+        for (stats_t *s = slots; s; s = s->next) {
+            log_ring_t *r = __atomic_load_n(&s->log, __ATOMIC_ACQUIRE);
+            if (r) {
+                log_writer_drain(lw, r);
+            }
+        }
+        log_writer_flush(lw);
+        if (stop) {
+            break;
+        }
 
-    for (const mime_type_t *mt = mime_types; mt->extension; mt++) {
-        if (strcasecmp(dot, mt->extension) == 0) {
-            return mt->mime_type;
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&log_lock);
+        if (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE) &&
+            !__atomic_load_n(&log_reopen, __ATOMIC_ACQUIRE)) {
+            pthread_cond_timedwait(&log_wake, &log_lock, &until);
         }
+        pthread_mutex_unlock(&log_lock);
     }
 
-    return "application/octet-stream";
+    if (lw->fd >= 0) {
+        close(lw->fd);
+    }
+    free(lw);
+    return NULL;
 }
 
-/* Normalize path and check for directory traversal */
-static int is_safe_path(const char *path) {
-    if (strstr(path, "..")) {
-        return 0;
-    }
-    if (path[0] != '/') {
-        return 0;
+/* Signal handler for graceful shutdown */
+static void signal_handler(int signum) {
+    (void)signum;
+    keep_running = 0;
+    if (server_fd != -1) {
+        close(server_fd);
     }
-    return 1;
 }
 
-/* Serve static file */
-static void serve_static_file(const char *request_path, response_t *res) {
-    char filepath[MAX_PATH_SIZE * 2];
-    struct stat st;
+/* SIGHUP: have the main thread reload the configuration */
+static void reload_handler(int signum) {
+    (void)signum;
+    reload_requested = 1;
+}
 
-    if (!is_safe_path(request_path)) {
-        send_http_response(res, HTTP_BAD_REQUEST, "text/html",
-                          "<h1>400 Bad Request</h1>", 24);
-        return;
-    }
+/* SIGUSR2: have the main thread start an upgraded server */
+static void upgrade_handler(int signum) {
+    (void)signum;
+    upgrade_requested = 1;
+}
 
-    snprintf(filepath, sizeof(filepath), "%s%s", DOCUMENT_ROOT, request_path);
+/* SIGQUIT: stop accepting and exit once open connections are done */
+static void drain_handler(int signum) {
+    (void)signum;
+    draining = 1;
+}
 
-    if (stat(filepath, &st) == 0 && S_ISDIR(st.st_mode)) {
-        size_t len = strlen(filepath);
-        if (len > 0 && filepath[len - 1] != '/') {
-            strncat(filepath, "/", sizeof(filepath) - len - 1);
-        }
-        strncat(filepath, DEFAULT_INDEX, sizeof(filepath) - strlen(filepath) - 1);
-    }
+/* The signals the main thread waits for; other threads keep them blocked */
+static void server_signals(sigset_t *set) {
+    sigemptyset(set);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGHUP);
+    sigaddset(set, SIGQUIT);
+    sigaddset(set, SIGUSR2);
+}
 
-    int fd = open(filepath, O_RDONLY);
-    if (fd < 0) {
-        send_http_response(res, HTTP_NOT_FOUND, "text/html",
-                          "<h1>404 Not Found</h1>", 23);
+/* Have the log thread reopen the log, starting it the first time */
+static void access_log_reopen(void) {
+    __atomic_store_n(&log_reopen, 1, __ATOMIC_RELEASE);
+    if (log_thread_running) {
+        pthread_mutex_lock(&log_lock);
+        pthread_cond_signal(&log_wake);
+        pthread_mutex_unlock(&log_lock);
         return;
     }
 
-    if (fstat(fd, &st) < 0) {
-        close(fd);
-        send_http_response(res, HTTP_INTERNAL_ERROR, "text/html",
-                          "<h1>500 Internal Server Error</h1>", 35);
+    log_writer_t *lw = malloc(sizeof(*lw));
+    if (!lw) {
+        fprintf(stderr, "Out of memory starting the access log\n");
         return;
     }
+    lw->fd = -1;
+    lw->used = 0;
+    lw->stamp_second = -1;
 
-    char *file_content = malloc(st.st_size);
-    if (!file_content) {
-        close(fd);
-        send_http_response(res, HTTP_INTERNAL_ERROR, "text/html",
-                          "<h1>500 Internal Server Error</h1>", 35);
-        return;
+    sigset_t signals, old_mask;
+    server_signals(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_mask);
+    if (pthread_create(&log_thread, NULL, access_log_main, lw) != 0) {
+        perror("pthread_create");
+        free(lw);
+    } else {
+        log_thread_running = 1;
     }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
 
-    ssize_t bytes_read = read(fd, file_content, st.st_size);
-    close(fd);
-
-    if (bytes_read != st.st_size) {
-        free(file_content);
-        send_http_response(res, HTTP_INTERNAL_ERROR, "text/html",
-                          "<h1>500 Internal Server Error</h1>", 35);
+/* Stop the log thread once everything queued has been written */
+static void access_log_stop(void) {
+    if (!log_thread_running) {
         return;
     }
-
-    const char *mime_type = get_mime_type(filepath);
-    send_http_response(res, HTTP_OK, mime_type, file_content, st.st_size);
-
-    free(file_content);
+    pthread_mutex_lock(&log_lock);
+    __atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&log_wake);
+    pthread_mutex_unlock(&log_lock);
+    pthread_join(log_thread, NULL);
+    log_thread_running = 0;
 }
 
-/* Route handlers */
-static void handle_home(const request_t *req, response_t *res) {
-    (void)req;
-    const char *body = "<h1>Welcome!</h1><p>Simple C HTTP Server</p>";
-    send_http_response(res, HTTP_OK, "text/html", body, strlen(body));
+/* Append the current Date header line */
+static int response_append_date(response_t *res) {
+    return response_append(res, date_header(), DATE_HEADER_LEN);
 }
 
-static void handle_about(const request_t *req, response_t *res) {
-    (void)req;
-    const char *body = "<h1>About</h1><p>Multithreaded C Server with Static Files</p>";
-    send_http_response(res, HTTP_OK, "text/html", body, strlen(body));
+/* Close a header block with Date and the connection disposition */
+static void response_end_headers(response_t *res) {
+    response_append_date(res);
+    response_printf(res, "Connection: %s\r\n\r\n", res->keep_alive ? "keep-alive" : "close");
 }
 
-static void handle_health(const request_t *req, response_t *res) {
-    (void)req;
-    const char *body = "{\"status\":\"healthy\",\"threads\":\"enabled\"}";
-    send_http_response(res, HTTP_OK, "application/json", body, strlen(body));
+/* Reason phrase for a status code */
+static const char *http_status_text(int status) {
+    switch (status) {
+        case HTTP_OK: return "OK";
+        case HTTP_PARTIAL_CONTENT: return "Partial Content";
+        case HTTP_NOT_MODIFIED: return "Not Modified";
+        case HTTP_BAD_REQUEST: return "Bad Request";
+        case HTTP_NOT_FOUND: return "Not Found";
+        case HTTP_METHOD_NOT_ALLOWED: return "Method Not Allowed";
+        case HTTP_REQUEST_TIMEOUT: return "Request Timeout";
+        case HTTP_PAYLOAD_TOO_LARGE: return "Payload Too Large";
+        case HTTP_RANGE_NOT_SATISFIABLE: return "Range Not Satisfiable";
+        case HTTP_INTERNAL_ERROR: return "Internal Server Error";
+        case HTTP_SERVICE_UNAVAILABLE: return "Service Unavailable";
+        default: return "Unknown";
+    }
 }
 
-/* Find and execute route handler */
-static int handle_dynamic_route(const request_t *req, response_t *res) {
-    for (const route_t *route = routes; route->path; route++) {
-        if (strcmp(req->path, route->path) == 0) {
-            route->handler(req, res);
-            return 1;
-        }
+/* Header lines after the status line and Date, for a body of body_len bytes */
+static void send_header_fields(response_t *res, int status, const char *content_type,
+                               size_t body_len) {
+    response_printf(res, "Content-Type: %s\r\n", content_type);
+    response_printf(res, "Content-Length: %zu\r\n", body_len);
+    if (status == HTTP_SERVICE_UNAVAILABLE) {
+        response_printf(res, "Retry-After: %d\r\n", RETRY_AFTER_SECS);
     }
-    return 0;
+    /* A handler that was already running when a drain began still announces the close */
+    if (draining) {
+        res->keep_alive = 0;
+    }
+    response_printf(res, "Connection: %s\r\n", res->keep_alive ? "keep-alive" : "close");
+    response_printf(res, "\r\n");
 }
 
-/* Main request handler */
-static void handle_request(int client_fd) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read = read(client_fd, buffer, sizeof(buffer) - 1);
+/* Send HTTP status line and headers for a body of body_len bytes */
+static void send_http_headers(response_t *res, int status, const char *content_type,
+                              size_t body_len) {
+    res->status = status;
+    response_printf(res, "HTTP/1.1 %d %s\r\n", status, http_status_text(status));
+    response_append_date(res);
+    send_header_fields(res, status, content_type, body_len);
+}
 
-    if (bytes_read <= 0) {
-        return;
-    }
+/* Send HTTP response with status, copying body into the response */
+static void send_http_response(response_t *res, int status, const char *content_type,
+                               const char *body, size_t body_len) {
+    send_http_headers(res, status, content_type, body_len);
 
-    buffer[bytes_read] = '\0';
+    if (body && body_len > 0) {
+        response_append(res, body, body_len);
+    }
+}
 
-    char method[MAX_METHOD_SIZE];
-    char path[MAX_PATH_SIZE];
-    char query_string[MAX_PATH_SIZE];
+/* Send a minimal HTML error page for status */
+static void send_http_error(response_t *res, int status) {
+    char body[128];
+    int len = snprintf(body, sizeof(body), "<h1>%d %s</h1>", status, http_status_text(status));
+    send_http_response(res, status, "text/html", body, len);
+}
 
+/*
+ * Stream the request body to on_data as it arrives rather than discarding
+ * it. on_data returns 0 to keep reading, or an HTTP status to answer with
+ * instead, closing the connection. on_end builds the response once the
+ * body is complete. ctx must outlive the handler, e.g. come from
+ * response_alloc().
+ */
+static void request_stream_body(response_t *res,
+                                int (*on_data)(void *ctx, const char *data, size_t len),
+                                void (*on_end)(void *ctx, response_t *res), void *ctx) {
+    res->on_body = on_data;
+    res->on_body_end = on_end;
+    res->body_ctx = ctx;
+}
+
+/*
+ * Send the body as it is produced instead of building it up front. Once
+ * the headers, and later each piece, have been written to the socket,
+ * produce(ctx, res) appends the next piece with response_append() or
+ * response_printf(), ideally around STREAM_CHUNK_SIZE bytes. It returns 1
+ * while more follows, 0 after the last piece, or -1 to drop the
+ * connection. Pieces go out as Transfer-Encoding: chunked; HTTP/1.0
+ * clients get the raw bytes and the connection closes at the end. ctx must
+ * outlive the stream, e.g. come from response_alloc().
+ */
+static void response_stream(response_t *res, int status, const char *content_type,
+                            int (*produce)(void *ctx, response_t *res), void *ctx) {
+    if (!res->allow_chunked) {
+        res->keep_alive = 0;
+    }
+    res->status = status;
+    response_printf(res, "HTTP/1.1 %d %s\r\n", status, http_status_text(status));
+    response_printf(res, "Content-Type: %s\r\n", content_type);
+    if (res->allow_chunked) {
+        response_printf(res, "Transfer-Encoding: chunked\r\n");
+    }
+    response_end_headers(res);
+    res->produce = produce;
+    res->produce_ctx = ctx;
+    res->stream_chunked = res->allow_chunked;
+}
+
+/* Find a request header by name, returning its value and length or NULL */
+static const char *request_header(const request_t *req, const char *name, size_t *len) {
+    for (size_t i = 0; i < req->num_headers; i++) {
+        const http_header_t *h = &req->headers[i];
+        if (header_name_is(req->head, h, name)) {
+            *len = h->value_len;
+            return req->head + h->value_off;
+        }
+    }
+    return NULL;
+}
+
+/* FNV-1a over an extension, folding ASCII case */
+static uint64_t mime_hash(const char *ext) {
+    uint64_t h = 14695981039346656037ULL;
+    for (; *ext; ext++) {
+        unsigned char c = (unsigned char)*ext;
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Slot for a hash under a bucket's displacement (murmur3's finalizer) */
+static uint32_t mime_slot(uint64_t h, uint32_t displace, uint32_t mask) {
+    uint32_t x = (uint32_t)h ^ (displace * 0x9e3779b9u);
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x & mask;
+}
+
+/*
+ * Find each bucket a displacement that puts all its extensions in free
+ * slots, largest buckets first while the table is emptiest. Returns -1 if
+ * some bucket finds none, for the caller to retry with a bigger table.
+ */
+static int mime_index_place(mime_index_t *ix, const mime_type_t **keys, const uint64_t *hashes,
+                            const int *next, const int *heads, const uint32_t *sizes,
+                            uint32_t max_size) {
+    for (uint32_t size = max_size; size > 0; size--) {
+        for (uint32_t b = 0; b < ix->num_buckets; b++) {
+            if (sizes[b] != size) {
+                continue;
+            }
+            uint32_t d;
+            for (d = 1; d <= MIME_DISPLACE_TRIES; d++) {
+                int k;
+                for (k = heads[b]; k >= 0; k = next[k]) {
+                    uint32_t slot = mime_slot(hashes[k], d, ix->mask);
+                    if (ix->slots[slot]) {
+                        break;
+                    }
+                    ix->slots[slot] = keys[k];
+                }
+                if (k < 0) {
+                    break;
+                }
+                /* Undo this attempt's placements, up to the clash */
+                for (int j = heads[b]; j != k; j = next[j]) {
+                    ix->slots[mime_slot(hashes[j], d, ix->mask)] = NULL;
+                }
+            }
+            if (d > MIME_DISPLACE_TRIES) {
+                return -1;
+            }
+            ix->displace[b] = d;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Build the index over overrides (may be NULL) and mime_types[]. Where an
+ * extension appears twice the first one wins; duplicates always hash to
+ * the same bucket, which is where they are dropped. Returns NULL if out
+ * of memory.
+ */
+static mime_index_t *mime_index_build(const mime_type_t *overrides) {
+    const mime_type_t *lists[2] = {overrides, mime_types};
+    mime_index_t *ix = NULL;
+    size_t n = 0;
+
+    for (int l = 0; l < 2; l++) {
+        for (const mime_type_t *mt = lists[l]; mt && mt->extension; mt++) {
+            n++;
+        }
+    }
+    uint32_t num_buckets = (uint32_t)(n / MIME_BUCKET_SIZE + 1);
+    const mime_type_t **keys = malloc((n + 1) * sizeof(*keys));
+    uint64_t *hashes = malloc((n + 1) * sizeof(*hashes));
+    int *next = malloc((n + 1) * sizeof(*next));
+    int *heads = malloc(num_buckets * sizeof(*heads));
+    uint32_t *sizes = calloc(num_buckets, sizeof(*sizes));
+    if (!keys || !hashes || !next || !heads || !sizes) {
+        goto out;
+    }
+
+    size_t count = 0;
+    uint32_t max_size = 0;
+    for (uint32_t b = 0; b < num_buckets; b++) {
+        heads[b] = -1;
+    }
+    for (int l = 0; l < 2; l++) {
+        for (const mime_type_t *mt = lists[l]; mt && mt->extension; mt++) {
+            uint64_t h = mime_hash(mt->extension);
+            uint32_t b = (uint32_t)(h >> 32) % num_buckets;
+            int k;
+            for (k = heads[b]; k >= 0; k = next[k]) {
+                if (strcasecmp(keys[k]->extension, mt->extension) == 0) {
+                    break;
+                }
+            }
+            if (k >= 0) {
+                continue;
+            }
+            keys[count] = mt;
+            hashes[count] = h;
+            next[count] = heads[b];
+            heads[b] = (int)count;
+            if (++sizes[b] > max_size) {
+                max_size = sizes[b];
+            }
+            count++;
+        }
+    }
+
+    /* About one slot in five stays empty, which keeps displacements short */
+    uint32_t num_slots = 1;
+    while (num_slots < count + count / 4) {
+        num_slots <<= 1;
+    }
+    for (;;) {
+        ix = calloc(1, sizeof(*ix) + num_buckets * sizeof(uint32_t) +
+                       num_slots * sizeof(const mime_type_t *));
+        if (!ix) {
+            goto out;
+        }
+        ix->num_buckets = num_buckets;
+        ix->mask = num_slots - 1;
+        ix->slots = (const mime_type_t **)(ix + 1);
+        ix->displace = (uint32_t *)(ix->slots + num_slots);
+        if (mime_index_place(ix, keys, hashes, next, heads, sizes, max_size) == 0) {
+            break;
+        }
+        free(ix);
+        ix = NULL;
+        num_slots <<= 1;
+    }
+
+out:
+    free(keys);
+    free(hashes);
+    free(next);
+    free(heads);
+    free(sizes);
+    return ix;
+}
+
+/* Get MIME type and caching policy from file extension */
+static const mime_type_t *get_mime_type(const char *path) {
+    const char *dot = strrchr(path, '.');
+    const mime_index_t *ix = __atomic_load_n(&mime_index, __ATOMIC_ACQUIRE);
+    if (!dot || !ix) {
+        return &default_mime_type;
+    }
+
+    uint64_t h = mime_hash(dot);
+    uint32_t b = (uint32_t)(h >> 32) % ix->num_buckets;
+    const mime_type_t *mt = ix->slots[mime_slot(h, ix->displace[b], ix->mask)];
+    if (mt && strcasecmp(dot, mt->extension) == 0) {
+        return mt;
+    }
+    return &default_mime_type;
+}
+
+/* True if an Accept-Encoding q-value, starting after "q=", is zero */
+static int qvalue_is_zero(const char *s, size_t len) {
+    size_t i = 0;
+    if (i >= len || s[i] != '0') {
+        return 0;
+    }
+    i++;
+    if (i < len && s[i] == '.') {
+        i++;
+        while (i < len && s[i] == '0') {
+            i++;
+        }
+    }
+    return i == len || s[i] == ' ' || s[i] == '\t' || s[i] == ';' || s[i] == ',';
+}
+
+/*
+ * Bitmask of content codings an Accept-Encoding value allows. A coding
+ * listed with q=0 is refused even when "*" would otherwise allow it;
+ * x-gzip is an alias for gzip.
+ */
+static unsigned accepted_codings(const char *value, size_t len) {
+    unsigned allowed = 0;
+    unsigned refused = 0;
+    int wildcard = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && value[i] != ',' && value[i] != ';' && value[i] != ' ' &&
+               value[i] != '\t') {
+            i++;
+        }
+        size_t name_len = i - start;
+
+        int zero = 0;
+        while (i < len && value[i] != ',') {
+            if ((value[i] == 'q' || value[i] == 'Q') && i + 1 < len && value[i + 1] == '=') {
+                zero = qvalue_is_zero(value + i + 2, len - i - 2);
+            }
+            i++;
+        }
+        if (name_len == 0) {
+            continue;
+        }
+
+        if (name_len == 1 && value[start] == '*') {
+            wildcard = !zero;
+            continue;
+        }
+        for (int c = 0; c < NUM_CODINGS; c++) {
+            const char *name = content_codings[c].name;
+            int match = name_len == strlen(name) && strncasecmp(value + start, name, name_len) == 0;
+            if (c == CODING_GZIP && name_len == 6 && strncasecmp(value + start, "x-gzip", 6) == 0) {
+                match = 1;
+            }
+            if (match) {
+                if (zero) {
+                    refused |= 1u << c;
+                } else {
+                    allowed |= 1u << c;
+                }
+            }
+        }
+    }
+
+    if (wildcard) {
+        allowed |= (1u << NUM_CODINGS) - 1;
+    }
+    return allowed & ~refused;
+}
+
+#ifdef HAVE_ZLIB
+/* Gzip-compress data into a malloc'd buffer */
+static char *compress_gzip(const char *data, size_t len, size_t *out_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    size_t cap = deflateBound(&zs, len);
+    char *out = malloc(cap);
+    if (!out) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = cap;
+    int rc = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+#endif
+
+#ifdef HAVE_BROTLI
+/* Brotli-compress data into a malloc'd buffer */
+static char *compress_brotli(const char *data, size_t len, size_t *out_len) {
+    size_t cap = BrotliEncoderMaxCompressedSize(len);
+    char *out = cap ? malloc(cap) : NULL;
+    if (!out) {
+        return NULL;
+    }
+
+    *out_len = cap;
+    if (!BrotliEncoderCompress(COMPRESS_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               len, (const uint8_t *)data, out_len, (uint8_t *)out)) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+#endif
+
+/* Whether this build can compress with a coding */
+static int compress_body_available(int coding) {
+#ifdef HAVE_BROTLI
+    if (coding == CODING_BR) {
+        return 1;
+    }
+#endif
+#ifdef HAVE_ZLIB
+    if (coding == CODING_GZIP) {
+        return 1;
+    }
+#endif
+    (void)coding;
+    return 0;
+}
+
+/* Compress data with a content coding, or return NULL if this build lacks it */
+static char *compress_body(int coding, const char *data, size_t len, size_t *out_len) {
+    switch (coding) {
+#ifdef HAVE_BROTLI
+        case CODING_BR:
+            return compress_brotli(data, len, out_len);
+#endif
+#ifdef HAVE_ZLIB
+        case CODING_GZIP:
+            return compress_gzip(data, len, out_len);
+#endif
+        default:
+            (void)data;
+            (void)len;
+            (void)out_len;
+            return NULL;
+    }
+}
+
+/* Format a time as an IMF-fixdate for HTTP date headers */
+static void http_date(time_t t, char *buf, size_t size) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* Parse an IMF-fixdate header value, or return -1 */
+static time_t http_date_parse(const char *value, size_t len) {
+    char buf[HTTP_DATE_SIZE];
+    struct tm tm;
+
+    if (len >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+/* Strong validator for one representation of a file, from its stat data */
+static void file_etag(char *buf, size_t size, const struct timespec *mtime, size_t file_size,
+                      int coding) {
+    snprintf(buf, size, "\"%llx.%lx-%zx%s%s\"", (unsigned long long)mtime->tv_sec,
+             (unsigned long)mtime->tv_nsec, file_size, coding != CODING_IDENTITY ? "-" : "",
+             coding != CODING_IDENTITY ? content_codings[coding].name : "");
+}
+
+/* Check an If-None-Match list against an entity tag, comparing weakly */
+static int etag_list_matches(const char *value, size_t len, const char *etag) {
+    size_t etag_len = strlen(etag);
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && value[i] != ',') {
+            i++;
+        }
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) {
+            end--;
+        }
+        if (end - start == 1 && value[start] == '*') {
+            return 1;
+        }
+        if (end - start > 2 && value[start] == 'W' && value[start + 1] == '/') {
+            start += 2;
+        }
+        if (end - start == etag_len && memcmp(value + start, etag, etag_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Evaluate a GET's preconditions against a representation. If-None-Match
+ * takes precedence; If-Modified-Since is only consulted without it.
+ */
+static int request_not_modified(const request_t *req, const char *etag, time_t mtime) {
+    size_t len;
+    const char *value = request_header(req, "If-None-Match", &len);
+    if (value) {
+        return etag_list_matches(value, len, etag);
+    }
+
+    value = request_header(req, "If-Modified-Since", &len);
+    if (value) {
+        time_t since = http_date_parse(value, len);
+        return since >= 0 && mtime <= since;
+    }
+    return 0;
+}
+
+/*
+ * Format the status line and headers of a file response, all but Date
+ * and Connection. A 304 carries only the validators and caching policy.
+ * Returns the length, or -1 if it does not fit.
+ */
+static int format_file_headers(char *buf, size_t size, int status, const mime_type_t *mime,
+                               size_t body_len, int coding, const char *etag,
+                               const char *last_modified) {
+    int len = snprintf(buf, size, "HTTP/1.1 %d %s\r\n", status, http_status_text(status));
+    if (status != HTTP_NOT_MODIFIED && len >= 0 && (size_t)len < size) {
+        len += snprintf(buf + len, size - len, "Content-Type: %s\r\nContent-Length: %zu\r\n",
+                        mime->mime_type, body_len);
+        if (coding != CODING_IDENTITY && (size_t)len < size) {
+            len += snprintf(buf + len, size - len, "Content-Encoding: %s\r\n",
+                            content_codings[coding].name);
+        }
+        if (status == HTTP_OK && (size_t)len < size) {
+            len += snprintf(buf + len, size - len, "Accept-Ranges: bytes\r\n");
+        }
+    }
+    if (len >= 0 && (size_t)len < size) {
+        len += snprintf(buf + len, size - len, "ETag: %s\r\nLast-Modified: %s\r\n%s%s%s%s",
+                        etag, last_modified, mime->cache_control ? "Cache-Control: " : "",
+                        mime->cache_control ? mime->cache_control : "",
+                        mime->cache_control ? "\r\n" : "",
+                        mime->compressible ? "Vary: Accept-Encoding\r\n" : "");
+    }
+    if (len < 0 || (size_t)len >= size) {
+        return -1;
+    }
+    return len;
+}
+
+/* Answer a satisfied conditional GET with a body-less 304 */
+static void send_not_modified(response_t *res, const mime_type_t *mime, int coding,
+                              const char *etag, const char *last_modified) {
+    char header[512];
+    int len = format_file_headers(header, sizeof(header), HTTP_NOT_MODIFIED, mime, 0, coding,
+                                  etag, last_modified);
+    if (len < 0) {
+        send_http_error(res, HTTP_INTERNAL_ERROR);
+        return;
+    }
+    res->status = HTTP_NOT_MODIFIED;
+    response_append(res, header, len);
+    response_end_headers(res);
+}
+
+/* Byte range of a representation, clipped to its size */
+typedef struct {
+    size_t start;
+    size_t len;
+} byte_range_t;
+
+/* A representation of a file being answered: inline bytes or a descriptor */
+typedef struct {
+    const mime_type_t *mime;
+    int coding;
+    const char *etag;
+    const char *last_modified;
+    const char *body;  /* NULL to send from fd */
+    int fd;
+    int fd_borrowed;
+    size_t size;
+} file_view_t;
+
+/* Parse a decimal range bound at *i, saturating instead of overflowing */
+static int parse_range_number(const char *value, size_t len, size_t *i, size_t *out) {
+    size_t n = 0;
+    size_t start = *i;
+    while (*i < len && value[*i] >= '0' && value[*i] <= '9') {
+        size_t digit = value[*i] - '0';
+        n = n > (SIZE_MAX - digit) / 10 ? SIZE_MAX : n * 10 + digit;
+        (*i)++;
+    }
+    *out = n;
+    return *i > start ? 0 : -1;
+}
+
+/*
+ * Sort ranges by start and coalesce those that overlap or touch, so a
+ * request repeating one range cannot make the body grow with the count.
+ * Returns the number left.
+ */
+static int merge_ranges(byte_range_t *ranges, int n) {
+    for (int i = 1; i < n; i++) {
+        byte_range_t r = ranges[i];
+        int j = i;
+        for (; j > 0 && ranges[j - 1].start > r.start; j--) {
+            ranges[j] = ranges[j - 1];
+        }
+        ranges[j] = r;
+    }
+
+    int out = 0;
+    for (int i = 0; i < n; i++) {
+        byte_range_t *prev = out > 0 ? &ranges[out - 1] : NULL;
+        if (prev && ranges[i].start <= prev->start + prev->len) {
+            size_t end = ranges[i].start + ranges[i].len;
+            if (end > prev->start + prev->len) {
+                prev->len = end - prev->start;
+            }
+        } else {
+            ranges[out++] = ranges[i];
+        }
+    }
+    return out;
+}
+
+/*
+ * Parse a Range header for a representation of size bytes. Returns the
+ * number of satisfiable ranges after merging (0 means 416), or -1 if the
+ * header is to be ignored: another unit, malformed, or more than
+ * MAX_RANGES ranges.
+ */
+static int parse_range(const char *value, size_t len, size_t size, byte_range_t *ranges) {
+    int n = 0;
+    int specs = 0;
+    size_t i = 6;
+
+    if (len < 6 || strncasecmp(value, "bytes=", 6) != 0) {
+        return -1;
+    }
+
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        if (i == len) {
+            break;
+        }
+
+        size_t first = 0;
+        size_t last = 0;
+        int suffix = value[i] == '-';
+        if (!suffix && parse_range_number(value, len, &i, &first) < 0) {
+            return -1;
+        }
+        if (i == len || value[i] != '-') {
+            return -1;
+        }
+        i++;
+        int have_last = parse_range_number(value, len, &i, &last) == 0;
+        if (suffix && !have_last) {
+            return -1;
+        }
+        while (i < len && (value[i] == ' ' || value[i] == '\t')) {
+            i++;
+        }
+        if ((i < len && value[i] != ',') || (have_last && !suffix && last < first)) {
+            return -1;
+        }
+        if (++specs > MAX_RANGES) {
+            return -1;
+        }
+
+        if (suffix) {
+            if (last == 0 || size == 0) {
+                continue;
+            }
+            size_t take = last < size ? last : size;
+            ranges[n].start = size - take;
+            ranges[n].len = take;
+        } else {
+            if (first >= size) {
+                continue;
+            }
+            size_t end = have_last && last < size - 1 ? last : size - 1;
+            ranges[n].start = first;
+            ranges[n].len = end - first + 1;
+        }
+        n++;
+    }
+
+    return specs > 0 ? merge_ranges(ranges, n) : -1;
+}
+
+/*
+ * Ranges requested for a representation, or -1 if the whole body should
+ * be sent. An If-Range validator that no longer matches voids the Range.
+ */
+static int request_ranges(const request_t *req, const file_view_t *f, byte_range_t *ranges) {
+    size_t len;
+    const char *value = request_header(req, "Range", &len);
+    if (!value) {
+        return -1;
+    }
+
+    size_t cond_len;
+    const char *cond = request_header(req, "If-Range", &cond_len);
+    if (cond) {
+        const char *validator = cond_len > 0 && cond[0] == '"' ? f->etag : f->last_modified;
+        if (cond_len != strlen(validator) || memcmp(cond, validator, cond_len) != 0) {
+            return -1;
+        }
+    }
+
+    return parse_range(value, len, f->size, ranges);
+}
+
+/*
+ * Answer a Range request with 206 (one part, or multipart/byteranges) or
+ * 416. Bodies are referenced in place or sent from the descriptor with
+ * sendfile(), so only the requested bytes are read. Returns 0, leaving
+ * the response untouched, when the full body should be sent instead,
+ * which includes a multipart body no smaller than the file itself.
+ */
+static int send_file_ranges(const request_t *req, response_t *res, const file_view_t *f) {
+    byte_range_t ranges[MAX_RANGES];
+    int n = request_ranges(req, f, ranges);
+    if (n < 0) {
+        return 0;
+    }
+
+    /* Parts are sized before anything is written, in case 200 is cheaper */
+    static const char part_fmt[] = "\r\n--%s\r\nContent-Type: %s\r\n"
+                                   "Content-Range: bytes %zu-%zu/%zu\r\n\r\n";
+    char boundary[24];
+    size_t body_len = 0;
+    if (n > 1) {
+        snprintf(boundary, sizeof(boundary), "%016llx", (unsigned long long)monotonic_ns());
+        body_len = strlen(boundary) + 8;
+        for (int k = 0; k < n; k++) {
+            body_len += snprintf(NULL, 0, part_fmt, boundary, f->mime->mime_type,
+                                 ranges[k].start, ranges[k].start + ranges[k].len - 1,
+                                 f->size) + ranges[k].len;
+        }
+        if (body_len >= f->size) {
+            return 0;
+        }
+    }
+
+    if (f->fd >= 0) {
+        res->file_fd = f->fd;
+        res->file_borrowed = f->fd_borrowed;
+        res->file_off = 0;
+        res->file_len = 0;
+    }
+
+    char header[512];
+    int len;
+
+    if (n == 0) {
+        len = format_file_headers(header, sizeof(header), HTTP_RANGE_NOT_SATISFIABLE, f->mime, 0,
+                                  f->coding, f->etag, f->last_modified);
+        if (len < 0) {
+            send_http_error(res, HTTP_INTERNAL_ERROR);
+            return 1;
+        }
+        res->status = HTTP_RANGE_NOT_SATISFIABLE;
+        response_append(res, header, len);
+        response_printf(res, "Content-Range: bytes */%zu\r\n", f->size);
+        response_end_headers(res);
+        return 1;
+    }
+
+    if (n == 1) {
+        len = format_file_headers(header, sizeof(header), HTTP_PARTIAL_CONTENT, f->mime,
+                                  ranges[0].len, f->coding, f->etag, f->last_modified);
+        if (len < 0) {
+            send_http_error(res, HTTP_INTERNAL_ERROR);
+            return 1;
+        }
+        res->status = HTTP_PARTIAL_CONTENT;
+        response_append(res, header, len);
+        response_printf(res, "Content-Range: bytes %zu-%zu/%zu\r\n", ranges[0].start,
+                        ranges[0].start + ranges[0].len - 1, f->size);
+        response_end_headers(res);
+        if (f->body) {
+            response_add_ref(res, f->body + ranges[0].start, ranges[0].len);
+        } else {
+            res->file_off = ranges[0].start;
+            res->file_len = ranges[0].len;
+        }
+        return 1;
+    }
+
+    /* Each part's headers go in the slab between the body segments */
+    char content_type[96];
+    snprintf(content_type, sizeof(content_type), "multipart/byteranges; boundary=%s", boundary);
+    mime_type_t multipart = *f->mime;
+    multipart.mime_type = content_type;
+
+    len = format_file_headers(header, sizeof(header), HTTP_PARTIAL_CONTENT, &multipart, body_len,
+                              f->coding, f->etag, f->last_modified);
+    if (len < 0) {
+        send_http_error(res, HTTP_INTERNAL_ERROR);
+        return 1;
+    }
+    res->status = HTTP_PARTIAL_CONTENT;
+    response_append(res, header, len);
+    response_end_headers(res);
+    for (int k = 0; k < n; k++) {
+        response_printf(res, part_fmt, boundary, f->mime->mime_type, ranges[k].start,
+                        ranges[k].start + ranges[k].len - 1, f->size);
+        if (f->body) {
+            response_add_ref(res, f->body + ranges[k].start, ranges[k].len);
+        } else {
+            response_add_file_range(res, ranges[k].start, ranges[k].len);
+        }
+    }
+    response_printf(res, "\r\n--%s--\r\n", boundary);
+    return 1;
+}
+
+/*
+ * Static file cache, keyed by the filesystem path a request maps to.
+ * Small files are held as prebuilt headers plus body; larger ones keep an
+ * open descriptor for sendfile(). Each shard has its own lock, hash table
+ * and LRU list, and entries are revalidated against stat() at most once
+ * per FILE_CACHE_CHECK_SECS.
+ *
+ * Encoded variants live under "<key> <coding>". They come from a sidecar
+ * file, or from compressing the identity body once, or are negative
+ * entries recording that the coding is unavailable. The latter two are
+ * checked against the source file and against a sidecar appearing.
+ */
+typedef struct file_cache_entry {
+    uint64_t hash;
+    char *key;
+    char *path;
+    char *header;        /* all but Date and Connection */
+    size_t header_len;
+    char *body;
+    int fd;
+    int mapped;
+    size_t size;
+    const mime_type_t *mime;
+    int coding;
+    int probe;
+    int negative;
+    size_t file_size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char etag[FILE_ETAG_SIZE];
+    char last_modified[HTTP_DATE_SIZE];
+    time_t checked_at;
+    size_t charge;
+    int refs;
+    int linked;
+    struct file_cache_shard *shard;
+    struct file_cache_entry *hnext;
+    struct file_cache_entry *prev;
+    struct file_cache_entry *next;
+} file_cache_entry_t;
+
+typedef struct file_cache_shard {
+    pthread_mutex_t lock;
+    file_cache_entry_t *buckets[FILE_CACHE_BUCKETS];
+    file_cache_entry_t *lru_head;
+    file_cache_entry_t *lru_tail;
+    size_t bytes;
+    size_t entries;
+} file_cache_shard_t;
+
+static file_cache_shard_t file_cache[FILE_CACHE_SHARDS];
+
+/* FNV-1a hash of a path */
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *s = (const unsigned char *)path; *s; s++) {
+        h ^= *s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Initialize shard locks */
+static void file_cache_init(void) {
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        memset(&file_cache[i], 0, sizeof(file_cache[i]));
+        pthread_mutex_init(&file_cache[i].lock, NULL);
+    }
+}
+
+/* Free an entry that is unlinked and unreferenced */
+static void file_cache_entry_free(file_cache_entry_t *e) {
+    if (e->fd >= 0) {
+        close(e->fd);
+    }
+    if (e->mapped) {
+        munmap(e->body, e->size);
+    }
+    free(e);
+}
+
+/* Remove an entry from its shard; caller holds the shard lock */
+static void file_cache_unlink(file_cache_shard_t *shard, file_cache_entry_t *e) {
+    file_cache_entry_t **pp = &shard->buckets[e->hash % FILE_CACHE_BUCKETS];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        shard->lru_head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        shard->lru_tail = e->prev;
+    }
+
+    shard->bytes -= e->charge;
+    shard->entries--;
+    e->linked = 0;
+}
+
+/* Drop a reference taken by a lookup or insert */
+static void file_cache_release(void *arg) {
+    file_cache_entry_t *e = arg;
+    file_cache_shard_t *shard = e->shard;
+
+    pthread_mutex_lock(&shard->lock);
+    int free_it = --e->refs == 0 && !e->linked;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (free_it) {
+        file_cache_entry_free(e);
+    }
+}
+
+/* Unlink an entry unless another thread already did */
+static void file_cache_invalidate(file_cache_entry_t *e) {
+    file_cache_shard_t *shard = e->shard;
+
+    pthread_mutex_lock(&shard->lock);
+    if (e->linked) {
+        file_cache_unlink(shard, e);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* Check an entry against the file it was built from */
+static int file_cache_fresh(const file_cache_entry_t *e) {
+    struct stat st;
+    if (stat(e->path, &st) < 0 || st.st_ino != e->ino || st.st_dev != e->dev ||
+        (size_t)st.st_size != e->file_size || st.st_mtim.tv_sec != e->mtime.tv_sec ||
+        st.st_mtim.tv_nsec != e->mtime.tv_nsec) {
+        return 0;
+    }
+
+    if (e->probe) {
+        char sidecar[MAX_PATH_SIZE * 2 + 8];
+        snprintf(sidecar, sizeof(sidecar), "%s%s", e->path, content_codings[e->coding].suffix);
+        if (stat(sidecar, &st) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void file_cache_map(const file_cache_entry_t *e);
+
+/* Find a live entry for key and take a reference, or return NULL */
+static file_cache_entry_t *file_cache_lookup(const char *key) {
+    if (file_cache_size == 0) {
+        return NULL;
+    }
+
+    uint64_t hash = hash_path(key);
+    file_cache_shard_t *shard = &file_cache[hash % FILE_CACHE_SHARDS];
+    file_cache_entry_t *e;
+    time_t now = monotonic_seconds();
+    int check = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    for (e = shard->buckets[hash % FILE_CACHE_BUCKETS]; e; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            break;
+        }
+    }
+    if (e) {
+        e->refs++;
+        if (now - e->checked_at >= FILE_CACHE_CHECK_SECS) {
+            e->checked_at = now;
+            check = 1;
+        }
+        if (e != shard->lru_head) {
+            e->prev->next = e->next;
+            if (e->next) {
+                e->next->prev = e->prev;
+            } else {
+                shard->lru_tail = e->prev;
+            }
+            e->prev = NULL;
+            e->next = shard->lru_head;
+            shard->lru_head->prev = e;
+            shard->lru_head = e;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (e && check) {
+        if (!file_cache_fresh(e)) {
+            file_cache_invalidate(e);
+            file_cache_release(e);
+            e = NULL;
+        } else {
+            file_cache_map(e);
+        }
+    }
+
+    if (e) {
+        STAT_ADD(cache_hits, 1);
+    } else {
+        STAT_ADD(cache_misses, 1);
+    }
+    return e;
+}
+
+/* Where a cache entry's body lives */
+enum {
+    FILE_BODY_FD,      /* open descriptor, sent with sendfile() */
+    FILE_BODY_INLINE,  /* heap copy after the entry */
+    FILE_BODY_MAPPED   /* shared read-only mapping of the file (-m) */
+};
+
+/*
+ * Allocate an entry describing the file at path, with prebuilt headers for
+ * a body of size bytes in the given coding, and room for the body itself
+ * if it is to be inline. Inline and mapped bodies count against the cache
+ * budget. Returns NULL if it would not fit the cache.
+ */
+static file_cache_entry_t *file_cache_alloc(const char *key, const char *path,
+                                            const struct stat *st, const mime_type_t *mime,
+                                            int coding, size_t size, int body_mode) {
+    if (file_cache_size == 0) {
+        return NULL;
+    }
+
+    size_t shard_budget = file_cache_size / FILE_CACHE_SHARDS;
+    char etag[FILE_ETAG_SIZE];
+    char last_modified[HTTP_DATE_SIZE];
+    file_etag(etag, sizeof(etag), &st->st_mtim, st->st_size, coding);
+    http_date(st->st_mtim.tv_sec, last_modified, sizeof(last_modified));
+
+    char header[512];
+    int header_len = format_file_headers(header, sizeof(header), HTTP_OK, mime, size, coding,
+                                         etag, last_modified);
+    if (header_len < 0) {
+        return NULL;
+    }
+
+    size_t key_len = strlen(key) + 1;
+    size_t path_len = strlen(path) + 1;
+    size_t alloc_size = sizeof(file_cache_entry_t) + key_len + path_len + header_len +
+                        (body_mode == FILE_BODY_INLINE ? size : 0);
+    size_t charge = alloc_size + (body_mode == FILE_BODY_MAPPED ? size : 0);
+    if (charge > shard_budget) {
+        return NULL;
+    }
+
+    file_cache_entry_t *e = malloc(alloc_size);
+    if (!e) {
+        return NULL;
+    }
+
+    char *p = (char *)(e + 1);
+    e->key = p;
+    memcpy(p, key, key_len);
+    p += key_len;
+    e->path = p;
+    memcpy(p, path, path_len);
+    p += path_len;
+    e->header = p;
+    e->header_len = header_len;
+    memcpy(p, header, header_len);
+    p += header_len;
+
+    e->body = body_mode == FILE_BODY_INLINE ? p : NULL;
+    e->fd = -1;
+    e->mapped = 0;
+    e->hash = hash_path(key);
+    e->size = size;
+    e->mime = mime;
+    e->coding = coding;
+    e->probe = 0;
+    e->negative = 0;
+    e->file_size = st->st_size;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    memcpy(e->etag, etag, sizeof(etag));
+    memcpy(e->last_modified, last_modified, sizeof(last_modified));
+    e->checked_at = monotonic_seconds();
+    e->charge = charge;
+    e->refs = 1;
+    e->linked = 1;
+    e->shard = &file_cache[e->hash % FILE_CACHE_SHARDS];
+    e->prev = NULL;
+    return e;
+}
+
+/*
+ * Insert a new entry, replacing any entry with the same key and evicting
+ * least recently used entries to stay within budget. The caller's
+ * reference from file_cache_alloc() is kept.
+ */
+static file_cache_entry_t *file_cache_link(file_cache_entry_t *e) {
+    file_cache_shard_t *shard = e->shard;
+    size_t shard_budget = file_cache_size / FILE_CACHE_SHARDS;
+    file_cache_entry_t *evicted = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* A concurrent miss may have inserted the same key first */
+    file_cache_entry_t **pp = &shard->buckets[e->hash % FILE_CACHE_BUCKETS];
+    for (file_cache_entry_t *old = *pp; old; old = old->hnext) {
+        if (old->hash == e->hash && strcmp(old->key, e->key) == 0) {
+            file_cache_unlink(shard, old);
+            if (old->refs == 0) {
+                old->hnext = evicted;
+                evicted = old;
+            }
+            break;
+        }
+    }
+
+    while (shard->lru_tail &&
+           (shard->bytes + e->charge > shard_budget ||
+            shard->entries >= FILE_CACHE_MAX_ENTRIES / FILE_CACHE_SHARDS)) {
+        file_cache_entry_t *victim = shard->lru_tail;
+        file_cache_unlink(shard, victim);
+        if (victim->refs == 0) {
+            victim->hnext = evicted;
+            evicted = victim;
+        }
+    }
+
+    e->hnext = *pp;
+    *pp = e;
+    e->next = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->prev = e;
+    } else {
+        shard->lru_tail = e;
+    }
+    shard->lru_head = e;
+    shard->bytes += e->charge;
+    shard->entries++;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    while (evicted) {
+        file_cache_entry_t *next = evicted->hnext;
+        file_cache_entry_free(evicted);
+        evicted = next;
+    }
+
+    return e;
+}
+
+/* Read size bytes at the start of fd, or fail if the file ends sooner */
+static int read_full(int fd, char *buf, size_t size) {
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = pread(fd, buf + got, size - got, got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+/*
+ * Build an entry for an open regular file and insert it. Takes ownership
+ * of fd when it returns an entry (with a reference held); returns NULL
+ * otherwise. With map set (-m, once the file has been found unchanged),
+ * a body that would be copied inline is mapped instead, so every worker
+ * sends straight from the page cache. The descriptor stays open beside
+ * the mapping for senders that must not touch it from user space.
+ */
+static file_cache_entry_t *file_cache_insert(const char *key, const char *path, int fd,
+                                             const struct stat *st, const mime_type_t *mime,
+                                             int coding, int map) {
+    size_t size = st->st_size;
+    int body_mode = size > FILE_CACHE_INLINE_MAX ? FILE_BODY_FD : FILE_BODY_INLINE;
+    if (map && body_mode == FILE_BODY_INLINE && size >= FILE_CACHE_MMAP_MIN) {
+        body_mode = FILE_BODY_MAPPED;
+    }
+
+    file_cache_entry_t *e = file_cache_alloc(key, path, st, mime, coding, size, body_mode);
+    if (!e) {
+        return NULL;
+    }
+
+    if (body_mode == FILE_BODY_MAPPED) {
+        void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            free(e);
+            return NULL;
+        }
+#ifdef MADV_WILLNEED
+        madvise(map, size, MADV_SEQUENTIAL);
+        madvise(map, size, MADV_WILLNEED);
+#endif
+        e->body = map;
+        e->mapped = 1;
+        e->fd = fd;
+    } else if (e->body) {
+        if (read_full(fd, e->body, size) < 0) {
+            free(e);
+            return NULL;
+        }
+        close(fd);
+    } else {
+        e->fd = fd;
+    }
+
+    return file_cache_link(e);
+}
+
+/*
+ * With -m, replace the heap copy in e by a mapping of the file once a
+ * revalidation has found it unchanged since it was read, so a file that
+ * is still being written is not mapped. e stays valid for its holders.
+ */
+static void file_cache_map(const file_cache_entry_t *e) {
+    if (!mmap_static || e->mapped || !e->body || e->probe || e->size < FILE_CACHE_MMAP_MIN) {
+        return;
+    }
+    int fd = open(e->path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_ino == e->ino && st.st_dev == e->dev &&
+        (size_t)st.st_size == e->file_size && st.st_mtim.tv_sec == e->mtime.tv_sec &&
+        st.st_mtim.tv_nsec == e->mtime.tv_nsec) {
+        file_cache_entry_t *m = file_cache_insert(e->key, e->path, fd, &st, e->mime, e->coding, 1);
+        if (m) {
+            file_cache_release(m);
+            return;
+        }
+    }
+    close(fd);
+}
+
+/*
+ * Rebuild the cache under the current settings. Every entry is dropped
+ * (those still being sent go once released), then the files that were
+ * cached under the document root are loaded again, most recently used
+ * first, so changes to the cache size, -m or MIME types take effect at
+ * once without a cold start. Encoded variants are rebuilt on demand.
+ */
+static void file_cache_rewarm(void) {
+    typedef struct warm_key {
+        struct warm_key *next;
+        char *path;
+        char key[];
+    } warm_key_t;
+    warm_key_t *keys = NULL;
+    warm_key_t **tail = &keys;
+    size_t warmed = 0;
+
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        file_cache_shard_t *shard = &file_cache[i];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->lru_head) {
+            file_cache_entry_t *e = shard->lru_head;
+            if (e->coding == CODING_IDENTITY && !e->negative) {
+                size_t key_len = strlen(e->key);
+                warm_key_t *k = malloc(sizeof(warm_key_t) + key_len + strlen(e->path) + 2);
+                if (k) {
+                    memcpy(k->key, e->key, key_len + 1);
+                    k->path = k->key + key_len + 1;
+                    strcpy(k->path, e->path);
+                    k->next = NULL;
+                    *tail = k;
+                    tail = &k->next;
+                }
+            }
+            file_cache_unlink(shard, e);
+            if (e->refs == 0) {
+                file_cache_entry_free(e);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    const char *root = __atomic_load_n(&document_root, __ATOMIC_ACQUIRE);
+    size_t root_len = strlen(root);
+    while (keys) {
+        warm_key_t *k = keys;
+        keys = k->next;
+
+        struct stat st;
+        int fd = strncmp(k->key, root, root_len) == 0 ? open(k->path, O_RDONLY) : -1;
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            file_cache_entry_t *e = file_cache_insert(k->key, k->path, fd, &st,
+                                                      get_mime_type(k->path), CODING_IDENTITY,
+                                                      0);
+            if (e) {
+                file_cache_release(e);
+                warmed++;
+                fd = -1;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(k);
+    }
+    printf("File cache: rewarmed %zu file%s\n", warmed, warmed == 1 ? "" : "s");
+}
+
+/*
+ * Find or create the variant of identity entry e in a coding. A sidecar
+ * file next to the original wins; otherwise, with -z, the inline body is
+ * compressed once. When neither yields anything a negative entry is
+ * cached so later requests skip the probe. Returns a referenced entry
+ * with a body, or NULL.
+ */
+static file_cache_entry_t *file_cache_variant(const file_cache_entry_t *e, const char *key,
+                                              int coding) {
+    char vkey[MAX_PATH_SIZE * 2 + 8];
+    snprintf(vkey, sizeof(vkey), "%s %s", key, content_codings[coding].name);
+
+    file_cache_entry_t *v = file_cache_lookup(vkey);
+    if (v) {
+        if (!v->negative) {
+            return v;
+        }
+        file_cache_release(v);
+        return NULL;
+    }
+
+    char sidecar[MAX_PATH_SIZE * 2 + 8];
+    snprintf(sidecar, sizeof(sidecar), "%s%s", e->path, content_codings[coding].suffix);
+    int fd = open(sidecar, O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            v = file_cache_insert(vkey, sidecar, fd, &st, e->mime, coding, 0);
+            if (v) {
+                return v;
+            }
+        }
+        close(fd);
+        return NULL;
+    }
+
+    /* On-the-fly and negative entries are validated against the source */
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_dev = e->dev;
+    st.st_ino = e->ino;
+    st.st_size = e->file_size;
+    st.st_mtim = e->mtime;
+
+    /* A mapped body is compressed from a copy, as reading a truncated mapping faults */
+    char *body = NULL;
+    size_t body_len = 0;
+    char *copy = NULL;
+    const char *src = e->body;
+    if (compress_static && e->mapped && e->size >= COMPRESS_MIN_SIZE) {
+        copy = malloc(e->size);
+        if (copy && read_full(e->fd, copy, e->size) < 0) {
+            free(copy);
+            copy = NULL;
+        }
+        src = copy;
+    }
+    if (compress_static && src && e->size >= COMPRESS_MIN_SIZE) {
+        body = compress_body(coding, src, e->size, &body_len);
+        if (body && body_len >= e->size) {
+            free(body);
+            body = NULL;
+        }
+    }
+    free(copy);
+
+    v = file_cache_alloc(vkey, e->path, &st, e->mime, coding, body ? body_len : 0,
+                         FILE_BODY_INLINE);
+    if (v) {
+        v->probe = 1;
+        v->negative = body == NULL;
+        if (body) {
+            memcpy(v->body, body, body_len);
+        }
+        file_cache_link(v);
+    }
+    free(body);
+
+    if (v && v->negative) {
+        file_cache_release(v);
+        v = NULL;
+    }
+    return v;
+}
+
+/*
+ * Answer from a referenced cache entry, or with 304 if the request's
+ * preconditions say the client's copy is current. The reference moves to
+ * the response.
+ */
+static void file_cache_respond(file_cache_entry_t *e, const request_t *req, response_t *res) {
+    if (request_not_modified(req, e->etag, e->mtime.tv_sec)) {
+        send_not_modified(res, e->mime, e->coding, e->etag, e->last_modified);
+        file_cache_release(e);
+        return;
+    }
+
+    /* User-space TLS reads a mapped body from the descriptor instead */
+    const char *body = e->mapped && res->user_copy ? NULL : e->body;
+    file_view_t view = {e->mime, e->coding, e->etag, e->last_modified, body, e->fd, 1, e->size};
+    if (send_file_ranges(req, res, &view)) {
+        res->release = file_cache_release;
+        res->release_arg = e;
+        return;
+    }
+
+    res->status = HTTP_OK;
+    response_append(res, e->header, e->header_len);
+    response_end_headers(res);
+
+    if (body) {
+        response_add_ref(res, body, e->size);
+    } else {
+        res->file_fd = e->fd;
+        res->file_borrowed = 1;
+        res->file_off = 0;
+        res->file_len = e->size;
+    }
+    res->release = file_cache_release;
+    res->release_arg = e;
+}
+
+/*
+ * Answer from identity entry e, or from the most preferred encoded variant
+ * the client accepts. The reference on e moves to the response either way.
+ */
+static void file_cache_respond_encoded(file_cache_entry_t *e, const char *key, unsigned accept,
+                                       const request_t *req, response_t *res) {
+    if (e->mime->compressible && accept) {
+        for (int coding = 0; coding < NUM_CODINGS; coding++) {
+            if (!(accept & (1u << coding))) {
+                continue;
+            }
+            file_cache_entry_t *v = file_cache_variant(e, key, coding);
+            if (v) {
+                file_cache_release(e);
+                file_cache_respond(v, req, res);
+                return;
+            }
+        }
+    }
+    file_cache_respond(e, req, res);
+}
+
+/* Serve static file */
+static void serve_static_file(const request_t *req, response_t *res) {
+    const char *request_path = req->path;
+    char filepath[MAX_PATH_SIZE * 2];
+    struct stat st;
+
+    if (!is_safe_path(request_path)) {
+        send_http_response(res, HTTP_BAD_REQUEST, "text/html",
+                          "<h1>400 Bad Request</h1>", 24);
+        return;
+    }
+
+    snprintf(filepath, sizeof(filepath), "%s%s",
+             __atomic_load_n(&document_root, __ATOMIC_ACQUIRE), request_path);
+
+    size_t accept_len;
+    const char *accept_encoding = request_header(req, "Accept-Encoding", &accept_len);
+    unsigned accept = accept_encoding ? accepted_codings(accept_encoding, accept_len) : 0;
+
+    file_cache_entry_t *cached = file_cache_lookup(filepath);
+    if (cached) {
+        file_cache_respond_encoded(cached, filepath, accept, req, res);
+        return;
+    }
+
+    char key[MAX_PATH_SIZE * 2];
+    memcpy(key, filepath, strlen(filepath) + 1);
+
+    if (stat(filepath, &st) == 0 && S_ISDIR(st.st_mode)) {
+        size_t len = strlen(filepath);
+        if (len > 0 && filepath[len - 1] != '/') {
+            strncat(filepath, "/", sizeof(filepath) - len - 1);
+        }
+        strncat(filepath, DEFAULT_INDEX, sizeof(filepath) - strlen(filepath) - 1);
+    }
+
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        send_http_response(res, HTTP_NOT_FOUND, "text/html",
+                          "<h1>404 Not Found</h1>", 23);
+        return;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        send_http_response(res, HTTP_INTERNAL_ERROR, "text/html",
+                          "<h1>500 Internal Server Error</h1>", 35);
+        return;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        send_http_response(res, HTTP_NOT_FOUND, "text/html",
+                          "<h1>404 Not Found</h1>", 23);
+        return;
+    }
+
+    const mime_type_t *mime = get_mime_type(filepath);
+
+    cached = file_cache_insert(key, filepath, fd, &st, mime, CODING_IDENTITY, 0);
+    if (cached) {
+        file_cache_respond_encoded(cached, key, accept, req, res);
+        return;
+    }
+
+    char etag[FILE_ETAG_SIZE];
+    char last_modified[HTTP_DATE_SIZE];
+    file_etag(etag, sizeof(etag), &st.st_mtim, st.st_size, CODING_IDENTITY);
+    http_date(st.st_mtim.tv_sec, last_modified, sizeof(last_modified));
+
+    if (request_not_modified(req, etag, st.st_mtim.tv_sec)) {
+        close(fd);
+        send_not_modified(res, mime, CODING_IDENTITY, etag, last_modified);
+        return;
+    }
+
+    file_view_t view = {mime, CODING_IDENTITY, etag, last_modified, NULL, fd, 0, st.st_size};
+    if (send_file_ranges(req, res, &view)) {
+        return;
+    }
+
+    char header[512];
+    int header_len = format_file_headers(header, sizeof(header), HTTP_OK, mime, st.st_size,
+                                         CODING_IDENTITY, etag, last_modified);
+    if (header_len < 0) {
+        close(fd);
+        send_http_error(res, HTTP_INTERNAL_ERROR);
+        return;
+    }
+
+    /* The body is streamed from fd by the connection, never copied here */
+    res->status = HTTP_OK;
+    response_append(res, header, header_len);
+    response_end_headers(res);
+    res->file_fd = fd;
+    res->file_off = 0;
+    res->file_len = st.st_size;
+}
+
+/* Map a request method to its METHOD_* index, or -1 if unknown */
+static int method_lookup(const char *method) {
+    for (int i = 0; i < NUM_METHODS; i++) {
+        if (strcmp(method, method_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Allocate an empty router node for a segment */
+static route_node_t *route_node_new(const char *segment, size_t len) {
+    route_node_t *node = calloc(1, sizeof(route_node_t));
+    if (!node) {
+        return NULL;
+    }
+    node->segment = segment;
+    node->segment_len = len;
+    for (int i = 0; i < NUM_METHODS; i++) {
+        node->routes[i] = -1;
+    }
+    return node;
+}
+
+/* Order segments by bytes, then length */
+static int route_segment_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int r = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (r != 0) {
+        return r;
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/*
+ * Binary search the literal children of node for a segment. Returns the
+ * child, or NULL with *slot set to where it would be inserted.
+ */
+static route_node_t *route_find_child(const route_node_t *node, const char *seg, size_t len,
+                                      size_t *slot) {
+    size_t lo = 0;
+    size_t hi = node->num_children;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const route_node_t *child = node->children[mid];
+        int r = route_segment_cmp(seg, len, child->segment, child->segment_len);
+        if (r == 0) {
+            return node->children[mid];
+        }
+        if (r < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    if (slot) {
+        *slot = lo;
+    }
+    return NULL;
+}
+
+/* Find or create the child of node for one route pattern segment */
+static route_node_t *route_add_child(route_node_t *node, const char *seg, size_t len) {
+    if (len > 0 && seg[0] == ':') {
+        if (!node->capture) {
+            node->capture = route_node_new(seg + 1, len - 1);
+        } else if (route_segment_cmp(seg + 1, len - 1, node->capture->segment,
+                                     node->capture->segment_len) != 0) {
+            fprintf(stderr, "Route capture :%.*s conflicts with :%.*s\n", (int)len - 1,
+                    seg + 1, (int)node->capture->segment_len, node->capture->segment);
+            return NULL;
+        }
+        return node->capture;
+    }
+
+    size_t slot;
+    route_node_t *child = route_find_child(node, seg, len, &slot);
+    if (child) {
+        return child;
+    }
+    child = route_node_new(seg, len);
+    if (!child) {
+        return NULL;
+    }
+    route_node_t **children = realloc(node->children,
+                                      (node->num_children + 1) * sizeof(route_node_t *));
+    if (!children) {
+        free(child);
+        return NULL;
+    }
+    memmove(children + slot + 1, children + slot,
+            (node->num_children - slot) * sizeof(route_node_t *));
+    children[slot] = child;
+    node->children = children;
+    node->num_children++;
+    return child;
+}
+
+/* Add routes[index] to the router */
+static int route_insert(size_t index) {
+    const route_t *route = &routes[index];
+    int method = method_lookup(route->method);
+    if (method < 0 || route->path[0] != '/') {
+        fprintf(stderr, "Invalid route: %s %s\n", route->method, route->path);
+        return -1;
+    }
+
+    /* "/" is the root itself; every further '/' starts another segment */
+    route_node_t *node = route_root;
+    const char *seg = route->path + 1;
+    int more = *seg != '\0';
+    while (more && node) {
+        const char *end = strchr(seg, '/');
+        size_t len = end ? (size_t)(end - seg) : strlen(seg);
+        node = route_add_child(node, seg, len);
+        more = end != NULL;
+        seg = end ? end + 1 : seg;
+    }
+    if (!node) {
+        return -1;
+    }
+
+    if (node->routes[method] >= 0) {
+        fprintf(stderr, "Duplicate route: %s %s\n", route->method, route->path);
+        return -1;
+    }
+    node->routes[method] = (int)index;
+    node->has_routes = 1;
+    return 0;
+}
+
+/*
+ * Match the rest of a path (more set if another segment follows) below
+ * node, preferring literal segments and backtracking into captures.
+ */
+static const route_node_t *route_match(const route_node_t *node, const char *path, size_t len,
+                                       int more, route_params_t *params) {
+    if (!more) {
+        return node->has_routes ? node : NULL;
+    }
+
+    const char *end = memchr(path, '/', len);
+    size_t seg_len = end ? (size_t)(end - path) : len;
+    const char *rest = end ? end + 1 : path + len;
+    size_t rest_len = end ? len - seg_len - 1 : 0;
+
+    const route_node_t *child = route_find_child(node, path, seg_len, NULL);
+    if (child) {
+        const route_node_t *found = route_match(child, rest, rest_len, end != NULL, params);
+        if (found) {
+            return found;
+        }
+    }
+
+    if (node->capture && seg_len > 0 && seg_len < MAX_PARAM_SIZE &&
+        params->count < MAX_ROUTE_PARAMS) {
+        route_param_t *param = &params->params[params->count++];
+        param->name = node->capture->segment;
+        url_decode(param->value, sizeof(param->value), path, seg_len);
+
+        const route_node_t *found = route_match(node->capture, rest, rest_len, end != NULL,
+                                                params);
+        if (found) {
+            return found;
+        }
+        params->count--;
+    }
+
+    return NULL;
+}
+
+/* Find the router node for a request path, filling in its captures */
+static const route_node_t *route_find(const char *path, route_params_t *params) {
+    params->count = 0;
+    if (!route_root || path[0] != '/') {
+        return NULL;
+    }
+    size_t len = strlen(path + 1);
+    return route_match(route_root, path + 1, len, len > 0, params);
+}
+
+/* Get a route capture by name */
+static const char *route_param_get(const request_t *req, const char *name) {
+    for (size_t i = 0; i < req->params->count; i++) {
+        const route_param_t *param = &req->params->params[i];
+        if (strcmp(param->name, name) == 0) {
+            return param->value;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Serialize one constant response with the given connection disposition,
+ * leaving out the Date line, which is added after *status_len bytes
+ */
+static int prebuild_response(const route_t *route, int keep_alive, char **out, size_t *out_len,
+                             size_t *status_len) {
     response_t res;
     if (response_init(&res, BUFFER_SIZE) < 0) {
+        return -1;
+    }
+    res.keep_alive = keep_alive;
+    response_printf(&res, "HTTP/1.1 %d %s\r\n", HTTP_OK, http_status_text(HTTP_OK));
+    *status_len = res.size;
+    send_header_fields(&res, HTTP_OK, route->content_type, strlen(route->body));
+    response_append(&res, route->body, strlen(route->body));
+    *out = res.data;
+    *out_len = res.size;
+    return 0;
+}
+
+/* Compile the route table into the router and prebuild constant responses */
+static int routes_init(void) {
+    route_root = route_node_new("", 0);
+    if (!route_root) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < NUM_ROUTES; i++) {
+        const route_t *route = &routes[i];
+        prebuilt_response_t *pre = &prebuilt_responses[i];
+        if (route_insert(i) < 0) {
+            return -1;
+        }
+        if (route->handler) {
+            continue;
+        }
+        if (prebuild_response(route, 1, &pre->keep_alive, &pre->keep_alive_len,
+                              &pre->status_len) < 0 ||
+            prebuild_response(route, 0, &pre->close, &pre->close_len, &pre->status_len) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Append one Prometheus metric family header */
+static void metrics_family(response_t *body, const char *name, const char *type,
+                           const char *help) {
+    response_printf(body, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Prometheus text exposition of the per-thread stats, summed at scrape
+ * time. Rates (accepts, requests) and the cache hit ratio over a window
+ * are left to the scraper via rate() on the counters.
+ */
+static void handle_metrics(const request_t *req, response_t *res) {
+    (void)req;
+    stats_t total;
+    response_t body;
+
+    if (response_init(&body, 16 * 1024) < 0) {
+        send_http_response(res, HTTP_INTERNAL_ERROR, "text/html",
+                          "<h1>500 Internal Server Error</h1>", 35);
+        return;
+    }
+    stats_collect(&total);
+
+    metrics_family(&body, "http_responses_total", "counter", "Responses sent, by status code.");
+    for (int i = 0; i <= STATS_STATUS_MAX - STATS_STATUS_MIN; i++) {
+        if (total.responses[i]) {
+            response_printf(&body, "http_responses_total{code=\"%d\"} %llu\n",
+                            i + STATS_STATUS_MIN, (unsigned long long)total.responses[i]);
+        }
+    }
+
+    metrics_family(&body, "http_sent_bytes_total", "counter",
+                   "Bytes written to client sockets, headers included.");
+    response_printf(&body, "http_sent_bytes_total %llu\n",
+                    (unsigned long long)total.bytes_sent);
+
+    metrics_family(&body, "http_access_log_dropped_total", "counter",
+                   "Access log records dropped because a thread's ring was full.");
+    response_printf(&body, "http_access_log_dropped_total %llu\n",
+                    (unsigned long long)total.log_dropped);
+
+    metrics_family(&body, "http_tls_handshakes_total", "counter", "TLS handshakes completed.");
+    response_printf(&body, "http_tls_handshakes_total %llu\n",
+                    (unsigned long long)total.tls_handshakes);
+
+    metrics_family(&body, "http_tls_resumed_total", "counter",
+                   "TLS handshakes that resumed an earlier session.");
+    response_printf(&body, "http_tls_resumed_total %llu\n",
+                    (unsigned long long)total.tls_resumed);
+
+    metrics_family(&body, "http_tls_ktls_total", "counter",
+                   "TLS connections whose sends the kernel encrypts (kTLS).");
+    response_printf(&body, "http_tls_ktls_total %llu\n", (unsigned long long)total.tls_ktls);
+
+    metrics_family(&body, "http_connections_accepted_total", "counter",
+                   "Connections accepted.");
+    response_printf(&body, "http_connections_accepted_total %llu\n",
+                    (unsigned long long)total.accepted);
+
+    metrics_family(&body, "http_connections_shed_total", "counter",
+                   "Connections turned away with 503 at the connection cap.");
+    response_printf(&body, "http_connections_shed_total %llu\n",
+                    (unsigned long long)total.shed);
+
+    metrics_family(&body, "http_connections_active", "gauge", "Connections currently open.");
+    response_printf(&body, "http_connections_active %lld\n",
+                    (long long)(total.conns_opened - total.conns_closed));
+
+    metrics_family(&body, "http_file_cache_hits_total", "counter",
+                   "Static file lookups answered from the cache.");
+    response_printf(&body, "http_file_cache_hits_total %llu\n",
+                    (unsigned long long)total.cache_hits);
+    metrics_family(&body, "http_file_cache_misses_total", "counter",
+                   "Static file lookups that went to the filesystem.");
+    response_printf(&body, "http_file_cache_misses_total %llu\n",
+                    (unsigned long long)total.cache_misses);
+    uint64_t lookups = total.cache_hits + total.cache_misses;
+    metrics_family(&body, "http_file_cache_hit_ratio", "gauge",
+                   "Fraction of static file lookups served from the cache since start.");
+    response_printf(&body, "http_file_cache_hit_ratio %.6f\n",
+                    lookups ? (double)total.cache_hits / lookups : 0.0);
+
+    metrics_family(&body, "http_request_duration_seconds", "histogram",
+                   "Time from a parsed request head to its last response byte, by route kind.");
+    for (int k = 0; k < ROUTE_KINDS; k++) {
+        uint64_t cumulative = 0;
+        for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+            cumulative += total.latency[k][i];
+            if (i < STATS_LATENCY_BUCKETS - 1) {
+                response_printf(&body,
+                                "http_request_duration_seconds_bucket{route=\"%s\",le=\"%g\"} %llu\n",
+                                route_kind_names[k], (double)(1ull << i) / 1e6,
+                                (unsigned long long)cumulative);
+            } else {
+                response_printf(&body,
+                                "http_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %llu\n",
+                                route_kind_names[k], (unsigned long long)cumulative);
+            }
+        }
+        response_printf(&body, "http_request_duration_seconds_sum{route=\"%s\"} %.9f\n",
+                        route_kind_names[k], (double)total.latency_sum_ns[k] / 1e9);
+        response_printf(&body, "http_request_duration_seconds_count{route=\"%s\"} %llu\n",
+                        route_kind_names[k], (unsigned long long)cumulative);
+    }
+
+    send_http_headers(res, HTTP_OK, "text/plain; version=0.0.4", body.size);
+    response_add_owned(res, body.data, body.size, free);
+}
+
+/* GET /users/:id - echo the numeric id captured from the path */
+static void handle_user(const request_t *req, response_t *res) {
+    static const char not_found[] = "<h1>404 Not Found</h1>";
+    const char *id = route_param_get(req, "id");
+    char body[MAX_PARAM_SIZE + 16];
+
+    if (!id || strspn(id, "0123456789") != strlen(id)) {
+        send_http_response(res, HTTP_NOT_FOUND, "text/html", not_found, sizeof(not_found) - 1);
+        return;
+    }
+    int len = snprintf(body, sizeof(body), "{\"id\":\"%s\"}", id);
+    send_http_response(res, HTTP_OK, "application/json", body, (size_t)len);
+}
+
+/* Running totals for an upload being streamed */
+typedef struct {
+    size_t bytes;
+    size_t chunks;
+} upload_state_t;
+
+/* Count one piece of an upload */
+static int upload_data(void *ctx, const char *data, size_t len) {
+    upload_state_t *u = ctx;
+    (void)data;
+    u->bytes += len;
+    u->chunks++;
+    return 0;
+}
+
+/* Report the upload totals */
+static void upload_end(void *ctx, response_t *res) {
+    const upload_state_t *u = ctx;
+    char body[128];
+    int len = snprintf(body, sizeof(body), "{\"bytes\":%zu,\"chunks\":%zu}",
+                       u->bytes, u->chunks);
+    send_http_response(res, HTTP_OK, "application/json", body, len);
+}
+
+/* Accept a body of any size without buffering it and report what arrived */
+static void handle_upload(const request_t *req, response_t *res) {
+    (void)req;
+    upload_state_t *u = response_alloc(res, sizeof(upload_state_t));
+    if (!u) {
+        send_http_error(res, HTTP_INTERNAL_ERROR);
+        return;
+    }
+    u->bytes = 0;
+    u->chunks = 0;
+    request_stream_body(res, upload_data, upload_end, u);
+}
+
+/* Progress of a /stream response */
+typedef struct {
+    unsigned long next;
+    unsigned long total;
+} stream_state_t;
+
+/* Produce the next piece of numbered lines */
+static int stream_produce(void *ctx, response_t *res) {
+    stream_state_t *state = ctx;
+    while (state->next < state->total && res->size < STREAM_CHUNK_SIZE) {
+        response_printf(res, "line %lu\n", state->next++);
+    }
+    return state->next < state->total;
+}
+
+/*
+ * Stream ?lines=N numbered lines (default 1000, at most 1000000, negative
+ * counts as 0) without buffering them
+ */
+static void handle_stream(const request_t *req, response_t *res) {
+    stream_state_t *state = response_alloc(res, sizeof(stream_state_t));
+    if (!state) {
+        send_http_error(res, HTTP_INTERNAL_ERROR);
+        return;
+    }
+    const char *lines = query_get(req->query, "lines");
+    long total = lines ? strtol(lines, NULL, 10) : 1000;
+    if (total < 0) {
+        total = 0;
+    } else if (total > 1000000) {
+        total = 1000000;
+    }
+    state->next = 0;
+    state->total = (unsigned long)total;
+    response_stream(res, HTTP_OK, "text/plain", stream_produce, state);
+}
+
+/* Sleep for ?ms=N milliseconds (default 100, at most 10 s); registered as blocking */
+static void handle_slow(const request_t *req, response_t *res) {
+    const char *ms = query_get(req->query, "ms");
+    long delay = ms ? strtol(ms, NULL, 10) : 100;
+    if (delay < 0) {
+        delay = 0;
+    } else if (delay > 10000) {
+        delay = 10000;
+    }
+
+    struct timespec ts = {delay / 1000, (delay % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+
+    char body[64];
+    int len = snprintf(body, sizeof(body), "{\"slept_ms\":%ld}", delay);
+    send_http_response(res, HTTP_OK, "application/json", body, len);
+}
+
+/* Execute the handler of a matched route */
+static void handle_dynamic_route(int index, const request_t *req, response_t *res) {
+    const route_t *route = &routes[index];
+
+    res->route_kind = ROUTE_KIND_DYNAMIC;
+    if (route->handler) {
+        route->handler(req, res);
+        return;
+    }
+
+    /* Constant route: copy the status line and Date, borrow the rest */
+    const prebuilt_response_t *pre = &prebuilt_responses[index];
+    const char *data = res->keep_alive ? pre->keep_alive : pre->close;
+    size_t len = res->keep_alive ? pre->keep_alive_len : pre->close_len;
+    res->status = HTTP_OK;
+    response_append(res, data, pre->status_len);
+    response_append_date(res);
+    response_add_ref(res, data + pre->status_len, len - pre->status_len);
+}
+
+/* Copy a string into the response arena */
+static char *response_strdup(response_t *res, const char *str) {
+    size_t len = strlen(str);
+    char *copy = response_alloc(res, len + 1);
+    if (copy) {
+        memcpy(copy, str, len + 1);
+    }
+    return copy;
+}
+
+/* Answer 405, listing in Allow the methods the path does answer */
+static void send_method_not_allowed(response_t *res, const route_node_t *node) {
+    static const char body[] = "<h1>405 Method Not Allowed</h1>";
+    char allow[64];
+    size_t len = 0;
+
+    allow[0] = '\0';
+    for (int i = 0; i < NUM_METHODS; i++) {
+        int get = node ? node->routes[METHOD_GET] >= 0 : 1;
+        int allowed = node ? node->routes[i] >= 0 : i == METHOD_GET;
+        if (allowed || (i == METHOD_HEAD && get)) {
+            len += snprintf(allow + len, sizeof(allow) - len, "%s%s", len ? ", " : "",
+                            method_names[i]);
+        }
+    }
+
+    res->status = HTTP_METHOD_NOT_ALLOWED;
+    response_printf(res, "HTTP/1.1 %d %s\r\n", HTTP_METHOD_NOT_ALLOWED,
+                    http_status_text(HTTP_METHOD_NOT_ALLOWED));
+    response_append_date(res);
+    response_printf(res, "Allow: %s\r\n", allow);
+    send_header_fields(res, HTTP_METHOD_NOT_ALLOWED, "text/html", sizeof(body) - 1);
+    response_append(res, body, sizeof(body) - 1);
+}
+
+/*
+ * Build the response for a parsed request head located at buf. When
+ * deferred is given, a blocking route is not run here: it is packaged as a
+ * job in *deferred for the caller to hand to the offload pool.
+ */
+static void handle_request(const http_parser_t *p, const char *buf, response_t *res,
+                           offload_job_t **deferred) {
+    char method[MAX_METHOD_SIZE];
+    char path[MAX_PATH_SIZE];
+
+    const char *target = buf + p->target_off;
+    const char *question = memchr(target, '?', p->target_len);
+    size_t path_len = question ? (size_t)(question - target) : p->target_len;
+    size_t query_len = question ? p->target_len - path_len - 1 : 0;
+
+    if (p->method_len >= MAX_METHOD_SIZE || path_len >= MAX_PATH_SIZE) {
+        res->keep_alive = 0;
+        send_http_response(res, HTTP_BAD_REQUEST, "text/html",
+                          "<h1>400 Bad Request</h1>", 24);
+        return;
+    }
+
+    memcpy(method, buf + p->method_off, p->method_len);
+    method[p->method_len] = '\0';
+    memcpy(path, target, path_len);
+    path[path_len] = '\0';
+
+    route_params_t *route_params = response_alloc(res, sizeof(route_params_t));
+    if (!route_params) {
+        send_http_response(res, HTTP_INTERNAL_ERROR, "text/html",
+                          "<h1>500 Internal Server Error</h1>", 35);
+        return;
+    }
+
+    /*
+     * Paths with no route fall through to static files, which are GET only.
+     * HEAD is answered as GET unless routed itself, the body dropped before
+     * the response is sent.
+     */
+    int method_id = method_lookup(method);
+    const route_node_t *node = route_find(path, route_params);
+    if (method_id == METHOD_HEAD) {
+        res->head_only = 1;
+        if (!node || node->routes[METHOD_HEAD] < 0) {
+            method_id = METHOD_GET;
+        }
+    }
+    int route = node && method_id >= 0 ? node->routes[method_id] : -1;
+    if (route < 0 && (node || method_id != METHOD_GET)) {
+        send_method_not_allowed(res, node);
+        return;
+    }
+
+    request_t req = {
+        .method = method,
+        .path = path,
+        .query = NULL,
+        .params = route_params,
+        .head = buf,
+        .headers = p->headers,
+        .num_headers = p->num_headers,
+        .chunked = p->chunked,
+        .content_length = p->content_length
+    };
+
+    if (route < 0) {
+        res->route_kind = ROUTE_KIND_STATIC;
+        serve_static_file(&req, res);
+        return;
+    }
+
+    /* The query stays in the request buffer; handlers decode what they use */
+    query_params_t *query_params = response_alloc(res, sizeof(query_params_t));
+    if (!query_params) {
+        send_http_error(res, HTTP_INTERNAL_ERROR);
+        return;
+    }
+    parse_query_string(question ? question + 1 : target + path_len, query_len, query_params,
+                       res->arena);
+    req.query = query_params;
+
+    if (deferred && routes[route].blocking) {
+        offload_job_t *job = response_alloc(res, sizeof(offload_job_t));
+        if (job) {
+            job->req = req;
+            job->req.method = response_strdup(res, method);
+            job->req.path = response_strdup(res, path);
+        }
+        if (!job || !job->req.method || !job->req.path) {
+            send_http_error(res, HTTP_INTERNAL_ERROR);
+            return;
+        }
+        job->route = route;
+        *deferred = job;
+        return;
+    }
+
+    handle_dynamic_route(route, &req, res);
+}
+
+#ifdef HAVE_EPOLL
+/*
+ * Offload pool for blocking handlers. Each thread has its own queue and
+ * jobs are dealt round-robin across them; a thread whose queue is empty
+ * steals from its peers before going to sleep. Idle threads wait on one
+ * condition variable guarded by a count of queued jobs, so a submission
+ * wakes at most one of them.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    offload_job_t *head;
+    offload_job_t *tail;
+    pthread_t thread;
+    int index;
+} __attribute__((aligned(CACHE_LINE_SIZE))) offload_thread_t;
+
+static offload_thread_t offload_pool[MAX_OFFLOAD_THREADS];
+static int offload_started = 0;
+static unsigned offload_next = 0;
+static pthread_mutex_t offload_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t offload_idle_cond = PTHREAD_COND_INITIALIZER;
+static size_t offload_queued = 0;   /* guarded by offload_idle_lock */
+static int offload_stopping = 0;    /* guarded by offload_idle_lock */
+
+/* Hand a job back to its I/O worker, waking it if it may be asleep */
+static void offload_complete(offload_job_t *job) {
+    offload_queue_t *q = job->done;
+    offload_job_t *head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    do {
+        job->next = head;
+    } while (!__atomic_compare_exchange_n(&q->head, &head, job, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (!head) {
+        uint64_t one = 1;
+        ssize_t n;
+        do {
+            n = write(q->wake_fd, &one, sizeof(one));
+        } while (n < 0 && errno == EINTR);
+    }
+}
+
+/* Take every completed job, oldest first */
+static offload_job_t *offload_take_completed(offload_queue_t *q) {
+    uint64_t count;
+    ssize_t n;
+    do {
+        n = read(q->wake_fd, &count, sizeof(count));
+    } while (n < 0 && errno == EINTR);
+
+    offload_job_t *job = __atomic_exchange_n(&q->head, NULL, __ATOMIC_ACQUIRE);
+    offload_job_t *ordered = NULL;
+    while (job) {
+        offload_job_t *next = job->next;
+        job->next = ordered;
+        ordered = job;
+        job = next;
+    }
+    return ordered;
+}
+
+/* Pop the oldest job from one thread's queue */
+static offload_job_t *offload_pop(offload_thread_t *t) {
+    pthread_mutex_lock(&t->lock);
+    offload_job_t *job = t->head;
+    if (job) {
+        t->head = job->next;
+        if (!t->head) {
+            t->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    return job;
+}
+
+/* Queue a job on the next thread in turn and wake an idle thread */
+static void offload_submit(offload_job_t *job) {
+    unsigned i = __atomic_fetch_add(&offload_next, 1, __ATOMIC_RELAXED) % (unsigned)offload_started;
+    offload_thread_t *t = &offload_pool[i];
+
+    job->next = NULL;
+    pthread_mutex_lock(&t->lock);
+    if (t->tail) {
+        t->tail->next = job;
+    } else {
+        t->head = job;
+    }
+    t->tail = job;
+    pthread_mutex_unlock(&t->lock);
+
+    pthread_mutex_lock(&offload_idle_lock);
+    offload_queued++;
+    pthread_cond_signal(&offload_idle_cond);
+    pthread_mutex_unlock(&offload_idle_lock);
+}
+
+/*
+ * Pool thread: reserve one queued job, then find it in its own queue or
+ * a peer's. Every reservation is backed by a job already queued, so the
+ * search always succeeds. The pool drains what is queued before stopping.
+ */
+static void *offload_thread(void *arg) {
+    offload_thread_t *self = arg;
+
+    stats_attach();
+    for (;;) {
+        pthread_mutex_lock(&offload_idle_lock);
+        while (offload_queued == 0 && !offload_stopping) {
+            pthread_cond_wait(&offload_idle_cond, &offload_idle_lock);
+        }
+        if (offload_queued == 0) {
+            pthread_mutex_unlock(&offload_idle_lock);
+            break;
+        }
+        offload_queued--;
+        pthread_mutex_unlock(&offload_idle_lock);
+
+        offload_job_t *job = NULL;
+        while (!job) {
+            for (int i = 0; i < offload_started && !job; i++) {
+                job = offload_pop(&offload_pool[(self->index + i) % offload_started]);
+            }
+        }
+
+        handle_dynamic_route(job->route, &job->req, &job->conn->res);
+        offload_complete(job);
+    }
+    stats_detach();
+    return NULL;
+}
+
+/* Start the pool if any route is blocking; returns the threads started */
+static int offload_start(void) {
+    int blocking = 0;
+    for (size_t i = 0; i < NUM_ROUTES; i++) {
+        blocking |= routes[i].blocking;
+    }
+    if (!blocking) {
+        return 0;
+    }
+
+    offload_stopping = 0;
+    for (int i = 0; i < offload_threads; i++) {
+        offload_thread_t *t = &offload_pool[i];
+        pthread_mutex_init(&t->lock, NULL);
+        t->head = NULL;
+        t->tail = NULL;
+        t->index = i;
+        if (pthread_create(&t->thread, NULL, offload_thread, t) != 0) {
+            perror("pthread_create");
+            pthread_mutex_destroy(&t->lock);
+            break;
+        }
+        offload_started++;
+    }
+    return offload_started;
+}
+
+/* Let the pool finish what is queued and join its threads */
+static void offload_stop(void) {
+    pthread_mutex_lock(&offload_idle_lock);
+    offload_stopping = 1;
+    pthread_cond_broadcast(&offload_idle_cond);
+    pthread_mutex_unlock(&offload_idle_lock);
+
+    for (int i = 0; i < offload_started; i++) {
+        pthread_join(offload_pool[i].thread, NULL);
+        pthread_mutex_destroy(&offload_pool[i].lock);
+    }
+    offload_started = 0;
+}
+#endif
+
+/* Put a file descriptor into non-blocking mode */
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Create a bound, listening TCP socket, optionally joining a SO_REUSEPORT group */
+static int open_listener(int port, int reuseport) {
+    struct sockaddr_in address;
+    int opt = 1;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        close(fd);
+        return -1;
+    }
+
+#ifdef SO_REUSEPORT
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
+#else
+    (void)reuseport;
+#endif
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, listen_backlog) < 0) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Take over listening sockets passed in systemd's socket activation form:
+ * LISTEN_FDS descriptors from fd 3, meant for the process LISTEN_PID. An
+ * upgrade hands them over the same way and names the old server in
+ * SERVER_UPGRADE_FROM. The variables are cleared so children never see them.
+ */
+static void listeners_inherit(void) {
+    const char *fds = getenv("LISTEN_FDS");
+    const char *pid = getenv("LISTEN_PID");
+    const char *from = getenv("SERVER_UPGRADE_FROM");
+
+    if (fds && pid && atol(pid) == (long)getpid()) {
+        int n = atoi(fds);
+        if (n > MAX_WORKERS) {
+            n = MAX_WORKERS;
+        }
+        int i;
+        for (i = 0; i < n; i++) {
+            int accepting = 0;
+            socklen_t len = sizeof(accepting);
+            if (getsockopt(LISTEN_FDS_START + i, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) < 0 ||
+                !accepting) {
+                fprintf(stderr, "LISTEN_FDS: fd %d is not a listening socket\n",
+                        LISTEN_FDS_START + i);
+                break;
+            }
+        }
+        inherited_listeners = i;
+    }
+    if (from) {
+        upgrade_parent = (pid_t)atol(from);
+    }
+
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDNAMES");
+    unsetenv("SERVER_UPGRADE_FROM");
+}
+
+/*
+ * The index-th listening socket: inherited if there is one, otherwise
+ * newly bound. Either way it is recorded so an upgrade can pass it on.
+ */
+static int listener_open(int index, int port, int reuseport) {
+    int fd;
+
+    if (num_listen_fds == MAX_WORKERS) {
+        fprintf(stderr, "Too many listening sockets\n");
+        return -1;
+    }
+    if (index < inherited_listeners) {
+        fd = LISTEN_FDS_START + index;
+        /* listen() again only updates the backlog; queued connections stay */
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || listen(fd, listen_backlog) < 0) {
+            perror("inherited listener");
+            return -1;
+        }
+    } else {
+        fd = open_listener(port, reuseport);
+        if (fd < 0) {
+            return -1;
+        }
+    }
+    listen_fds[num_listen_fds++] = fd;
+    return fd;
+}
+
+/*
+ * Runs in the forked child: move the listeners to fd 3 onwards, close
+ * every other descriptor, fill in LISTEN_PID and exec. Only
+ * async-signal-safe calls, since other threads held locks at the fork.
+ */
+static void upgrade_exec(char **envp, char *pid_digits, long max_fd) {
+    int moved[MAX_WORKERS];
+    int n = num_listen_fds;
+    int first_free = LISTEN_FDS_START + n;
+    sigset_t none;
+
+    /* Copy above the target range first so no move clobbers another listener */
+    for (int i = 0; i < n; i++) {
+        moved[i] = fcntl(listen_fds[i], F_DUPFD, first_free);
+        if (moved[i] < 0) {
+            _exit(127);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (dup2(moved[i], LISTEN_FDS_START + i) < 0) {
+            _exit(127);
+        }
+    }
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, (unsigned)first_free, ~0U, 0) < 0)
+#endif
+    {
+        for (long fd = first_free; fd < max_fd; fd++) {
+            close((int)fd);
+        }
+    }
+
+    char digits[24];
+    int len = 0;
+    for (long pid = (long)getpid(); pid > 0 || len == 0; pid /= 10) {
+        digits[len++] = (char)('0' + pid % 10);
+    }
+    while (len > 0) {
+        *pid_digits++ = digits[--len];
+    }
+    *pid_digits = '\0';
+
+    /* The main thread runs with the server's signals blocked, and exec keeps the mask */
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    execve(upgrade_exe, config_argv, envp);
+
+    static const char msg[] = "Upgrade: exec failed\n";
+    ssize_t ignored = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)ignored;
+    _exit(127);
+}
+
+/*
+ * SIGUSR2: start a new server from the binary on disk, with the same
+ * command line, handing it our listening sockets. Both processes accept
+ * on the same sockets, so connections waiting in the backlog are never
+ * dropped; once the new server is up it sends us SIGQUIT and we drain.
+ * If it fails to start we simply keep serving.
+ */
+static void upgrade_spawn(void) {
+    extern char **environ;
+    char fds_var[32];
+    char pid_var[32] = "LISTEN_PID=";
+    char from_var[48];
+    size_t count = 0;
+    size_t n = 0;
+    int status;
+    pid_t pid;
+
+    /* Reap an earlier attempt that exited, reporting why */
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        fprintf(stderr, "Upgrade: pid %ld exited with status %d\n", (long)pid,
+                WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    }
+    if (draining) {
+        fprintf(stderr, "Upgrade: already draining, ignored\n");
+        return;
+    }
+
+    while (environ[count]) {
+        count++;
+    }
+    char **envp = malloc((count + 4) * sizeof(char *));
+    if (!envp) {
+        perror("malloc");
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], "LISTEN_", 7) != 0 &&
+            strncmp(environ[i], "SERVER_UPGRADE_FROM=", 20) != 0) {
+            envp[n++] = environ[i];
+        }
+    }
+    snprintf(fds_var, sizeof(fds_var), "LISTEN_FDS=%d", num_listen_fds);
+    snprintf(from_var, sizeof(from_var), "SERVER_UPGRADE_FROM=%ld", (long)getpid());
+    envp[n++] = fds_var;
+    envp[n++] = pid_var;
+    envp[n++] = from_var;
+    envp[n] = NULL;
+
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    if (max_fd < 0) {
+        max_fd = 1024;
+    }
+
+    /*
+     * The child closes the write end with everything else it must not
+     * keep, so EOF on the pipe means it no longer shares our sockets. It
+     * sits above the listeners' target range so no dup2() closes it early.
+     */
+    int exec_pipe[2];
+    if (pipe(exec_pipe) < 0) {
+        perror("pipe");
+        free(envp);
+        return;
+    }
+    int exec_done = fcntl(exec_pipe[1], F_DUPFD_CLOEXEC, LISTEN_FDS_START + num_listen_fds);
+    close(exec_pipe[1]);
+    if (exec_done < 0) {
+        perror("fcntl");
+        close(exec_pipe[0]);
+        free(envp);
+        return;
+    }
+
+    /* Closes that missed the flag finish before the fork; later ones see it */
+    __atomic_store_n(&upgrade_forking, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&closes_active, __ATOMIC_SEQ_CST) > 0) {
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        upgrade_exec(envp, pid_var + strlen(pid_var), max_fd);
+    }
+    free(envp);
+    close(exec_done);
+    if (pid > 0) {
+        struct pollfd pfd = {.fd = exec_pipe[0], .events = POLLIN};
+        for (int i = 0; i < 5 && poll(&pfd, 1, EVENT_LOOP_TICK_MS) <= 0; i++) {
+        }
+    }
+    close(exec_pipe[0]);
+    __atomic_store_n(&upgrade_forking, 0, __ATOMIC_SEQ_CST);
+    if (pid < 0) {
+        perror("fork");
+        return;
+    }
+    printf("Upgrade: started pid %ld with %d listening socket%s\n", (long)pid, num_listen_fds,
+           num_listen_fds == 1 ? "" : "s");
+    fflush(stdout);
+}
+
+/* Tell the server we were started by that we are serving, so it drains */
+static void upgrade_notify(void) {
+    if (upgrade_parent > 0 && upgrade_parent == getppid()) {
+        printf("Upgrade: took over from pid %ld\n", (long)upgrade_parent);
+        fflush(stdout);
+        kill(upgrade_parent, SIGQUIT);
+    }
+    upgrade_parent = 0;
+}
+
+/* Whether another connection fits under the connection cap */
+static int conn_admit(void) {
+    return max_connections == 0 ||
+           __atomic_load_n(&conns_active, __ATOMIC_RELAXED) < max_connections;
+}
+
+/*
+ * Turn away a connection over the cap with a canned 503. Whatever request
+ * bytes already arrived are read first so closing does not reset the
+ * connection before the client sees the answer.
+ */
+static void conn_shed(int fd) {
+    static const char status_line[] = "HTTP/1.1 503 Service Unavailable\r\n";
+    static const char response[] = "Content-Type: text/html\r\n"
+                                   "Content-Length: 32\r\n"
+                                   "Retry-After: " STRINGIFY(RETRY_AFTER_SECS) "\r\n"
+                                   "Connection: close\r\n"
+                                   "\r\n"
+                                   "<h1>503 Service Unavailable</h1>";
+    char discard[BUFFER_SIZE];
+
+    struct iovec iov[3] = {
+        {(void *)status_line, sizeof(status_line) - 1},
+        {(void *)date_header(), DATE_HEADER_LEN},
+        {(void *)response, sizeof(response) - 1}
+    };
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 3};
+    STAT_ADD(shed, 1);
+#ifdef HAVE_OPENSSL
+    /* A TLS client would take the plain-text 503 for garbage; just close */
+    if (__atomic_load_n(&tls_ctx, __ATOMIC_ACQUIRE)) {
+        close(fd);
+        return;
+    }
+#endif
+    STAT_ADD(responses[HTTP_SERVICE_UNAVAILABLE - STATS_STATUS_MIN], 1);
+    ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n > 0) {
+        STAT_ADD(bytes_sent, n);
+    }
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+    close(fd);
+}
+
+#ifdef HAVE_IO_URING
+/* Operation tags, stored in the low bits of the connection pointer */
+enum {
+    UOP_ACCEPT,
+    UOP_RECV,
+    UOP_SEND,
+    UOP_POLL,
+    UOP_TIMEOUT,
+    UOP_CANCEL,
+    UOP_WAKE,
+    UOP_MASK = 7
+};
+
+/* Submit queued entries and optionally wait for at least one completion */
+static int uring_submit(uring_t *r, int wait) {
+    unsigned tail = *r->sq_tail;
+    unsigned to_submit = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && !wait) {
+        return 0;
+    }
+    return (int)syscall(__NR_io_uring_enter, r->fd, to_submit, wait ? 1 : 0,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/*
+ * Take the next free submission entry, zeroed and already queued for the
+ * next submit; entries are only seen by the kernel on io_uring_enter().
+ */
+static struct io_uring_sqe *uring_get_sqe(uring_t *r) {
+    unsigned tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        if (uring_submit(r, 0) < 0 ||
+            tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+            return NULL;
+        }
+    }
+    unsigned index = tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/* Hand a provided buffer back to the kernel */
+static void uring_buf_recycle(uring_t *r, int bid) {
+    struct io_uring_buf *buf = &r->buf_ring->bufs[r->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * read_buffer_size);
+    buf->len = read_buffer_size;
+    buf->bid = (unsigned short)bid;
+    r->buf_tail++;
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Unmap a ring and its buffers; in-flight operations are cancelled */
+static void uring_destroy(uring_t *r) {
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_map && r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_map_len);
+    }
+    if (r->sq_map) {
+        munmap(r->sq_map, r->sq_map_len);
+    }
+    if (r->buf_ring) {
+        munmap(r->buf_ring, r->buf_ring_len);
+    }
+    free(r->bufs);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+/*
+ * Create a ring for the calling thread, preferring single-issuer deferred
+ * task running (6.1+), and register its provided receive buffers (5.19+).
+ */
+static int uring_init(uring_t *r) {
+    static const unsigned setup_flags[] = {
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+        0
+    };
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    for (size_t i = 0; i < sizeof(setup_flags) / sizeof(setup_flags[0]) && r->fd < 0; i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = setup_flags[i];
+        r->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_len > r->sq_map_len) {
+            r->sq_map_len = r->cq_map_len;
+        }
+        r->cq_map_len = r->sq_map_len;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        r->sq_map = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            r->cq_map = NULL;
+            goto fail;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = r->sq_map;
+    char *cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    r->buf_ring_len = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    r->buf_ring = mmap(NULL, r->buf_ring_len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->buf_ring == MAP_FAILED) {
+        r->buf_ring = NULL;
+        goto fail;
+    }
+    r->bufs = malloc((size_t)URING_BUF_COUNT * read_buffer_size);
+    if (!r->bufs) {
+        goto fail;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        goto fail;
+    }
+    for (int bid = 0; bid < URING_BUF_COUNT; bid++) {
+        uring_buf_recycle(r, bid);
+    }
+    return 0;
+
+fail:
+    {
+        int err = errno;
+        uring_destroy(r);
+        errno = err;
+    }
+    return -1;
+}
+
+/* Tag an operation with the connection it belongs to */
+static uint64_t uring_tag(conn_t *c, int op) {
+    return (uint64_t)(uintptr_t)c | (uint64_t)op;
+}
+
+/* Take bytes the ring already received; 0 means a receive must be armed */
+static int conn_fill_uring(conn_t *c) {
+    conn_uring_t *u = &c->u;
+    size_t room = read_buffer_size - c->rlen;
+
+    if (u->pending_len == 0) {
+        return u->eof ? -1 : 0;
+    }
+    if (room == 0) {
+        return 0;
+    }
+
+    size_t n = u->pending_len < room ? u->pending_len : room;
+    memcpy(c->rbuf + c->rlen, u->pending, n);
+    c->rlen += n;
+    u->pending += n;
+    u->pending_len -= n;
+    if (u->pending_len == 0) {
+        uring_buf_recycle(u->ring, u->pending_bid);
+        u->pending_bid = -1;
+    }
+    return 1;
+}
+
+/* Queue a sendmsg of the unsent response bytes; completion resumes the connection */
+static int conn_send_uring(conn_t *c) {
+    conn_uring_t *u = &c->u;
+    if (u->send_armed) {
+        return 0;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(u->ring);
+    if (!sqe) {
+        return -1;
+    }
+    memset(&u->msg, 0, sizeof(u->msg));
+    u->msg.msg_iov = u->iov;
+    int more;
+    u->msg.msg_iovlen = response_iov(&c->res, c->res_off, u->iov, 2 * RESPONSE_MAX_SEGMENTS + 1,
+                                     &more);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&u->msg;
+    sqe->len = 1;
+    sqe->msg_flags = more ? MSG_MORE : 0;
+    sqe->user_data = uring_tag(c, UOP_SEND);
+    u->send_armed = 1;
+    u->inflight++;
+    return 0;
+}
+#endif
+
+/* What a connection is waiting for after being driven */
+enum {
+    CONN_WANT_READ,
+    CONN_WANT_WRITE,
+    CONN_PARKED,   /* waiting for an offloaded handler; nothing to arm */
+    CONN_CLOSE
+};
+
+#ifdef HAVE_IO_URING
+/* Whether the connection speaks TLS, and so is readiness-driven under io_uring */
+static int conn_is_tls(const conn_t *c) {
+#ifdef HAVE_OPENSSL
+    return c->tls != NULL;
+#else
+    (void)c;
+    return 0;
+#endif
+}
+#endif
+
+/* Whether OpenSSL encrypts this connection's sends, so the socket cannot be written directly */
+static int conn_user_tls(const conn_t *c) {
+#ifdef HAVE_OPENSSL
+    return c->tls && !c->ktls_send;
+#else
+    (void)c;
+    return 0;
+#endif
+}
+
+#ifdef HAVE_OPENSSL
+/*
+ * Map a failed SSL_read_ex() or SSL_write_ex() to the read()/write()
+ * convention: -1 with EAGAIN if it would block, 0 on a clean close, -1
+ * otherwise. A failed connection is not sent a close_notify.
+ */
+static ssize_t tls_io_result(SSL *ssl, int r) {
+    switch (SSL_get_error(ssl, r)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            SSL_set_quiet_shutdown(ssl, 1);
+            errno = EIO;
+            return -1;
+    }
+}
+
+/*
+ * Advance the TLS handshake of a new connection. Once it is done, see
+ * whether the kernel took over encrypting sends (kTLS): then responses
+ * go out with sendmsg() and sendfile() exactly as for plain HTTP, and
+ * only reads pass through OpenSSL. Returns 1 when done, 0 with *want set
+ * if it would block, -1 on failure.
+ */
+static int conn_tls_handshake(conn_t *c, int *want) {
+    if (!c->tls) {
+        c->tls = SSL_new(__atomic_load_n(&tls_ctx, __ATOMIC_ACQUIRE));
+        if (!c->tls || !SSL_set_fd(c->tls, c->fd)) {
+            return -1;
+        }
+        SSL_set_accept_state(c->tls);
+        if (request_timeout > 0) {
+            c->deadline = monotonic_seconds() + request_timeout;
+        }
+    }
+
+    ERR_clear_error();
+    int r = SSL_do_handshake(c->tls);
+    if (r == 1) {
+        STAT_ADD(tls_handshakes, 1);
+        if (SSL_session_reused(c->tls)) {
+            STAT_ADD(tls_resumed, 1);
+        }
+#ifdef BIO_get_ktls_send
+        c->ktls_send = BIO_get_ktls_send(SSL_get_wbio(c->tls));
+        if (c->ktls_send) {
+            STAT_ADD(tls_ktls, 1);
+        }
+#endif
+        c->deadline = 0;
+        c->phase = CONN_PHASE_HEAD;
+        return 1;
+    }
+    int err = SSL_get_error(c->tls, r);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        *want = err == SSL_ERROR_WANT_WRITE ? CONN_WANT_WRITE : CONN_WANT_READ;
+        return 0;
+    }
+    SSL_set_quiet_shutdown(c->tls, 1);
+    return -1;
+}
+
+/* Send close_notify once, unless the connection failed or never finished its handshake */
+static void conn_tls_shutdown(conn_t *c) {
+    if (c->tls && SSL_is_init_finished(c->tls) && !SSL_get_quiet_shutdown(c->tls) &&
+        !(SSL_get_shutdown(c->tls) & SSL_SENT_SHUTDOWN)) {
+        ERR_clear_error();
+        SSL_shutdown(c->tls);
+    }
+}
+#endif
+
+/* read() from the client, decrypting if the connection is TLS */
+static ssize_t conn_recv(conn_t *c, void *buf, size_t len) {
+#ifdef HAVE_OPENSSL
+    if (c->tls) {
+        size_t n;
+        ERR_clear_error();
+        int r = SSL_read_ex(c->tls, buf, len, &n);
+        return r ? (ssize_t)n : tls_io_result(c->tls, r);
+    }
+#endif
+    return read(c->fd, buf, len);
+}
+
+/* send() to the client, encrypting in user space unless kTLS does it */
+static ssize_t conn_send(conn_t *c, const void *buf, size_t len, int flags) {
+#ifdef HAVE_OPENSSL
+    if (conn_user_tls(c)) {
+        size_t n;
+        ERR_clear_error();
+        int r = SSL_write_ex(c->tls, buf, len, &n);
+        return r ? (ssize_t)n : tls_io_result(c->tls, r);
+    }
+#endif
+    return send(c->fd, buf, len, flags);
+}
+
+/*
+ * sendmsg() to the client. Under user-space TLS the iovecs are gathered
+ * into one record first, so a response does not cost a record and a
+ * write per slab run and segment.
+ */
+static ssize_t conn_sendmsg(conn_t *c, const struct msghdr *msg, int flags) {
+    if (conn_user_tls(c)) {
+        char record[FILE_COPY_CHUNK];
+        size_t len = 0;
+        for (size_t i = 0; i < (size_t)msg->msg_iovlen && len < sizeof(record); i++) {
+            size_t n = msg->msg_iov[i].iov_len;
+            if (n > sizeof(record) - len) {
+                n = sizeof(record) - len;
+            }
+            memcpy(record + len, msg->msg_iov[i].iov_base, n);
+            len += n;
+        }
+        return conn_send(c, record, len, flags);
+    }
+    return sendmsg(c->fd, msg, flags);
+}
+
+/*
+ * Set up connection state for an accepted socket, reusing a pooled object
+ * (and its response slab) when one is available.
+ */
+static conn_t *conn_new(int fd, const struct sockaddr_in *addr, mem_pool_t *pool) {
+    conn_t *c;
+    if (pool && pool->free_conns) {
+        c = pool->free_conns;
+        pool->free_conns = c->next;
+        pool->num_free_conns--;
+    } else {
+        void *mem;
+        if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(conn_t) + read_buffer_size) != 0) {
+            return NULL;
+        }
+        c = mem;
+        c->rbuf = (char *)(c + 1);
+        c->res.data = NULL;
+        c->res.capacity = 0;
+    }
+    c->fd = fd;
+    c->addr = *addr;
+    c->rstart = 0;
+    c->rlen = 0;
+    http_parser_init(&c->parser);
+    c->phase = CONN_PHASE_HEAD;
+#ifdef HAVE_OPENSSL
+    c->tls = NULL;
+    c->ktls_send = 0;
+    if (__atomic_load_n(&tls_ctx, __ATOMIC_ACQUIRE)) {
+        c->phase = CONN_PHASE_HANDSHAKE;
+    }
+#endif
+    response_clear(&c->res);
+    c->arena.blocks = NULL;
+    c->arena.ptr = NULL;
+    c->arena.end = NULL;
+    c->arena.pool = pool;
+    c->res.arena = &c->arena;
+    c->pool = pool;
+    c->res_off = 0;
+    c->keep_alive = 0;
+    c->requests = 0;
+    c->events = 0;
+    c->last_active = 0;
+    c->deadline = 0;
+    c->started_ns = 0;
+    c->sent = 0;
+    c->log_sampled = 0;
+    c->log_line = NULL;
+    c->log_line_len = 0;
+    c->offload = NULL;
+    c->offloaded = 0;
+    c->continue_off = 0;
+    c->prev = NULL;
+    c->next = NULL;
+#ifdef HAVE_IO_URING
+    memset(&c->u, 0, sizeof(c->u));
+    c->u.pending_bid = -1;
+#endif
+    STAT_ADD(conns_opened, 1);
+    __atomic_add_fetch(&conns_active, 1, __ATOMIC_RELAXED);
+    return c;
+}
+
+/* Close the socket and return connection state to its pool */
+static void conn_free(conn_t *c) {
+    mem_pool_t *pool = c->pool;
+
+#ifdef HAVE_OPENSSL
+    if (c->tls) {
+        conn_tls_shutdown(c);
+        SSL_free(c->tls);
+        c->tls = NULL;
+    }
+#endif
+    close(c->fd);
+    STAT_ADD(conns_closed, 1);
+    __atomic_sub_fetch(&conns_active, 1, __ATOMIC_RELAXED);
+    response_release_body(&c->res);
+    arena_reset(&c->arena);
+
+    if (pool && pool->num_free_conns < CONN_POOL_MAX) {
+        if (c->res.capacity > RESPONSE_SLAB_KEEP) {
+            response_free(&c->res);
+        }
+        c->next = pool->free_conns;
+        pool->free_conns = c;
+        pool->num_free_conns++;
+        return;
+    }
+
+    response_free(&c->res);
+    free(c);
+}
+
+/* Release everything cached in a pool */
+static void mem_pool_drain(mem_pool_t *pool) {
+    while (pool->free_conns) {
+        conn_t *c = pool->free_conns;
+        pool->free_conns = c->next;
+        response_free(&c->res);
+        free(c);
+    }
+    while (pool->free_blocks) {
+        arena_block_t *b = pool->free_blocks;
+        pool->free_blocks = b->next;
+        free(b);
+    }
+    pool->num_free_conns = 0;
+    pool->num_free_blocks = 0;
+}
+
+/*
+ * Read more request bytes after any still-unparsed input, compacting the
+ * buffer only when the unparsed tail has reached its end. Under io_uring
+ * the bytes come from what the ring has already received.
+ * Returns 1 if bytes were read, 0 if the socket would block, -1 on EOF or error.
+ */
+static int conn_fill(conn_t *c) {
+    if (c->rlen == read_buffer_size && c->rstart > 0) {
+        c->rlen -= c->rstart;
+        memmove(c->rbuf, c->rbuf + c->rstart, c->rlen);
+        c->rstart = 0;
+    }
+
+#ifdef HAVE_IO_URING
+    /* TLS connections wait for readiness and read through OpenSSL */
+    if (c->u.ring && !c->u.readable && !conn_is_tls(c)) {
+        return conn_fill_uring(c);
+    }
+    c->u.readable = 0;
+#endif
+
+    for (;;) {
+        ssize_t n = conn_recv(c, c->rbuf + c->rlen, read_buffer_size - c->rlen);
+        if (n > 0) {
+            c->rlen += n;
+            return 1;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        return -1;
+    }
+}
+
+/* Start a fresh response for the current request */
+static int conn_begin_response(conn_t *c) {
+    if (!c->res.data) {
+        if (response_init(&c->res, BUFFER_SIZE) < 0) {
+            return -1;
+        }
+        c->res.arena = &c->arena;
+    }
+    response_release_body(&c->res);
+    c->res.size = 0;
+    c->res.status = 0;
+    c->res.route_kind = ROUTE_KIND_OTHER;
+    c->res.on_body = NULL;
+    c->res.on_body_end = NULL;
+    c->res.body_ctx = NULL;
+    c->res.produce = NULL;
+    c->res.produce_ctx = NULL;
+    c->res.allow_chunked = 0;
+    c->res.stream_chunked = 0;
+    c->res.head_only = 0;
+    c->res.user_copy = 0;
+    c->res_off = 0;
+    c->started_ns = monotonic_ns();
+    c->sent = 0;
+    c->log_sampled = access_log_sampled();
+    c->log_line = NULL;
+    c->log_line_len = 0;
+    return 0;
+}
+
+/* Keep the request line of a sampled request, which the buffer will not */
+static void conn_log_line(conn_t *c) {
+    const http_parser_t *p = &c->parser;
+    const char *buf = c->rbuf + c->rstart;
+
+    if (p->method_len >= MAX_METHOD_SIZE) {
+        return;
+    }
+    size_t target_len = p->target_len;
+    if (p->method_len + target_len + 11 > LOG_LINE_MAX) {
+        target_len = LOG_LINE_MAX - 11 - p->method_len;
+    }
+    char *line = arena_alloc(&c->arena, LOG_LINE_MAX);
+    if (line) {
+        c->log_line = line;
+        c->log_line_len = snprintf(line, LOG_LINE_MAX, "%.*s %.*s HTTP/1.%d", (int)p->method_len,
+                                   buf + p->method_off, (int)target_len, buf + p->target_off,
+                                   p->version_minor);
+    }
+}
+
+/* Whether the connection may stay open after the current request */
+static int conn_may_keep_alive(const conn_t *c) {
+    return c->parser.keep_alive && keepalive_timeout > 0 &&
+           c->requests + 1 < keepalive_max_requests && !draining;
+}
+
+/* Finish a request head once its handler has built the response */
+static int conn_handled(conn_t *c) {
+    int expect = c->parser.expect_continue && c->parser.state != PS_DONE;
+
+    /* A handler reading the body builds its response later, when it may stay open */
+    if (expect && c->res.on_body) {
+        c->res.keep_alive = conn_may_keep_alive(c);
+    }
+    c->keep_alive = c->res.keep_alive;
+
+    /* From here on the deadline is for the body to keep arriving */
+    c->deadline = request_timeout > 0 && c->parser.state != PS_DONE ?
+                  monotonic_seconds() + request_timeout : 0;
+
+    /* The head is no longer referenced once the handler returns */
+    c->rstart += c->parser.pos;
+
+    /*
+     * The client holds the body back until told to go ahead. If nothing
+     * reads it, the final response (built to close) goes out at once and
+     * the lingering close discards whatever the client sends anyway.
+     */
+    if (expect && !c->res.on_body) {
+        if (c->res.head_only) {
+            response_drop_body(&c->res);
+        }
+        c->phase = CONN_PHASE_WRITE;
+        return 0;
+    }
+    c->continue_off = 0;
+    c->phase = expect ? CONN_PHASE_CONTINUE : CONN_PHASE_BODY;
+    return 0;
+}
+
+/*
+ * Build the response for the parsed request head. A blocking handler is
+ * sent to the offload pool, leaving the connection in CONN_PHASE_OFFLOAD
+ * with its response and arena owned by the pool thread; the arena
+ * allocates from the heap meanwhile since the worker's free lists are not
+ * shared.
+ */
+static int conn_process(conn_t *c) {
+    offload_job_t *job = NULL;
+
+    if (conn_begin_response(c) < 0) {
+        return -1;
+    }
+    /* A response sent before an expected body arrives has to close */
+    c->res.keep_alive = conn_may_keep_alive(c) &&
+                        !(c->parser.expect_continue && c->parser.state != PS_DONE);
+    c->res.allow_chunked = c->parser.version_minor >= 1;
+    c->res.user_copy = conn_user_tls(c);
+    if (c->log_sampled) {
+        conn_log_line(c);
+    }
+    handle_request(&c->parser, c->rbuf + c->rstart, &c->res, c->offload ? &job : NULL);
+#ifdef HAVE_EPOLL
+    /* Shed instead of letting this worker's backlog of blocking work grow */
+    if (job && c->offload->outstanding >= OFFLOAD_QUEUE_DEPTH) {
+        send_http_error(&c->res, HTTP_SERVICE_UNAVAILABLE);
+        job = NULL;
+    }
+    if (job) {
+        job->conn = c;
+        job->done = c->offload;
+        c->offload->outstanding++;
+        c->offloaded = 1;
+        c->arena.pool = NULL;
+        c->phase = CONN_PHASE_OFFLOAD;
+        offload_submit(job);
+        return 0;
+    }
+#endif
+    return conn_handled(c);
+}
+
+/*
+ * Answer with status instead of reading the rest of the request, then
+ * close. Also used when a request misses its deadline.
+ */
+static int conn_abort_body(conn_t *c, int status) {
+    if (conn_begin_response(c) < 0) {
+        return -1;
+    }
+    c->res.keep_alive = 0;
+    c->keep_alive = 0;
+    send_http_error(&c->res, status);
+    c->phase = CONN_PHASE_WRITE;
+    return 0;
+}
+
+/* Answer a request that could not be parsed, then close */
+static int conn_reject(conn_t *c) {
+    if (conn_begin_response(c) < 0) {
+        return -1;
+    }
+    c->res.keep_alive = 0;
+    c->keep_alive = 0;
+    send_http_response(&c->res, HTTP_BAD_REQUEST, "text/html",
+                      "<h1>400 Bad Request</h1>", 24);
+    c->phase = CONN_PHASE_WRITE;
+    return 0;
+}
+
+/*
+ * Send up to len bytes of the response's file starting at *off, advancing
+ * it. Returns the bytes sent, 0 if the socket would block, -1 on error.
+ */
+static ssize_t conn_send_file_range(conn_t *c, off_t *off, size_t len) {
+    response_t *res = &c->res;
+
+    for (;;) {
+        ssize_t n;
+#ifdef HAVE_SENDFILE
+        if (!conn_user_tls(c)) {
+            n = sendfile(c->fd, res->file_fd, off, len);
+        } else
+#endif
+        {
+            /* Bytes OpenSSL encrypts have to pass through user space */
+            char chunk[FILE_COPY_CHUNK];
+            size_t want = len < sizeof(chunk) ? len : sizeof(chunk);
+            n = pread(res->file_fd, chunk, want, *off);
+            if (n > 0) {
+                n = conn_send(c, chunk, n, 0);
+                if (n > 0) {
+                    *off += n;
+                }
+            }
+        }
+        if (n > 0) {
+            c->sent += n;
+            STAT_ADD(bytes_sent, n);
+            return n;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        /* The file shrank underneath us or the peer went away */
+        return -1;
+    }
+}
+
+/* Stream the file body that follows the in-memory response */
+static int conn_send_file(conn_t *c) {
+    response_t *res = &c->res;
+
+    while (res->file_len > 0) {
+        ssize_t n = conn_send_file_range(c, &res->file_off, res->file_len);
+        if (n <= 0) {
+            return (int)n;
+        }
+        res->file_len -= n;
+    }
+
+    return 1;
+}
+
+/*
+ * Write as much of the pending response as the socket accepts, resuming
+ * after short writes. Headers are sent with MSG_MORE when file data
+ * follows so the kernel coalesces them with the next sendfile() segment.
+ * File segments between in-memory runs (multipart ranges) are sent in
+ * place. Returns 1 when done, 0 if it would block, -1 on error.
+ */
+static int conn_flush(conn_t *c) {
+    response_t *res = &c->res;
+    size_t total = res->size + res->seg_bytes;
+
+    while (c->res_off < total) {
+        off_t file_off;
+        size_t file_len;
+        if (response_file_at(res, c->res_off, &file_off, &file_len)) {
+            ssize_t n = conn_send_file_range(c, &file_off, file_len);
+            if (n <= 0) {
+                return (int)n;
+            }
+            c->res_off += n;
+            continue;
+        }
+#ifdef HAVE_IO_URING
+        if (c->u.ring && !conn_user_tls(c)) {
+            return conn_send_uring(c);
+        }
+#endif
+        struct iovec iov[2 * RESPONSE_MAX_SEGMENTS + 1];
+        struct msghdr msg = {.msg_iov = iov};
+        int more;
+        msg.msg_iovlen = response_iov(res, c->res_off, iov, 2 * RESPONSE_MAX_SEGMENTS + 1, &more);
+
+        /* sendmsg() is writev() with flags, so MSG_MORE can be passed */
+        ssize_t n = conn_sendmsg(c, &msg, more ? MSG_MORE : 0);
+        if (n > 0) {
+            c->res_off += n;
+            c->sent += n;
+            STAT_ADD(bytes_sent, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        return -1;
+    }
+
+    if (res->file_fd >= 0) {
+        return conn_send_file(c);
+    }
+    return 1;
+}
+
+/*
+ * Replace the sent piece of a streamed body with the next one from the
+ * handler, framed as a chunk, so at most one piece is held at a time.
+ * The terminating chunk follows the last piece.
+ */
+static int conn_stream_next(conn_t *c) {
+    static const char size_placeholder[] = "00000000\r\n";
+    response_t *res = &c->res;
+    size_t prefix = res->stream_chunked ? sizeof(size_placeholder) - 1 : 0;
+
+    response_release_segments(res);
+    res->size = 0;
+    c->res_off = 0;
+    response_append(res, size_placeholder, prefix);
+
+    int more = res->produce(res->produce_ctx, res);
+    if (more < 0) {
+        return -1;
+    }
+
+    if (res->stream_chunked) {
+        size_t len = res->size - prefix + res->seg_bytes;
+        if (len > 0xffffffffu) {
+            return -1;
+        }
+        if (len > 0) {
+            char hex[9];
+            snprintf(hex, sizeof(hex), "%08zx", len);
+            memcpy(res->data, hex, 8);
+            response_append(res, "\r\n", 2);
+        } else {
+            res->size = 0;
+        }
+        if (!more) {
+            response_append(res, "0\r\n\r\n", 5);
+        }
+    }
+    if (!more) {
+        res->produce = NULL;
+    }
+    return 0;
+}
+
+/* Whether the client may still be sending: input buffered here or in the socket */
+static int conn_has_unread(conn_t *c) {
+    char byte;
+
+    if (c->rstart < c->rlen) {
+        return 1;
+    }
+#ifdef HAVE_IO_URING
+    if (c->u.pending_len > 0) {
+        return 1;
+    }
+#endif
+#ifdef HAVE_OPENSSL
+    if (c->tls && SSL_pending(c->tls) > 0) {
+        return 1;
+    }
+#endif
+    return recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+/*
+ * Get ready to parse the next pipelined request in place. A connection
+ * that is closing while the client may still be sending (pipelined
+ * requests past the cap, an unread body) shuts its write side and drains
+ * input for a while first: closing with unread data resets the connection
+ * and can destroy the response before the client reads it.
+ */
+static int conn_finish_request(conn_t *c) {
+    uint64_t elapsed_ns = monotonic_ns() - c->started_ns;
+
+    stats_record_response(&c->res, elapsed_ns);
+    if (c->log_sampled) {
+        /* io_uring accepts without the peer address; look it up for the log */
+        if (c->addr.sin_family == 0) {
+            socklen_t len = sizeof(c->addr);
+            getpeername(c->fd, (struct sockaddr *)&c->addr, &len);
+        }
+        access_log_record(&c->addr, c->res.status, c->log_line, c->log_line_len, c->sent,
+                          elapsed_ns);
+    }
+    response_release_body(&c->res);
+    arena_reset(&c->arena);
+    c->requests++;
+    c->deadline = 0;
+    /* A draining server closes once nothing pipelined is left to answer */
+    if (draining && c->rstart == c->rlen) {
+        c->keep_alive = 0;
+    }
+    if (!c->keep_alive) {
+#ifdef HAVE_OPENSSL
+        conn_tls_shutdown(c);
+#endif
+        if (!conn_has_unread(c) || shutdown(c->fd, SHUT_WR) < 0) {
+            return -1;
+        }
+        c->phase = CONN_PHASE_LINGER;
+        c->deadline = monotonic_seconds() + LINGER_TIMEOUT;
+        return 0;
+    }
+
+    if (c->rstart == c->rlen) {
+        c->rstart = 0;
+        c->rlen = 0;
+    }
+    http_parser_init(&c->parser);
+    c->phase = CONN_PHASE_HEAD;
+    return 0;
+}
+
+/*
+ * A connection missed its deadline. A request still arriving gets a 408
+ * and the connection closes once it is sent; a stalled response or a
+ * lingering close is simply dropped. Returns -1 if it should close now.
+ */
+static int conn_expire(conn_t *c) {
+    c->deadline = 0;
+    if (c->phase == CONN_PHASE_HEAD || c->phase == CONN_PHASE_CONTINUE ||
+        c->phase == CONN_PHASE_BODY) {
+        return conn_abort_body(c, HTTP_REQUEST_TIMEOUT);
+    }
+    return -1;
+}
+
+/*
+ * Serve as many requests as possible without blocking. Requests already
+ * buffered (pipelined) are parsed and answered before reading again.
+ * The first byte of a request head starts its deadline: the whole head
+ * must arrive within request_timeout, however it is trickled in.
+ */
+static int conn_drive(conn_t *c) {
+    for (;;) {
+        int r;
+
+        switch (c->phase) {
+#ifdef HAVE_OPENSSL
+            case CONN_PHASE_HANDSHAKE: {
+                int want;
+                r = conn_tls_handshake(c, &want);
+                if (r < 0) {
+                    return CONN_CLOSE;
+                }
+                if (r == 0) {
+                    return want;
+                }
+                break;
+            }
+#endif
+
+            case CONN_PHASE_HEAD:
+                if (c->deadline == 0 && c->rstart < c->rlen && request_timeout > 0) {
+                    c->deadline = monotonic_seconds() + request_timeout;
+                }
+                r = http_parse_head(&c->parser, c->rbuf + c->rstart, c->rlen - c->rstart);
+                if (r == HTTP_PARSE_ERROR ||
+                    (r == HTTP_PARSE_AGAIN && c->rlen - c->rstart == read_buffer_size)) {
+                    if (conn_reject(c) < 0) {
+                        return CONN_CLOSE;
+                    }
+                    break;
+                }
+                if (r == HTTP_PARSE_AGAIN) {
+                    r = conn_fill(c);
+                    if (r < 0) {
+                        return CONN_CLOSE;
+                    }
+                    if (r == 0) {
+                        return CONN_WANT_READ;
+                    }
+                    break;
+                }
+                if (conn_process(c) < 0) {
+                    return CONN_CLOSE;
+                }
+                break;
+
+            case CONN_PHASE_OFFLOAD:
+                if (c->offloaded) {
+                    return CONN_PARKED;
+                }
+                c->arena.pool = c->pool;
+                if (conn_handled(c) < 0) {
+                    return CONN_CLOSE;
+                }
+                break;
+
+            case CONN_PHASE_LINGER:
+                /* Discard input until the client closes or the deadline passes */
+                c->rstart = 0;
+                c->rlen = 0;
+                r = conn_fill(c);
+                if (r < 0) {
+                    return CONN_CLOSE;
+                }
+                if (r == 0) {
+                    return CONN_WANT_READ;
+                }
+                break;
+
+            case CONN_PHASE_CONTINUE: {
+                /* Queued ahead of the body; a full socket just waits for room */
+                static const char expect_continue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                size_t left = sizeof(expect_continue) - 1 - c->continue_off;
+                ssize_t n = conn_send(c, expect_continue + c->continue_off, left, 0);
+                if (n > 0) {
+                    c->continue_off += n;
+                    if ((size_t)n == left) {
+                        c->phase = CONN_PHASE_BODY;
+                    }
+                    break;
+                }
+                if (n < 0 && errno == EINTR) {
+                    break;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return CONN_WANT_WRITE;
+                }
+                return CONN_CLOSE;
+            }
+
+            case CONN_PHASE_BODY: {
+                size_t consumed, data_off, data_len;
+                const char *body = c->rbuf + c->rstart;
+                r = http_parse_body(&c->parser, body, c->rlen - c->rstart,
+                                    &consumed, &data_off, &data_len);
+                c->rstart += consumed;
+                if (r == HTTP_PARSE_ERROR) {
+                    return CONN_CLOSE;
+                }
+                if (r == HTTP_PARSE_DATA && c->res.on_body) {
+                    int status = c->res.on_body(c->res.body_ctx, body + data_off, data_len);
+                    if (status != 0 && conn_abort_body(c, status) < 0) {
+                        return CONN_CLOSE;
+                    }
+                } else if (r == HTTP_PARSE_DONE) {
+                    if (c->res.on_body_end) {
+                        c->res.on_body_end(c->res.body_ctx, &c->res);
+                        c->keep_alive = c->res.keep_alive;
+                    }
+                    if (c->res.on_body && c->res.size == 0 && c->res.nsegs == 0) {
+                        send_http_error(&c->res, HTTP_INTERNAL_ERROR);
+                    }
+                    if (c->res.head_only) {
+                        response_drop_body(&c->res);
+                    }
+                    c->phase = CONN_PHASE_WRITE;
+                } else if (r == HTTP_PARSE_AGAIN) {
+                    /* Everything buffered has been consumed; refill from the start */
+                    c->rstart = 0;
+                    c->rlen = 0;
+                    r = conn_fill(c);
+                    if (r < 0) {
+                        return CONN_CLOSE;
+                    }
+                    if (r == 0) {
+                        return CONN_WANT_READ;
+                    }
+                    if (request_timeout > 0) {
+                        c->deadline = monotonic_seconds() + request_timeout;
+                    }
+                }
+                break;
+            }
+
+            case CONN_PHASE_WRITE:
+                r = conn_flush(c);
+                if (r < 0) {
+                    return CONN_CLOSE;
+                }
+                if (r == 0) {
+                    /* The client must keep reading, one stall at most request_timeout */
+                    if (request_timeout > 0) {
+                        c->deadline = monotonic_seconds() + request_timeout;
+                    }
+                    return CONN_WANT_WRITE;
+                }
+                if (c->res.produce) {
+                    if (conn_stream_next(c) < 0) {
+                        return CONN_CLOSE;
+                    }
+                    break;
+                }
+                if (conn_finish_request(c) < 0) {
+                    return CONN_CLOSE;
+                }
+                break;
+        }
+    }
+}
+
+/* Thread function to handle client connection */
+static void *client_thread(void *arg) {
+    conn_t *c = (conn_t *)arg;
+    mem_pool_t pool = {NULL, 0, NULL, 0};
+
+    /* The connection object itself is not pooled, only its arena blocks */
+    c->arena.pool = &pool;
+    set_nonblocking(c->fd);
+    stats_attach();
+
+    int state;
+    while ((state = conn_drive(c)) != CONN_CLOSE) {
+        struct pollfd pfd = {
+            .fd = c->fd,
+            .events = state == CONN_WANT_READ ? POLLIN : POLLOUT
+        };
+        time_t idle_since = monotonic_seconds();
+        int n;
+
+        /*
+         * Wake every tick to check the deadline, the idle timeout and a drain.
+         * A request in progress, including a stalled response write, is bound
+         * by its deadline; the idle timeout covers the rest.
+         */
+        while ((n = poll(&pfd, 1, EVENT_LOOP_TICK_MS)) == 0 && keep_running) {
+            time_t now = monotonic_seconds();
+            if ((c->deadline && now >= c->deadline) ||
+                (!c->deadline && keepalive_timeout > 0 && now - idle_since >= keepalive_timeout) ||
+                (draining && c->requests > 0 && c->phase == CONN_PHASE_HEAD &&
+                 c->rstart == c->rlen)) {
+                break;
+            }
+        }
+        if (n < 0 || !keep_running) {
+            break;
+        }
+        if (n == 0 && (!c->deadline || monotonic_seconds() < c->deadline || conn_expire(c) < 0)) {
+            break;
+        }
+    }
+
+    conn_free(c);
+    mem_pool_drain(&pool);
+    stats_detach();
+
+    return NULL;
+}
+
+static void config_reload(void);
+
+/*
+ * Accept loop spawning one detached thread per connection. Connection
+ * threads start with the server's signals blocked, so a SIGHUP always
+ * interrupts accept() here and the reload runs on this thread. After
+ * SIGQUIT it stops accepting and waits for open connections to finish.
+ */
+static void run_threaded(void) {
+    sigset_t signals;
+    sigset_t old_mask;
+
+    server_signals(&signals);
+    stats_attach();
+    upgrade_notify();
+
+    while (keep_running && !draining) {
+        if (reload_requested) {
+            reload_requested = 0;
+            config_reload();
+        }
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            upgrade_spawn();
+        }
+
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+
+        if (client_fd < 0) {
+            if (!keep_running) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            continue;
+        }
+        STAT_ADD(accepted, 1);
+        if (!conn_admit()) {
+            conn_shed(client_fd);
+            continue;
+        }
+
+        conn_t *client = conn_new(client_fd, &client_addr, NULL);
+        if (!client) {
+            close(client_fd);
+            continue;
+        }
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        pthread_sigmask(SIG_BLOCK, &signals, &old_mask);
+        if (pthread_create(&thread, &attr, client_thread, client) != 0) {
+            perror("pthread_create");
+            conn_free(client);
+        }
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+        pthread_attr_destroy(&attr);
+    }
+
+    /* Connection threads close once their current request is answered */
+    if (keep_running) {
+        time_t give_up = monotonic_seconds() + drain_timeout;
+        printf("Draining: no longer accepting, closing connections as they finish\n");
+        fflush(stdout);
+        while (keep_running && __atomic_load_n(&conns_active, __ATOMIC_RELAXED) > 0 &&
+               (drain_timeout == 0 || monotonic_seconds() < give_up)) {
+            struct timespec pause = {0, 100 * 1000000L};
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    stats_detach();
+}
+
+#ifdef HAVE_EPOLL
+/* Unlink a connection from its worker's activity list */
+static void worker_unlink_conn(worker_t *w, conn_t *c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        w->conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    } else {
+        w->conns_tail = c->prev;
+    }
+    c->prev = NULL;
+    c->next = NULL;
+}
+
+/* Mark a connection as just active by moving it to the list head */
+static void worker_touch_conn(worker_t *w, conn_t *c) {
+    c->last_active = w->now;
+    if (w->conns == c) {
+        return;
+    }
+    if (c->prev || c->next || w->conns_tail == c) {
+        worker_unlink_conn(w, c);
+    }
+    c->next = w->conns;
+    if (w->conns) {
+        w->conns->prev = c;
+    } else {
+        w->conns_tail = c;
+    }
+    w->conns = c;
+}
+
+#ifdef HAVE_IO_URING
+static void uring_close_conn(worker_t *w, conn_t *c);
+#endif
+
+/*
+ * Unlink a connection from its worker and release it. A child forked for
+ * an upgrade holds copies of every socket until it execs, which keeps
+ * epoll watching a closed socket; meanwhile it is removed explicitly.
+ */
+static void worker_close_conn(worker_t *w, conn_t *c) {
+    worker_unlink_conn(w, c);
+#ifdef HAVE_IO_URING
+    if (w->ring) {
+        uring_close_conn(w, c);
+        return;
+    }
+#endif
+    __atomic_add_fetch(&closes_active, 1, __ATOMIC_SEQ_CST);
+    if (c->events && __atomic_load_n(&upgrade_forking, __ATOMIC_SEQ_CST)) {
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+    conn_free(c);
+    __atomic_sub_fetch(&closes_active, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Take a connection off the activity list while a pool thread runs its
+ * handler, so no idle sweep or close frees it underneath the pool.
+ */
+static void worker_park_conn(worker_t *w, conn_t *c) {
+    if (c->prev || c->next || w->conns_tail == c) {
+        worker_unlink_conn(w, c);
+    }
+}
+
+/*
+ * Close connections that have been idle longer than the timeout. One with
+ * a request in progress, such as a stalled response write, is left to its
+ * deadline instead.
+ */
+static void worker_sweep_idle(worker_t *w) {
+    if (keepalive_timeout <= 0) {
+        return;
+    }
+    conn_t *c = w->conns_tail;
+    while (c && w->now - c->last_active >= keepalive_timeout) {
+        conn_t *prev = c->prev;
+        if (!c->deadline) {
+            worker_close_conn(w, c);
+        }
+        c = prev;
+    }
+}
+
+static void worker_drive_conn(worker_t *w, conn_t *c);
+
+/*
+ * Expire requests past their deadline. Activity does not postpone a
+ * deadline the way it postpones the idle timeout, so this walks every
+ * connection, once per tick.
+ */
+static void worker_sweep_deadlines(worker_t *w) {
+    conn_t *c = w->conns;
+    while (c) {
+        conn_t *next = c->next;
+        if (c->deadline && w->now >= c->deadline) {
+            if (conn_expire(c) < 0) {
+                worker_close_conn(w, c);
+            } else {
+                worker_drive_conn(w, c);
+            }
+        }
+        c = next;
+    }
+}
+
+/* Accept every pending connection and register it with this worker */
+static void worker_accept(worker_t *w) {
+    for (;;) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept4(w->listen_fd, (struct sockaddr *)&client_addr, &client_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && keep_running) {
+                perror("accept4");
+            }
+            return;
+        }
+        STAT_ADD(accepted, 1);
+        if (!conn_admit()) {
+            conn_shed(client_fd);
+            continue;
+        }
+
+        conn_t *c = conn_new(client_fd, &client_addr, &w->pool);
+        if (!c) {
+            close(client_fd);
+            continue;
+        }
+        c->offload = offload_started ? &w->done : NULL;
+
+        c->events = EPOLLIN | EPOLLRDHUP;
+        struct epoll_event ev = {.events = c->events, .data.ptr = c};
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            conn_free(c);
+            continue;
+        }
+
+        worker_touch_conn(w, c);
+    }
+}
+
+/* Drive one connection forward after a readiness notification */
+static void worker_conn_event(worker_t *w, conn_t *c, uint32_t events) {
+    if (events & EPOLLERR) {
+        worker_close_conn(w, c);
+        return;
+    }
+
+    int state = conn_drive(c);
+    if (state == CONN_CLOSE) {
+        worker_close_conn(w, c);
+        return;
+    }
+
+    /* A parked connection leaves the epoll set; it is added back on resume */
+    if (state == CONN_PARKED) {
+        if (c->events && epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL) < 0) {
+            perror("epoll_ctl");
+        }
+        c->events = 0;
+        worker_park_conn(w, c);
+        return;
+    }
+
+    int want = state == CONN_WANT_READ ? EPOLLIN | EPOLLRDHUP : EPOLLOUT;
+    if (want != c->events) {
+        struct epoll_event ev = {.events = want, .data.ptr = c};
+        if (epoll_ctl(w->epoll_fd, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+            worker_close_conn(w, c);
+            return;
+        }
+        c->events = want;
+    }
+
+    worker_touch_conn(w, c);
+}
+
+#ifdef HAVE_IO_URING
+static void uring_conn_drive(worker_t *w, conn_t *c);
+#endif
+
+/* Drive a connection outside a readiness notification, whichever engine runs it */
+static void worker_drive_conn(worker_t *w, conn_t *c) {
+#ifdef HAVE_IO_URING
+    if (w->ring) {
+        uring_conn_drive(w, c);
+        return;
+    }
+#endif
+    worker_conn_event(w, c, 0);
+}
+
+/*
+ * Pick up connections whose offloaded handler has finished and carry on
+ * serving them. While shutting down they are closed instead.
+ */
+static void worker_offload_done(worker_t *w) {
+    offload_job_t *job = offload_take_completed(&w->done);
+
+    while (job) {
+        /* The job lives in the connection's arena; read it before resuming */
+        offload_job_t *next = job->next;
+        conn_t *c = job->conn;
+
+        w->done.outstanding--;
+        c->offloaded = 0;
+        worker_touch_conn(w, c);
+        if (!keep_running) {
+            c->arena.pool = c->pool;
+            worker_close_conn(w, c);
+        } else {
+            worker_drive_conn(w, c);
+        }
+        job = next;
+    }
+}
+
+/* Wait for every offloaded handler of this worker to come back */
+static void worker_offload_drain(worker_t *w) {
+    while (w->done.outstanding > 0) {
+        struct pollfd pfd = {.fd = w->done.wake_fd, .events = POLLIN};
+        if (poll(&pfd, 1, EVENT_LOOP_TICK_MS) > 0) {
+            worker_offload_done(w);
+        }
+    }
+}
+
+/*
+ * Drain on SIGQUIT: the first call stops accepting, leaving the listener
+ * open for whichever process took it over, and closes connections idle
+ * between requests. The rest close after their current response.
+ * Accept wakeups are exclusive, so one may have been meant for this
+ * worker; a last non-blocking accept keeps that connection from waiting
+ * in the backlog until the next one wakes the new process.
+ * Returns 1 once the worker may exit: nothing open, or drain_timeout passed.
+ */
+static int worker_drain(worker_t *w) {
+    if (!w->draining) {
+        w->draining = 1;
+        w->drain_started = w->now;
+#ifdef HAVE_IO_URING
+        if (w->ring) {
+            struct io_uring_sqe *sqe = uring_get_sqe(w->ring);
+            if (sqe) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = -1;
+                sqe->addr = uring_tag(NULL, UOP_ACCEPT);
+                sqe->user_data = uring_tag(NULL, UOP_CANCEL);
+            }
+        } else
+#endif
+        {
+            if (epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->listen_fd, NULL) < 0) {
+                perror("epoll_ctl");
+            }
+            worker_accept(w);
+        }
+
+        conn_t *c = w->conns;
+        while (c) {
+            conn_t *next = c->next;
+            /* A connection yet to send its first request may be about to */
+            if (c->requests > 0 && c->phase == CONN_PHASE_HEAD && !conn_has_unread(c)) {
+                worker_close_conn(w, c);
+            }
+            c = next;
+        }
+    }
+
+    if (drain_timeout > 0 && w->now - w->drain_started >= drain_timeout) {
+        return 1;
+    }
+#ifdef HAVE_IO_URING
+    if (w->ring && w->accept_armed) {
+        return 0;
+    }
+#endif
+    return w->conns == NULL && w->done.outstanding == 0;
+}
+
+#ifdef HAVE_IO_URING
+/* Arm a multishot accept on the worker's listening socket */
+static int uring_arm_accept(worker_t *w) {
+    struct io_uring_sqe *sqe = uring_get_sqe(w->ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = uring_tag(NULL, UOP_ACCEPT);
+    w->accept_armed = 1;
+    return 0;
+}
+
+/* Arm the periodic tick that drives idle sweeps and shutdown checks */
+static int uring_arm_tick(worker_t *w) {
+    struct io_uring_sqe *sqe = uring_get_sqe(w->ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&w->tick;
+    sqe->len = 1;
+    sqe->user_data = uring_tag(NULL, UOP_TIMEOUT);
+    return 0;
+}
+
+/* Watch the worker's offload completion eventfd */
+static int uring_arm_wake(worker_t *w) {
+    struct io_uring_sqe *sqe = uring_get_sqe(w->ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = w->done.wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uring_tag(NULL, UOP_WAKE);
+    return 0;
+}
+
+/* Arm a receive into whichever provided buffer the kernel picks */
+static int uring_arm_recv(worker_t *w, conn_t *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(w->ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->len = read_buffer_size;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = uring_tag(c, UOP_RECV);
+    c->u.recv_armed = 1;
+    c->u.inflight++;
+    return 0;
+}
+
+/* Arm a one-shot readiness poll */
+static int uring_arm_poll(worker_t *w, conn_t *c, unsigned events) {
+    struct io_uring_sqe *sqe = uring_get_sqe(w->ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = events;
+    sqe->user_data = uring_tag(c, UOP_POLL);
+    c->u.poll_armed = 1;
+    c->u.inflight++;
+    return 0;
+}
+
+/*
+ * Release a connection once nothing in the ring refers to it. Until then
+ * it waits on the zombie list with its socket shut down, which makes any
+ * pending receive or poll complete.
+ */
+static void uring_close_conn(worker_t *w, conn_t *c) {
+    conn_uring_t *u = &c->u;
+
+    if (u->pending_bid >= 0) {
+        uring_buf_recycle(u->ring, u->pending_bid);
+        u->pending_bid = -1;
+        u->pending_len = 0;
+    }
+    if (u->inflight == 0) {
+        conn_free(c);
+        return;
+    }
+
+    u->closing = 1;
+    shutdown(c->fd, SHUT_RDWR);
+    c->prev = NULL;
+    c->next = w->zombies;
+    if (w->zombies) {
+        w->zombies->prev = c;
+    }
+    w->zombies = c;
+}
+
+/* Free a zombie connection whose last ring operation has completed */
+static void uring_reap_zombie(worker_t *w, conn_t *c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        w->zombies = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    conn_free(c);
+}
+
+/* Run a connection and arm whatever it is now waiting for */
+static void uring_conn_drive(worker_t *w, conn_t *c) {
+    conn_uring_t *u = &c->u;
+    int state = conn_drive(c);
+
+    if (state == CONN_WANT_READ) {
+        int r = 0;
+        if (!u->recv_armed && !u->poll_armed) {
+            r = conn_is_tls(c) ? uring_arm_poll(w, c, POLLIN) : uring_arm_recv(w, c);
+        }
+        if (r < 0) {
+            state = CONN_CLOSE;
+        }
+    } else if (state == CONN_WANT_WRITE) {
+        /* Sends complete on their own; sendfile() backpressure needs a poll */
+        if (!u->send_armed && !u->poll_armed && uring_arm_poll(w, c, POLLOUT) < 0) {
+            state = CONN_CLOSE;
+        }
+    }
+
+    if (state == CONN_CLOSE) {
+        worker_close_conn(w, c);
+        return;
+    }
+    if (state == CONN_PARKED) {
+        worker_park_conn(w, c);
+        return;
+    }
+    worker_touch_conn(w, c);
+}
+
+/* Register a connection produced by the multishot accept */
+static void uring_accept_conn(worker_t *w, int fd) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+
+    STAT_ADD(accepted, 1);
+    if (!conn_admit()) {
+        conn_shed(fd);
+        return;
+    }
+    conn_t *c = conn_new(fd, &addr, &w->pool);
+    if (!c) {
+        close(fd);
+        return;
+    }
+    c->u.ring = w->ring;
+    c->offload = offload_started ? &w->done : NULL;
+    uring_conn_drive(w, c);
+}
+
+/* Dispatch one completion */
+static void uring_complete(worker_t *w, const struct io_uring_cqe *cqe) {
+    int op = (int)(cqe->user_data & UOP_MASK);
+    conn_t *c = (conn_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)UOP_MASK);
+
+    if (op == UOP_ACCEPT) {
+        if (cqe->res >= 0) {
+            uring_accept_conn(w, cqe->res);
+        }
+        if (cqe->flags & IORING_CQE_F_MORE) {
+            return;
+        }
+        w->accept_armed = 0;
+        if (w->draining) {
+            /* Take what the cancelled accept may have been woken for, as worker_drain() does */
+            int fd;
+            while ((fd = accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                uring_accept_conn(w, fd);
+            }
+        } else if (keep_running && uring_arm_accept(w) < 0) {
+            perror("io_uring accept");
+        }
+        return;
+    }
+    if (op == UOP_TIMEOUT) {
+        if (keep_running) {
+            uring_arm_tick(w);
+        }
+        return;
+    }
+    if (op == UOP_CANCEL) {
+        return;
+    }
+    if (op == UOP_WAKE) {
+        worker_offload_done(w);
+        if (keep_running) {
+            uring_arm_wake(w);
+        }
+        return;
+    }
+
+    conn_uring_t *u = &c->u;
+    int bid = cqe->flags & IORING_CQE_F_BUFFER ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    u->inflight--;
+
+    if (u->closing) {
+        if (bid >= 0) {
+            uring_buf_recycle(u->ring, bid);
+        }
+        if (u->inflight == 0) {
+            uring_reap_zombie(w, c);
+        }
+        return;
+    }
+
+    switch (op) {
+        case UOP_RECV:
+            u->recv_armed = 0;
+            if (cqe->res > 0 && bid >= 0) {
+                u->pending = u->ring->bufs + (size_t)bid * read_buffer_size;
+                u->pending_len = (size_t)cqe->res;
+                u->pending_bid = bid;
+            } else if (cqe->res == -ENOBUFS) {
+                /* Every buffer is in use; wait for readability and read() instead */
+                if (uring_arm_poll(w, c, POLLIN) < 0) {
+                    worker_close_conn(w, c);
+                }
+                return;
+            } else {
+                if (bid >= 0) {
+                    uring_buf_recycle(u->ring, bid);
+                }
+                u->eof = 1;
+            }
+            break;
+
+        case UOP_SEND:
+            u->send_armed = 0;
+            if (cqe->res < 0) {
+                worker_close_conn(w, c);
+                return;
+            }
+            c->res_off += (size_t)cqe->res;
+            c->sent += (size_t)cqe->res;
+            STAT_ADD(bytes_sent, cqe->res);
+            break;
+
+        case UOP_POLL:
+            u->poll_armed = 0;
+            if (c->phase != CONN_PHASE_WRITE && c->phase != CONN_PHASE_CONTINUE) {
+                u->readable = 1;
+            }
+            break;
+    }
+
+    /* Whatever arrived waits in pending until the handler comes back */
+    if (c->offloaded) {
+        return;
+    }
+    uring_conn_drive(w, c);
+}
+
+/* Reap every available completion */
+static void uring_reap(worker_t *w) {
+    uring_t *r = w->ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        uring_complete(w, &cqe);
+        if (head == tail) {
+            tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+}
+
+/*
+ * Worker loop on io_uring: one io_uring_enter() per iteration submits
+ * everything queued while handling the previous batch of completions and
+ * waits for the next.
+ */
+static void uring_worker_loop(worker_t *w) {
+    w->tick.tv_sec = EVENT_LOOP_TICK_MS / 1000;
+    w->tick.tv_nsec = (EVENT_LOOP_TICK_MS % 1000) * 1000000L;
+    if (uring_arm_accept(w) < 0 || uring_arm_tick(w) < 0 ||
+        (offload_started && uring_arm_wake(w) < 0)) {
+        return;
+    }
+
+    while (keep_running) {
+        if (uring_submit(w->ring, 1) < 0 && errno != EINTR && errno != EBUSY &&
+            errno != ETIME) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        time_t now = monotonic_seconds();
+        if (now != w->now) {
+            w->now = now;
+            worker_sweep_idle(w);
+            worker_sweep_deadlines(w);
+        }
+
+        uring_reap(w);
+        if (draining && worker_drain(w)) {
+            break;
+        }
+    }
+
+    /* Shut everything down, cancel what is left and wait for it to drain */
+    worker_offload_drain(w);
+    while (w->conns) {
+        worker_close_conn(w, w->conns);
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(w->ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        sqe->user_data = uring_tag(NULL, UOP_CANCEL);
+    }
+    for (int i = 0; i < 10 && w->zombies; i++) {
+        uring_arm_tick(w);
+        uring_submit(w->ring, 1);
+        uring_reap(w);
+    }
+}
+#endif
+
+/* NUMA node a CPU belongs to, from sysfs; -1 when the kernel reports none */
+static int cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+
+    int node = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && isdigit((unsigned char)entry->d_name[4])) {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/*
+ * Prefer NUMA node for new pages: of the range at addr, or of every page
+ * the calling thread faults in when addr is NULL. Advisory; kernels without
+ * NUMA support refuse and memory stays wherever first touch puts it.
+ */
+static void numa_prefer(int node, void *addr, size_t len) {
+    if (node < 0 || node >= (int)(8 * sizeof(unsigned long))) {
         return;
     }
+    unsigned long mask = 1UL << node;
+    unsigned long max_node = 8 * sizeof(mask) + 1;
+    if (addr) {
+#ifdef SYS_mbind
+        syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, max_node, 0);
+#endif
+    } else {
+#ifdef SYS_set_mempolicy
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, max_node);
+#endif
+    }
+}
+
+/* Event loop run by each worker thread */
+static void *worker_thread(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    /* Connections, buffers, arena blocks and ring buffers come from this node */
+    numa_prefer(w->node, NULL, 0);
+    stats_attach();
+
+#ifdef HAVE_IO_URING
+    if (use_io_uring) {
+        uring_t ring;
+        if (uring_init(&ring) == 0) {
+            /* The listener is served by the ring; keep epoll from competing for it */
+            epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->listen_fd, NULL);
+            w->ring = &ring;
+            uring_worker_loop(w);
+            uring_destroy(&ring);
+            while (w->zombies) {
+                conn_t *c = w->zombies;
+                w->zombies = c->next;
+                conn_free(c);
+            }
+            w->ring = NULL;
+            mem_pool_drain(&w->pool);
+            stats_detach();
+            return NULL;
+        }
+        if (w->id == 0) {
+            perror("io_uring_setup, using epoll");
+        }
+    }
+#endif
+
+    while (keep_running) {
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, EVENT_LOOP_TICK_MS);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        time_t now = monotonic_seconds();
+        int tick = now != w->now;
+        w->now = now;
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                worker_accept(w);
+            } else if (events[i].data.ptr == &w->done) {
+                worker_offload_done(w);
+            } else {
+                worker_conn_event(w, events[i].data.ptr, events[i].events);
+            }
+        }
+
+        /* Sweep only once the batch is handled: it may hold events for what gets closed */
+        if (tick) {
+            worker_sweep_idle(w);
+            worker_sweep_deadlines(w);
+        }
+        if (draining && worker_drain(w)) {
+            break;
+        }
+    }
 
-    if (parse_request_line(buffer, method, path, query_string) < 0) {
-        send_http_response(&res, HTTP_BAD_REQUEST, "text/html",
-                          "<h1>400 Bad Request</h1>", 24);
-        write(client_fd, res.data, res.size);
-        response_free(&res);
-        return;
+    worker_offload_drain(w);
+    while (w->conns) {
+        worker_close_conn(w, w->conns);
     }
+    mem_pool_drain(&w->pool);
+    stats_detach();
 
-    if (strcmp(method, "GET") != 0) {
-        send_http_response(&res, HTTP_METHOD_NOT_ALLOWED, "text/html",
-                          "<h1>405 Method Not Allowed</h1>", 32);
-        write(client_fd, res.data, res.size);
-        response_free(&res);
-        return;
+    return NULL;
+}
+
+/* Pick the CPU for a worker: the index-th CPU this process may run on */
+static int worker_cpu(int index) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        return -1;
+    }
+    int count = CPU_COUNT(&set);
+    if (count == 0) {
+        return -1;
+    }
+    int target = index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && target-- == 0) {
+            return cpu;
+        }
     }
+    return -1;
+}
 
-    query_params_t query_params;
-    parse_query_string(query_string, &query_params);
+/* Bytes mapped for one worker: its state rounded up to whole pages */
+static size_t worker_map_len(void) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (sizeof(worker_t) + page - 1) / page * page;
+}
 
-    request_t req = {
-        .method = method,
-        .path = path,
-        .query = &query_params
-    };
+/*
+ * Worker state in pages of its own on the worker's node. The main thread
+ * fills it in, but the binding is set before the first touch, so the list
+ * heads, pool and clock the event loop reads on every wakeup stay local,
+ * and no two workers share a cache line.
+ */
+static worker_t *worker_alloc(int node) {
+    size_t len = worker_map_len();
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    numa_prefer(node, mem, len);
+    return mem;
+}
+
+/* Release worker state from worker_alloc */
+static void worker_free(worker_t *w) {
+    munmap(w, worker_map_len());
+}
+
+/* Thread attributes starting a worker on its CPU, before it allocates anything */
+static void worker_attr(pthread_attr_t *attr, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "pthread_attr_setaffinity_np: %s\n", strerror(err));
+    }
+}
+
+/*
+ * Run N epoll workers. By default they share the listening socket; with
+ * reuseport_listeners each worker binds its own SO_REUSEPORT socket and the
+ * kernel spreads new connections across them. When workers are pinned,
+ * SO_INCOMING_CPU steers each connection to the worker on the CPU that
+ * processed its packets.
+ */
+static int run_event_loop(int port, int num_workers) {
+    worker_t *workers[MAX_WORKERS];
+    int started = 0;
+    sigset_t signals;
+    sigset_t old_mask;
+
+    if (set_nonblocking(server_fd) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+
+    /* Threads inherit the mask: only this thread takes the server's signals */
+    server_signals(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_mask);
+    offload_start();
+
+    for (int i = 0; i < num_workers; i++) {
+        int cpu = pin_workers ? worker_cpu(i) : -1;
+        int node = cpu >= 0 ? cpu_node(cpu) : -1;
+        worker_t *w = worker_alloc(node);
+        workers[i] = w;
+        if (!w) {
+            break;
+        }
+        w->id = i;
+        w->conns = NULL;
+        w->conns_tail = NULL;
+        w->now = monotonic_seconds();
+        w->cpu = cpu;
+        w->node = node;
+        memset(&w->pool, 0, sizeof(w->pool));
+        w->done.head = NULL;
+        w->done.wake_fd = -1;
+        w->done.outstanding = 0;
+        w->draining = 0;
+        w->drain_started = 0;
+#ifdef HAVE_IO_URING
+        w->ring = NULL;
+        w->accept_armed = 0;
+        w->zombies = NULL;
+#endif
+
+        w->listen_fd = server_fd;
+        if (reuseport_listeners && i > 0) {
+            w->listen_fd = listener_open(i, port, 1);
+            if (w->listen_fd < 0) {
+                break;
+            }
+            if (set_nonblocking(w->listen_fd) < 0) {
+                perror("fcntl");
+                close(w->listen_fd);
+                break;
+            }
+        }
+
+#ifdef SO_INCOMING_CPU
+        if (reuseport_listeners && w->cpu >= 0 &&
+            setsockopt(w->listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &w->cpu, sizeof(w->cpu)) < 0) {
+            perror("setsockopt SO_INCOMING_CPU");
+        }
+#endif
+
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epoll_fd < 0) {
+            perror("epoll_create1");
+            if (w->listen_fd != server_fd) {
+                close(w->listen_fd);
+            }
+            break;
+        }
+
+        /* EPOLLEXCLUSIVE wakes a single worker per connection on a shared socket */
+        struct epoll_event ev = {
+            .events = w->listen_fd == server_fd && !reuseport_listeners ?
+                      EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN,
+            .data.ptr = NULL
+        };
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(w->epoll_fd);
+            if (w->listen_fd != server_fd) {
+                close(w->listen_fd);
+            }
+            break;
+        }
+
+        /* Completed offloaded handlers arrive through the worker's eventfd */
+        if (offload_started) {
+            struct epoll_event wake = {.events = EPOLLIN, .data.ptr = &w->done};
+            w->done.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (w->done.wake_fd < 0 ||
+                epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->done.wake_fd, &wake) < 0) {
+                perror("eventfd");
+                if (w->done.wake_fd >= 0) {
+                    close(w->done.wake_fd);
+                }
+                close(w->epoll_fd);
+                if (w->listen_fd != server_fd) {
+                    close(w->listen_fd);
+                }
+                break;
+            }
+        }
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (w->cpu >= 0) {
+            worker_attr(&attr, w->cpu);
+        }
+        int err = pthread_create(&w->thread, &attr, worker_thread, w);
+        pthread_attr_destroy(&attr);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            if (w->done.wake_fd >= 0) {
+                close(w->done.wake_fd);
+            }
+            close(w->epoll_fd);
+            if (w->listen_fd != server_fd) {
+                close(w->listen_fd);
+            }
+            break;
+        }
+        started++;
+    }
+    if (started < num_workers && workers[started]) {
+        worker_free(workers[started]);
+    }
+
+    if (started == 0) {
+        offload_stop();
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        return -1;
+    }
+
+    printf("Event loop: %d worker%s%s%s%s\n", started, started == 1 ? "" : "s",
+           use_io_uring ? ", io_uring" : "",
+           reuseport_listeners ? ", SO_REUSEPORT listeners" : "",
+           pin_workers ? ", pinned to CPUs" : "");
+    if (offload_started) {
+        printf("Offload pool: %d thread%s for blocking handlers\n", offload_started,
+               offload_started == 1 ? "" : "s");
+    }
+    upgrade_notify();
+
+    /*
+     * Sleep until a signal: reload on SIGHUP, upgrade on SIGUSR2, stop on
+     * SIGINT or SIGTERM. On SIGQUIT the workers drain and exit by themselves.
+     */
+    while (keep_running && !draining) {
+        sigsuspend(&old_mask);
+        if (reload_requested) {
+            reload_requested = 0;
+            config_reload();
+        }
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            upgrade_spawn();
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (keep_running) {
+        printf("Draining: no longer accepting, closing connections as they finish\n");
+        fflush(stdout);
+    }
 
-    if (!handle_dynamic_route(&req, &res)) {
-        serve_static_file(path, &res);
+    /* Workers drain their offloaded handlers before exiting, so the pool is idle */
+    for (int i = 0; i < started; i++) {
+        worker_t *w = workers[i];
+        pthread_join(w->thread, NULL);
+        close(w->epoll_fd);
+        if (w->done.wake_fd >= 0) {
+            close(w->done.wake_fd);
+        }
+        if (w->listen_fd != server_fd) {
+            close(w->listen_fd);
+        }
+        worker_free(w);
     }
+    offload_stop();
 
-    write(client_fd, res.data, res.size);
-    response_free(&res);
+    return 0;
 }
+#endif
 
-/* Thread function to handle client connection */
-static void *client_thread(void *arg) {
-    client_info_t *client = (client_info_t *)arg;
+#ifdef HAVE_OPENSSL
+/* ALPN: offer HTTP/1.1, the only protocol spoken here */
+static int tls_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *out_len,
+                           const unsigned char *in, unsigned int in_len, void *arg) {
+    static const unsigned char http11[] = "\x08http/1.1";
+    unsigned char *selected;
+    (void)ssl;
+    (void)arg;
+
+    if (SSL_select_next_proto(&selected, out_len, http11, sizeof(http11) - 1, in, in_len) !=
+        OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
 
-    handle_request(client->client_fd);
+/*
+ * Build a server context for the certificate chain and key, both PEM.
+ * Sessions resume from a server-side cache or from tickets; a context
+ * replacing old takes over its ticket keys, so tickets issued before a
+ * reload still resume. kTLS is requested and used whenever the kernel
+ * and the negotiated cipher allow it. Returns NULL after reporting why.
+ */
+static SSL_CTX *tls_ctx_build(const char *cert, const char *key, SSL_CTX *old) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        goto fail;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE
+#ifdef SSL_OP_ENABLE_KTLS
+                             | SSL_OP_ENABLE_KTLS
+#endif
+                        );
+    /* Partial writes let a short write of a large response resume like send() */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1) {
+        fprintf(stderr, "%s: cannot load the certificate chain\n", cert);
+        goto fail;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        fprintf(stderr, "%s: cannot load a private key matching %s\n", key, cert);
+        goto fail;
+    }
 
-    close(client->client_fd);
-    free(client);
+    static const unsigned char session_context[] = "server";
+    SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    if (old) {
+        unsigned char keys[80];
+        if (SSL_CTX_get_tlsext_ticket_keys(old, keys, sizeof(keys)) > 0) {
+            SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys));
+        }
+    }
+    SSL_CTX_set_alpn_select_cb(ctx, tls_alpn_select, NULL);
+    return ctx;
 
+fail:
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
     return NULL;
 }
+#endif
 
 /* Start server and accept connections */
-static int run_server(int port) {
-    struct sockaddr_in address;
-    int opt = 1;
-
+static int run_server(int port, int num_workers) {
+    /* No SA_RESTART, so these interrupt the threaded accept loop */
+    struct sigaction reload = {.sa_handler = reload_handler};
+    struct sigaction upgrade = {.sa_handler = upgrade_handler};
+    struct sigaction drain = {.sa_handler = drain_handler};
+    sigemptyset(&reload.sa_mask);
+    sigemptyset(&upgrade.sa_mask);
+    sigemptyset(&drain.sa_mask);
+    sigaction(SIGHUP, &reload, NULL);
+    sigaction(SIGUSR2, &upgrade, NULL);
+    sigaction(SIGQUIT, &drain, NULL);
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGPIPE, SIG_IGN);
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("socket");
+    http_scanner_init();
+    file_cache_init();
+    /* Publish a Date line before workers can race for the first one */
+    date_header();
+    if (routes_init() < 0) {
+        fprintf(stderr, "Failed to build route responses\n");
         return EXIT_FAILURE;
     }
 
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt");
-        close(server_fd);
+    listeners_inherit();
+    server_fd = listener_open(0, port, num_workers > 0 && reuseport_listeners);
+    if (server_fd < 0) {
         return EXIT_FAILURE;
     }
 
-    memset(&address, 0, sizeof(address));
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+    if (inherited_listeners > 0) {
+        struct sockaddr_in bound;
+        socklen_t bound_len = sizeof(bound);
+        if (getsockname(server_fd, (struct sockaddr *)&bound, &bound_len) == 0 &&
+            bound.sin_family == AF_INET) {
+            port = ntohs(bound.sin_port);
+        }
+        printf("Server listening on port %d (%d inherited socket%s)\n", port,
+               inherited_listeners, inherited_listeners == 1 ? "" : "s");
+    } else {
+        printf("Server listening on port %d\n", port);
+    }
+    printf("Document root: %s\n", document_root);
+#ifdef HAVE_OPENSSL
+    if (tls_ctx) {
+        printf("TLS: on, with kTLS offload where the kernel supports it\n");
+    }
+#endif
+    printf("Header scanner: %s\n", http_scanner.name);
+    printf("Compression: sidecars%s%s\n",
+           compress_static && compress_body_available(CODING_BR) ? ", br" : "",
+           compress_static && compress_body_available(CODING_GZIP) ? ", gzip" : "");
+    if (max_connections > 0) {
+        printf("Limits: %d connections, %ds request timeout, backlog %d\n", max_connections,
+               request_timeout, listen_backlog);
+    } else {
+        printf("Limits: unlimited connections, %ds request timeout, backlog %d\n",
+               request_timeout, listen_backlog);
+    }
+    if (access_log_every > 0) {
+        printf("Access log: %s, 1 in %d requests\n", access_log_path, access_log_every);
+    }
+    printf("Press Ctrl+C to shutdown, send SIGHUP to reload the configuration,\n"
+           "SIGUSR2 to upgrade in place, SIGQUIT to drain and exit\n");
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind");
-        close(server_fd);
-        return EXIT_FAILURE;
+#ifdef HAVE_EPOLL
+    if (num_workers > 0) {
+        if (run_event_loop(port, num_workers) < 0) {
+            close(server_fd);
+            return EXIT_FAILURE;
+        }
+    } else {
+        run_threaded();
     }
+#else
+    (void)num_workers;
+    run_threaded();
+#endif
 
-    if (listen(server_fd, LISTEN_BACKLOG) < 0) {
-        perror("listen");
-        close(server_fd);
-        return EXIT_FAILURE;
+    close(server_fd);
+    access_log_stop();
+    printf("\nServer shutdown complete\n");
+
+    return EXIT_SUCCESS;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-f config] [-w workers] [-t] [-k seconds] [-r requests] [-c MB] [-R] [-A]\n"
+                    "       [-U] [-z] [-m] [-b threads] [-C connections] [-T seconds] [-q backlog]\n"
+                    "       [-B bytes] [-D seconds] [-d root] [-L file] [-S N] [-E cert] [-K key]\n"
+                    "       [port]\n", prog);
+    fprintf(stderr, "  -f F  read settings from F first; flags override it (see server.conf)\n");
+    fprintf(stderr, "  -w N  number of event-loop worker threads (default: CPU count)\n");
+    fprintf(stderr, "  -t    use one thread per connection instead of the event loop\n");
+    fprintf(stderr, "  -k N  keep-alive idle timeout in seconds, 0 disables (default: %d)\n",
+            KEEPALIVE_TIMEOUT);
+    fprintf(stderr, "  -r N  max requests per connection (default: %d)\n",
+            KEEPALIVE_MAX_REQUESTS);
+    fprintf(stderr, "  -c N  static file cache size in MB, 0 disables (default: %d)\n",
+            FILE_CACHE_SIZE_MB);
+    fprintf(stderr, "  -R    give each worker its own SO_REUSEPORT listening socket\n");
+    fprintf(stderr, "  -A    pin workers to CPUs (with -R, also steer by SO_INCOMING_CPU)\n");
+    fprintf(stderr, "  -U    run workers on io_uring instead of epoll (Linux 6.1+)\n");
+    fprintf(stderr, "  -z    compress cached text files once per coding (needs make COMPRESS=1)\n");
+    fprintf(stderr, "  -m    serve cached files from shared mappings instead of heap copies\n");
+    fprintf(stderr, "  -b N  threads running blocking handlers off the event loop, 0 runs them\n"
+                    "        inline (default: %d)\n", OFFLOAD_THREADS);
+    fprintf(stderr, "  -C N  max open connections, beyond which new ones get 503; 0 is unlimited\n"
+                    "        (default: %d)\n", MAX_CONNECTIONS);
+    fprintf(stderr, "  -T N  seconds a request head may take to arrive, and a body read or\n"
+                    "        response write may stall, before 408 or close; 0 disables (default: %d)\n",
+            REQUEST_TIMEOUT);
+    fprintf(stderr, "  -q N  listen backlog (default: %d)\n", LISTEN_BACKLOG);
+    fprintf(stderr, "  -B N  per-connection read buffer, bounding a request head (default: %d)\n",
+            BUFFER_SIZE);
+    fprintf(stderr, "  -D N  seconds a drain waits for open connections, 0 waits for all\n"
+                    "        (default: %d)\n", DRAIN_TIMEOUT);
+    fprintf(stderr, "  -d D  document root (default: %s)\n", DOCUMENT_ROOT);
+    fprintf(stderr, "  -L F  append an access log to F, - for stdout (default: none)\n");
+    fprintf(stderr, "  -S N  log one request in N (default: 1)\n");
+    fprintf(stderr, "  -E F  serve HTTPS with the PEM certificate chain in F (needs make TLS=1)\n");
+    fprintf(stderr, "  -K F  PEM private key for -E (default: the -E file)\n");
+    fprintf(stderr, "SIGHUP rereads the config file and flags and applies what can change live.\n");
+    fprintf(stderr, "SIGUSR2 starts the binary again on the same listening sockets, then the old\n"
+                    "process drains; SIGQUIT drains and exits. LISTEN_FDS sockets are used if given.\n");
+}
+
+/* Every setting the config file and the command line can give */
+typedef struct {
+    int port;
+    int workers;
+    int threaded;
+    int keepalive_timeout;
+    int max_requests;
+    int cache_mb;
+    int reuseport;
+    int pin_workers;
+    int io_uring;
+    int compress;
+    int mmap;
+    int offload_threads;
+    int max_connections;
+    int request_timeout;
+    int listen_backlog;
+    int buffer_size;
+    int drain_timeout;
+    int log_sample;
+    char document_root[MAX_PATH_SIZE];
+    char access_log[MAX_PATH_SIZE];
+    char tls_cert[MAX_PATH_SIZE];
+    char tls_key[MAX_PATH_SIZE];
+    mime_type_t *mime;   /* config-file types, NULL-terminated once loaded */
+    size_t num_mime;
+} settings_t;
+
+/* Kinds of setting values */
+enum {
+    SETTING_INT,
+    SETTING_FLAG,
+    SETTING_STRING
+};
+
+/*
+ * Setting definition: its config-file key, the flag setting it (0 if
+ * none), where it lives in settings_t, and whether a reload applies it
+ * to the running server or it only takes effect on restart.
+ */
+typedef struct {
+    const char *name;
+    int flag;
+    int kind;
+    long min;
+    long max;
+    size_t offset;
+    int reloadable;
+} setting_def_t;
+
+#define SETTING_AT(field) offsetof(settings_t, field)
+
+static const setting_def_t setting_defs[] = {
+    {"port", 0, SETTING_INT, 1, 65535, SETTING_AT(port), 0},
+    {"workers", 'w', SETTING_INT, 1, MAX_WORKERS, SETTING_AT(workers), 0},
+    {"threaded", 't', SETTING_FLAG, 0, 1, SETTING_AT(threaded), 0},
+    {"keepalive_timeout", 'k', SETTING_INT, 0, INT_MAX, SETTING_AT(keepalive_timeout), 1},
+    {"max_requests", 'r', SETTING_INT, 1, INT_MAX, SETTING_AT(max_requests), 1},
+    {"cache_mb", 'c', SETTING_INT, 0, 1 << 20, SETTING_AT(cache_mb), 1},
+    {"reuseport", 'R', SETTING_FLAG, 0, 1, SETTING_AT(reuseport), 0},
+    {"pin_workers", 'A', SETTING_FLAG, 0, 1, SETTING_AT(pin_workers), 0},
+    {"io_uring", 'U', SETTING_FLAG, 0, 1, SETTING_AT(io_uring), 0},
+    {"compress", 'z', SETTING_FLAG, 0, 1, SETTING_AT(compress), 1},
+    {"mmap", 'm', SETTING_FLAG, 0, 1, SETTING_AT(mmap), 1},
+    {"offload_threads", 'b', SETTING_INT, 0, MAX_OFFLOAD_THREADS, SETTING_AT(offload_threads), 0},
+    {"max_connections", 'C', SETTING_INT, 0, INT_MAX, SETTING_AT(max_connections), 1},
+    {"request_timeout", 'T', SETTING_INT, 0, INT_MAX, SETTING_AT(request_timeout), 1},
+    {"listen_backlog", 'q', SETTING_INT, 1, INT_MAX, SETTING_AT(listen_backlog), 0},
+    {"buffer_size", 'B', SETTING_INT, 1024, 1 << 20, SETTING_AT(buffer_size), 0},
+    {"drain_timeout", 'D', SETTING_INT, 0, INT_MAX, SETTING_AT(drain_timeout), 1},
+    {"document_root", 'd', SETTING_STRING, 1, MAX_PATH_SIZE - 1, SETTING_AT(document_root), 1},
+    {"access_log", 'L', SETTING_STRING, 0, MAX_PATH_SIZE - 1, SETTING_AT(access_log), 1},
+    {"log_sample", 'S', SETTING_INT, 1, INT_MAX, SETTING_AT(log_sample), 1},
+    {"tls_cert", 'E', SETTING_STRING, 0, MAX_PATH_SIZE - 1, SETTING_AT(tls_cert), 1},
+    {"tls_key", 'K', SETTING_STRING, 0, MAX_PATH_SIZE - 1, SETTING_AT(tls_key), 1},
+    {NULL, 0, 0, 0, 0, 0, 0}
+};
+
+/* Settings the server is running with, to tell a reload what changed */
+static settings_t active_settings;
+
+/* Built-in defaults */
+static void settings_defaults(settings_t *s) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    memset(s, 0, sizeof(*s));
+    s->port = DEFAULT_PORT;
+    s->workers = cpus <= 0 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : (int)cpus;
+    s->keepalive_timeout = KEEPALIVE_TIMEOUT;
+    s->max_requests = KEEPALIVE_MAX_REQUESTS;
+    s->cache_mb = FILE_CACHE_SIZE_MB;
+    s->offload_threads = OFFLOAD_THREADS;
+    s->max_connections = MAX_CONNECTIONS;
+    s->request_timeout = REQUEST_TIMEOUT;
+    s->listen_backlog = LISTEN_BACKLOG;
+    s->buffer_size = BUFFER_SIZE;
+    s->drain_timeout = DRAIN_TIMEOUT;
+    s->log_sample = 1;
+    snprintf(s->document_root, sizeof(s->document_root), "%s", DOCUMENT_ROOT);
+}
+
+/* Free the config-file MIME types of settings that were not applied */
+static void settings_free(settings_t *s) {
+    for (size_t i = 0; i < s->num_mime; i++) {
+        free((char *)s->mime[i].extension);
+        free((char *)s->mime[i].mime_type);
     }
+    free(s->mime);
+    s->mime = NULL;
+    s->num_mime = 0;
+}
 
-    printf("Server listening on port %d\n", port);
-    printf("Document root: %s\n", DOCUMENT_ROOT);
-    printf("Press Ctrl+C to shutdown\n");
+/*
+ * Add a config-file type: "mime = .ext type [compress] [revalidate|day|week]".
+ * Returns NULL or what is wrong with the value.
+ */
+static const char *settings_add_mime(settings_t *s, char *value) {
+    char *save;
+    char *ext = strtok_r(value, " \t", &save);
+    char *type = ext ? strtok_r(NULL, " \t", &save) : NULL;
+    if (!ext || ext[0] != '.' || !type) {
+        return "expected .extension type [compress] [revalidate|day|week]";
+    }
 
-    while (keep_running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
+    mime_type_t mt = {NULL, NULL, 0, NULL};
+    for (char *opt = strtok_r(NULL, " \t", &save); opt; opt = strtok_r(NULL, " \t", &save)) {
+        if (strcmp(opt, "compress") == 0) {
+            mt.compressible = 1;
+        } else if (strcmp(opt, "revalidate") == 0) {
+            mt.cache_control = CACHE_REVALIDATE;
+        } else if (strcmp(opt, "day") == 0) {
+            mt.cache_control = CACHE_DAY;
+        } else if (strcmp(opt, "week") == 0) {
+            mt.cache_control = CACHE_WEEK;
+        } else {
+            return "unknown type option";
+        }
+    }
 
-        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+    /* One spare slot is kept for the terminator */
+    mime_type_t *grown = realloc(s->mime, (s->num_mime + 2) * sizeof(mime_type_t));
+    if (!grown) {
+        return "out of memory";
+    }
+    s->mime = grown;
+    mt.extension = strdup(ext);
+    mt.mime_type = strdup(type);
+    if (!mt.extension || !mt.mime_type) {
+        free((char *)mt.extension);
+        free((char *)mt.mime_type);
+        return "out of memory";
+    }
+    s->mime[s->num_mime++] = mt;
+    memset(&s->mime[s->num_mime], 0, sizeof(mime_type_t));
+    return NULL;
+}
 
-        if (client_fd < 0) {
-            if (!keep_running) {
-                break;
+/* Set one setting from its text form; returns NULL or what is wrong */
+static const char *settings_set(settings_t *s, const char *key, char *value) {
+    if (strcmp(key, "mime") == 0) {
+        return settings_add_mime(s, value);
+    }
+
+    for (const setting_def_t *def = setting_defs; def->name; def++) {
+        if (strcmp(def->name, key) != 0) {
+            continue;
+        }
+        char *field = (char *)s + def->offset;
+
+        if (def->kind == SETTING_STRING) {
+            size_t len = strlen(value);
+            if ((long)len < def->min || (long)len > def->max) {
+                return "invalid length";
             }
-            if (errno == EINTR) {
-                continue;
+            memcpy(field, value, len + 1);
+            return NULL;
+        }
+
+        long n;
+        if (def->kind == SETTING_FLAG &&
+            (strcmp(value, "on") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "true") == 0)) {
+            n = 1;
+        } else if (def->kind == SETTING_FLAG &&
+                   (strcmp(value, "off") == 0 || strcmp(value, "no") == 0 ||
+                    strcmp(value, "false") == 0)) {
+            n = 0;
+        } else {
+            char *end;
+            errno = 0;
+            n = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || errno != 0) {
+                return "not a number";
             }
-            perror("accept");
-            continue;
         }
+        if (n < def->min || n > def->max) {
+            return "out of range";
+        }
+        *(int *)(void *)field = (int)n;
+        return NULL;
+    }
+    return "unknown setting";
+}
 
-        client_info_t *client = malloc(sizeof(client_info_t));
-        if (!client) {
-            close(client_fd);
+/* Strip leading and trailing whitespace in place */
+static char *trim_space(char *str) {
+    while (isspace((unsigned char)*str)) {
+        str++;
+    }
+    size_t len = strlen(str);
+    while (len > 0 && isspace((unsigned char)str[len - 1])) {
+        str[--len] = '\0';
+    }
+    return str;
+}
+
+/*
+ * Read "key = value" lines into s. Blank lines and lines starting with
+ * '#' are skipped. Every bad line is reported before failing.
+ */
+static int settings_load_file(settings_t *s, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    char line[1024];
+    int lineno = 0;
+    int status = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *key = trim_space(line);
+        if (*key == '\0' || *key == '#') {
+            continue;
+        }
+        char *eq = strchr(key, '=');
+        if (!eq) {
+            fprintf(stderr, "%s:%d: expected key = value\n", path, lineno);
+            status = -1;
             continue;
         }
+        *eq = '\0';
+        key = trim_space(key);
+        char *value = trim_space(eq + 1);
+        const char *error = settings_set(s, key, value);
+        if (error) {
+            fprintf(stderr, "%s:%d: %s: %s\n", path, lineno, key, error);
+            status = -1;
+        }
+    }
+    fclose(f);
+    return status;
+}
+
+/*
+ * Build settings from the defaults, then the config file named by -f,
+ * then the other flags and the port operand, so the command line wins.
+ * Returns -1 after reporting the problem; 1 if usage should be shown.
+ */
+static int settings_parse(int argc, char **argv, settings_t *s) {
+    char flags[64] = "f:";
+    size_t n = 2;
+    int opt;
+
+    for (const setting_def_t *def = setting_defs; def->name; def++) {
+        if (def->flag) {
+            flags[n++] = (char)def->flag;
+            if (def->kind != SETTING_FLAG) {
+                flags[n++] = ':';
+            }
+        }
+    }
+    flags[n] = '\0';
 
-        client->client_fd = client_fd;
-        client->client_addr = client_addr;
+    settings_defaults(s);
 
-        pthread_t thread;
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    /* The file comes first whatever its position among the flags */
+    opterr = 0;
+    optind = 1;
+    config_path = NULL;
+    while ((opt = getopt(argc, argv, flags)) != -1) {
+        if (opt == 'f') {
+            config_path = optarg;
+        }
+    }
+    if (config_path && settings_load_file(s, config_path) < 0) {
+        settings_free(s);
+        return -1;
+    }
 
-        if (pthread_create(&thread, &attr, client_thread, client) != 0) {
-            perror("pthread_create");
-            close(client_fd);
-            free(client);
+    opterr = 1;
+    optind = 1;
+    while ((opt = getopt(argc, argv, flags)) != -1) {
+        if (opt == 'f') {
+            continue;
+        }
+        const setting_def_t *def = setting_defs;
+        while (def->name && def->flag != opt) {
+            def++;
+        }
+        if (!def->name) {
+            settings_free(s);
+            return 1;
+        }
+        char on[] = "1";
+        const char *error = settings_set(s, def->name, def->kind == SETTING_FLAG ? on : optarg);
+        if (error) {
+            fprintf(stderr, "Invalid -%c %s: %s\n", opt, optarg, error);
+            settings_free(s);
+            return -1;
         }
+    }
 
-        pthread_attr_destroy(&attr);
+    if (optind < argc && settings_set(s, "port", argv[optind])) {
+        fprintf(stderr, "Invalid port number: %s\n", argv[optind]);
+        settings_free(s);
+        return -1;
     }
+    return 0;
+}
 
-    close(server_fd);
-    printf("\nServer shutdown complete\n");
+/*
+ * Make settings current. At startup everything is applied; on reload only
+ * the reloadable settings are, and the rest are reported as needing a
+ * restart. Ownership of s->mime passes to the running server.
+ */
+static void settings_apply(settings_t *s, int startup) {
+    if (startup) {
+        reuseport_listeners = s->reuseport;
+        pin_workers = s->pin_workers;
+        offload_threads = s->offload_threads;
+        listen_backlog = s->listen_backlog;
+        read_buffer_size = (size_t)s->buffer_size;
+        if (s->io_uring) {
+#ifdef HAVE_IO_URING
+            use_io_uring = 1;
+#else
+            fprintf(stderr, "io_uring is not available in this build\n");
+#endif
+        }
+    } else {
+        for (const setting_def_t *def = setting_defs; def->name; def++) {
+            size_t size = def->kind == SETTING_STRING ? MAX_PATH_SIZE : sizeof(int);
+            if (!def->reloadable &&
+                memcmp((char *)s + def->offset, (char *)&active_settings + def->offset, size) != 0) {
+                fprintf(stderr, "Reload: %s changed; it takes effect on restart\n", def->name);
+            }
+        }
+    }
 
-    return EXIT_SUCCESS;
+#if !defined(HAVE_ZLIB) && !defined(HAVE_BROTLI)
+    if (s->compress && (startup || !active_settings.compress)) {
+        fprintf(stderr, "Compression is not available in this build\n");
+    }
+#endif
+
+    __atomic_store_n(&keepalive_timeout, s->keepalive_timeout, __ATOMIC_RELAXED);
+    __atomic_store_n(&keepalive_max_requests, s->max_requests, __ATOMIC_RELAXED);
+    __atomic_store_n(&max_connections, s->max_connections, __ATOMIC_RELAXED);
+    __atomic_store_n(&request_timeout, s->request_timeout, __ATOMIC_RELAXED);
+    __atomic_store_n(&drain_timeout, s->drain_timeout, __ATOMIC_RELAXED);
+    __atomic_store_n(&mmap_static, s->mmap, __ATOMIC_RELAXED);
+#if defined(HAVE_ZLIB) || defined(HAVE_BROTLI)
+    __atomic_store_n(&compress_static, s->compress, __ATOMIC_RELAXED);
+#endif
+    __atomic_store_n(&file_cache_size, (size_t)s->cache_mb * 1024 * 1024, __ATOMIC_RELAXED);
+
+    if (startup || strcmp(s->document_root, active_settings.document_root) != 0) {
+        char *root = strdup(s->document_root);
+        if (root) {
+            __atomic_store_n(&document_root, root, __ATOMIC_RELEASE);
+        }
+    }
+    /* Every reload reopens the log, so a rotated file is let go */
+    if (startup || strcmp(s->access_log, active_settings.access_log) != 0) {
+        char *path = strdup(s->access_log);
+        if (path) {
+            __atomic_store_n(&access_log_path, path, __ATOMIC_RELEASE);
+        }
+    }
+    if (s->access_log[0] || log_thread_running) {
+        access_log_reopen();
+    }
+    __atomic_store_n(&access_log_every, s->access_log[0] && log_thread_running ? s->log_sample : 0,
+                     __ATOMIC_RELAXED);
+#ifdef HAVE_OPENSSL
+    /* The files are reread on every reload, so a renewed certificate is picked up */
+    if (!startup && !s->tls_cert[0] != !tls_ctx) {
+        fprintf(stderr, "Reload: tls_cert turns TLS on or off; it takes effect on restart\n");
+    } else if (s->tls_cert[0]) {
+        SSL_CTX *ctx = tls_ctx_build(s->tls_cert, s->tls_key[0] ? s->tls_key : s->tls_cert,
+                                     tls_ctx);
+        if (ctx) {
+            __atomic_store_n(&tls_ctx, ctx, __ATOMIC_RELEASE);
+        } else if (!startup) {
+            fprintf(stderr, "Reload: keeping the current TLS certificate\n");
+        }
+    }
+#else
+    if (startup && s->tls_cert[0]) {
+        fprintf(stderr, "TLS is not available in this build\n");
+    }
+#endif
+    if (startup || s->mime || active_settings.mime) {
+        mime_index_t *ix = mime_index_build(s->mime);
+        if (ix) {
+            __atomic_store_n(&mime_index, ix, __ATOMIC_RELEASE);
+        } else {
+            fprintf(stderr, "Out of memory building the MIME type index\n");
+        }
+    }
+
+    active_settings = *s;
+    s->mime = NULL;
+    s->num_mime = 0;
+}
+
+/*
+ * SIGHUP: rebuild the settings from the config file and the original
+ * flags and apply them. Connections stay open; each request uses the
+ * settings current when it reads them. A file with errors changes nothing.
+ */
+static void config_reload(void) {
+    settings_t s;
+
+    if (settings_parse(config_argc, config_argv, &s) != 0) {
+        fprintf(stderr, "Reload failed; keeping the current settings\n");
+        return;
+    }
+    settings_apply(&s, 0);
+    printf("Reloaded configuration%s%s\n", config_path ? " from " : "",
+           config_path ? config_path : "");
+    file_cache_rewarm();
+    fflush(stdout);
 }
 
 int main(int argc, char *argv[]) {
-    int port = DEFAULT_PORT;
+    settings_t s;
 
-    if (argc > 1) {
-        port = atoi(argv[1]);
-        if (port <= 0 || port > 65535) {
-            fprintf(stderr, "Invalid port number: %s\n", argv[1]);
-            return EXIT_FAILURE;
+    int r = settings_parse(argc, argv, &s);
+    if (r != 0) {
+        if (r > 0) {
+            usage(argv[0]);
         }
+        return EXIT_FAILURE;
+    }
+    config_argc = argc;
+    config_argv = argv;
+    /* Started through $PATH there is no path to the new binary; reuse our image */
+    upgrade_exe = strchr(argv[0], '/') ? argv[0] : "/proc/self/exe";
+    settings_apply(&s, 1);
+    /* Never fall back to plain HTTP where HTTPS was asked for */
+#ifdef HAVE_OPENSSL
+    if (active_settings.tls_cert[0] && !tls_ctx) {
+#else
+    if (active_settings.tls_cert[0]) {
+#endif
+        return EXIT_FAILURE;
     }
 
-    return run_server(port);
+    return run_server(active_settings.port, active_settings.threaded ? 0 : active_settings.workers);
 }